@@ -22,10 +22,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <memory>
 #include <type_traits>
 #include <vector>
 
 #include "Event.hpp"
+#include "Log.hpp"
 
 struct AudioCue
 {
@@ -34,13 +36,50 @@ struct AudioCue
     NoteOn,
     NoteOff,
     NoiseStart,
-    NoiseEnd
+    NoiseEnd,
+    Patch       /* Start of a patch in a batch session; value is its index. */
   };
 
   size_t frame;
   Type type;
   int value;
 
+  /* Note cue values hold the note, the velocity layer, and the round robin
+   * take (1-based). Velocity and take are 0 unless layers or round robins
+   * were recorded. */
+  static constexpr int note_value(unsigned note, unsigned velocity = 0,
+   unsigned take = 0)
+  {
+    return note | (velocity << 8) | (take << 16);
+  }
+
+  static constexpr unsigned note_of(int value)
+  {
+    return value & 0xff;
+  }
+
+  static constexpr unsigned velocity_of(int value)
+  {
+    return (value >> 8) & 0xff;
+  }
+
+  static constexpr unsigned take_of(int value)
+  {
+    return (value >> 16) & 0xff;
+  }
+
+  /* Synths recorded in parallel tag their note cues with the synth they
+   * belong to (1-based); untagged cues (0) apply to every synth. */
+  static constexpr int synth_value(int value, unsigned synth)
+  {
+    return (value & 0xffffff) | (synth << 24);
+  }
+
+  static constexpr unsigned synth_of(int value)
+  {
+    return (value >> 24) & 0x7f;
+  }
+
   static constexpr const char *type_str(Type t)
   {
     switch(t)
@@ -49,6 +88,7 @@ struct AudioCue
     case NoteOff: return "NoteOff";
     case NoiseStart: return "NoiseStart";
     case NoiseEnd: return "NoiseEnd";
+    case Patch: return "Patch";
     }
     return "?";
   }
@@ -66,11 +106,28 @@ public:
   virtual bool write(const void *frames_i, size_t num_frames_i) = 0;
 };
 
+/* Notified after frames are written to an AudioBuffer. This is called from
+ * the capture callback, which may be a signal handler, so implementations
+ * must be async-signal-safe. */
+class AudioListener
+{
+public:
+  virtual ~AudioListener() {}
+  virtual void frames_written(size_t total_frames) = 0;
+};
+
 template<class T, class U=typename std::enable_if<std::is_integral<T>::value>::type>
 class AudioBuffer : public AudioInput
 {
   std::vector<T> samples;
   std::vector<AudioCue> cues;
+  std::shared_ptr<const void> external; /* Keeps a mapped sample view alive */
+  const T *view = nullptr;
+  size_t view_size = 0;
+  static constexpr size_t MAX_LISTENERS = 4;
+  AudioListener *listeners[MAX_LISTENERS]{};
+  uint64_t timeline_frame = 0;
+  bool timeline_set = false;
   size_t frames_left = 0;
   size_t frame = 0;
   size_t idx = 0;
@@ -93,6 +150,7 @@ public:
     if(new_size == samples.size())
       return;
 
+    external = nullptr;
     if(new_size < samples.size())
     {
       frames_left = 0;
@@ -103,6 +161,31 @@ public:
       frames_left = new_size - samples.size();
 
     samples.resize(new_size);
+    view = samples.data();
+    view_size = samples.size();
+  }
+
+  /**
+   * Use read-only external sample data (e.g. a memory mapped session)
+   * instead of the internal sample buffer. The buffer can't be written to
+   * afterward.
+   *
+   * @param data        Owner of the sample data.
+   * @param ptr         Interleaved samples in native byte order.
+   * @param num_frames  Number of frames of sample data.
+   * @param new_cues    Cues for the sample data.
+   */
+  void assign(std::shared_ptr<const void> data, const T *ptr, size_t num_frames,
+   std::vector<AudioCue> &&new_cues)
+  {
+    samples = std::vector<T>();
+    external = std::move(data);
+    view = ptr;
+    view_size = num_frames * channels;
+    cues = std::move(new_cues);
+    frame = num_frames;
+    idx = view_size;
+    frames_left = 0;
   }
 
   virtual bool write(const void *frames_i, size_t num_frames_i)
@@ -114,6 +197,9 @@ public:
       idx += num_frames_i * channels;
       frame += num_frames_i;
       frames_left -= num_frames_i;
+      for(AudioListener *l : listeners)
+        if(l)
+          l->frames_written(frame);
       return true;
     }
     return false;
@@ -124,7 +210,7 @@ public:
     for(size_t i = 0; i < cues.size(); i++)
     {
       size_t pos = cues[i].frame * channels;
-      if(pos > samples.size())
+      if(pos > view_size)
         continue;
 
       if(cues[i].type == AudioCue::NoteOn)
@@ -136,7 +222,7 @@ public:
         bound *= channels;
         for(; pos < bound; pos += channels)
           for(size_t smp = 0; smp < channels; smp++)
-            if(abs(samples[pos + smp]) >= threshold)
+            if(abs(view[pos + smp]) >= threshold)
               goto stop_on;
       stop_on:
         cues[i].frame = pos / channels;
@@ -152,7 +238,7 @@ public:
         bound *= channels;
         for(; pos > bound; pos -= channels)
           for(ssize_t smp = -(ssize_t)channels; smp < 0; smp++)
-            if(abs(samples[pos + smp]) >= threshold)
+            if(abs(view[pos + smp]) >= threshold)
               goto stop_off;
       stop_off:
         cues[i].frame = pos / channels;
@@ -160,6 +246,28 @@ public:
     }
   }
 
+  /* The sample buffer must not be resized while a listener is added.
+   * Listeners must be added and removed while capture is stopped. */
+  bool add_listener(AudioListener *l)
+  {
+    for(AudioListener *&slot : listeners)
+    {
+      if(!slot)
+      {
+        slot = l;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void remove_listener(AudioListener *l)
+  {
+    for(AudioListener *&slot : listeners)
+      if(slot == l)
+        slot = nullptr;
+  }
+
   void reserve_cues(unsigned n)
   {
     cues.reserve(n);
@@ -170,6 +278,27 @@ public:
     cues.push_back({ frame, type, value });
   }
 
+  /* Place a cue from its event time instead of when it is run. Only used
+   * once set_timeline() has given the frame at event time 0. */
+  void cue(AudioCue::Type type, int value, int64_t time_us)
+  {
+    if(!timeline_set || time_us < 0)
+    {
+      cue(type, value);
+      return;
+    }
+    size_t pos = timeline_frame +
+     static_cast<uint64_t>(time_us) * rate / 1000000;
+
+    cues.push_back({ pos, type, value });
+  }
+
+  void set_timeline(uint64_t start_frame)
+  {
+    timeline_frame = start_frame;
+    timeline_set = true;
+  }
+
   size_t frame_size() const
   {
     return channels * sizeof(T);
@@ -180,9 +309,9 @@ public:
     return frame;
   }
 
-  const std::vector<T> &get_samples() const
+  const T *get_samples() const
   {
-    return samples;
+    return view;
   }
 
   const std::vector<AudioCue> &get_cues() const
@@ -192,50 +321,57 @@ public:
 
   const T &operator[](size_t idx) const
   {
-    return samples[idx];
+    return view[idx];
   }
 };
 
 
 class AudioCueEvent
 {
-  template<class T>
-  class _AudioCueEvent : public Event
+  template<class T, bool has_value>
+  static void task(const Event &e, const uint8_t *data)
   {
-    AudioBuffer<T> &buffer;
-    AudioCue::Type type;
-    int value;
-    bool has_value;
+    /* Cue events only target buffers passed as non-const in schedule(). */
+    AudioBuffer<T> &buffer =
+     *const_cast<AudioBuffer<T> *>(static_cast<const AudioBuffer<T> *>(e.target));
+    AudioCue::Type type = static_cast<AudioCue::Type>(e.param);
 
-  public:
-    _AudioCueEvent(AudioBuffer<T> &_buffer, AudioCue::Type _type, int _time_ms):
-    Event(_time_ms), buffer(_buffer), type(_type), value(0), has_value(false) {}
-    _AudioCueEvent(AudioBuffer<T> &_buffer, AudioCue::Type _type, int _value, int _time_ms):
-    Event(_time_ms), buffer(_buffer), type(_type), value(_value), has_value(true) {}
+    if(has_value && AudioCue::synth_of(e.value))
+    {
+      Log::print(Log::INFO, "cue: %s = %u v%u rr%u synth %u\n", AudioCue::type_str(type),
+       AudioCue::note_of(e.value), AudioCue::velocity_of(e.value),
+       AudioCue::take_of(e.value), AudioCue::synth_of(e.value));
+    }
+    else
 
-    virtual void task() const
+    if(has_value && AudioCue::velocity_of(e.value))
     {
-      if(has_value)
-        fprintf(stderr, "cue: %s = %d\n", AudioCue::type_str(type), value);
-      else
-        fprintf(stderr, "cue: %s\n", AudioCue::type_str(type));
-      buffer.cue(type, value);
+      Log::print(Log::INFO, "cue: %s = %u v%u rr%u\n", AudioCue::type_str(type),
+       AudioCue::note_of(e.value), AudioCue::velocity_of(e.value),
+       AudioCue::take_of(e.value));
     }
-  };
+    else
+
+    if(has_value)
+      Log::print(Log::INFO, "cue: %s = %d\n", AudioCue::type_str(type), e.value);
+    else
+      Log::print(Log::INFO, "cue: %s\n", AudioCue::type_str(type));
+    buffer.cue(type, e.value, e.time_us);
+  }
 
 public:
   template<class T>
   static void schedule(EventSchedule &ev, AudioBuffer<T> &_buffer,
-   AudioCue::Type _type, int _time_ms)
+   AudioCue::Type _type, int64_t _time_us)
   {
-    ev.push(std::make_shared<_AudioCueEvent<T>>(_buffer, _type, _time_ms));
+    ev.push(_time_us, task<T, false>, &_buffer, _type, 0);
   }
 
   template<class T>
   static void schedule(EventSchedule &ev, AudioBuffer<T> &_buffer,
-   AudioCue::Type _type, int _val, int _time_ms)
+   AudioCue::Type _type, int _val, int64_t _time_us)
   {
-    ev.push(std::make_shared<_AudioCueEvent<T>>(_buffer, _type, _val, _time_ms));
+    ev.push(_time_us, task<T, true>, &_buffer, _type, _val);
   }
 };
 
@@ -0,0 +1,229 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AudioDump.hpp"
+#include "AudioFormat_Session.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Alignment of O_DIRECT buffers, offsets, and sizes. */
+static constexpr size_t DIRECT_ALIGN = 4096;
+
+static_assert(SessionFormat::DATA_ALIGN % DIRECT_ALIGN == 0,
+ "session data must be aligned for O_DIRECT");
+
+static bool pwrite_all(int fd, const uint8_t *data, size_t len, off_t pos)
+{
+  while(len)
+  {
+    ssize_t ret = pwrite(fd, data, len, pos);
+    if(ret < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    data += ret;
+    pos += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+AudioDump::AudioDump()
+{
+  sem_init(&sem, 0, 0);
+}
+
+AudioDump::~AudioDump()
+{
+  if(thread.joinable())
+  {
+    stop = true;
+    sem_post(&sem);
+    thread.join();
+  }
+  if(fd >= 0)
+    ::close(fd);
+
+  free(bounce);
+  sem_destroy(&sem);
+}
+
+bool AudioDump::open_file(const char *filename, bool use_direct,
+ const uint8_t *data, unsigned _channels, unsigned _rate, unsigned _sample_bytes)
+{
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  samples = data;
+  channels = _channels;
+  rate = _rate;
+  sample_bytes = _sample_bytes;
+  frame_size = channels * sample_bytes;
+  written = 0;
+  frames = 0;
+  stop = false;
+  error = false;
+
+  if(!bounce && posix_memalign(reinterpret_cast<void **>(&bounce),
+   DIRECT_ALIGN, BLOCK_SIZE))
+  {
+    bounce = nullptr;
+    return false;
+  }
+
+  direct = false;
+  if(use_direct)
+  {
+    fd = ::open(filename, flags | O_DIRECT, 0644);
+    if(fd >= 0)
+      direct = true;
+    else
+      fprintf(stderr, "dump: O_DIRECT unavailable for '%s': %s\n",
+       filename, strerror(errno));
+  }
+  if(fd < 0)
+    fd = ::open(filename, flags, 0644);
+
+  if(fd < 0)
+  {
+    fprintf(stderr, "dump: failed to open '%s': %s\n", filename, strerror(errno));
+    return false;
+  }
+
+  /* Unfinished header: no frame count or cues, so a crashed capture is
+   * recovered from the file size. */
+  uint8_t header[SessionFormat::HEADER_LENGTH];
+  SessionFormat::header(header, channels, rate, sample_bytes, 0, 0, 0);
+
+  memset(bounce, 0, SessionFormat::DATA_ALIGN);
+  memcpy(bounce, header, sizeof(header));
+  if(!pwrite_all(fd, bounce, SessionFormat::DATA_ALIGN, 0))
+  {
+    fprintf(stderr, "dump: error writing header: %s\n", strerror(errno));
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  thread = std::thread([this]() { run(); });
+  return true;
+}
+
+bool AudioDump::write_data(size_t bytes)
+{
+  const uint8_t *src = samples + written;
+  off_t pos = SessionFormat::DATA_ALIGN + written;
+
+  if(direct)
+  {
+    memcpy(bounce, src, bytes);
+    src = bounce;
+  }
+
+  if(!pwrite_all(fd, src, bytes, pos))
+  {
+    if(!error)
+      fprintf(stderr, "dump: write error: %s\n", strerror(errno));
+    error = true;
+    return false;
+  }
+  written += bytes;
+  return true;
+}
+
+void AudioDump::run()
+{
+  /* Leave signals (capture callback, abort) to the main thread. */
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  while(true)
+  {
+    while(sem_wait(&sem) < 0 && errno == EINTR);
+
+    if(stop)
+      break;
+
+    size_t available = frames.load(std::memory_order_acquire) * frame_size;
+    while(!error && available - written >= BLOCK_SIZE)
+      write_data(BLOCK_SIZE);
+  }
+}
+
+void AudioDump::frames_written(size_t total_frames)
+{
+  frames.store(total_frames, std::memory_order_release);
+  sem_post(&sem);
+}
+
+bool AudioDump::close_file(size_t total_frames, const std::vector<AudioCue> &cues)
+{
+  if(fd < 0)
+    return false;
+
+  if(thread.joinable())
+  {
+    stop = true;
+    sem_post(&sem);
+    thread.join();
+  }
+
+  /* Remaining full blocks, then the unaligned tail without O_DIRECT. */
+  size_t total = total_frames * frame_size;
+  while(!error && total - written >= BLOCK_SIZE)
+    write_data(BLOCK_SIZE);
+
+  if(direct)
+  {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+      error = true;
+    direct = false;
+  }
+  if(!error && total > written)
+    write_data(total - written);
+
+  std::vector<uint8_t> cue_data;
+  SessionFormat::cues(cue_data, cues);
+
+  uint64_t cue_offset = SessionFormat::DATA_ALIGN + total;
+  uint8_t header[SessionFormat::HEADER_LENGTH];
+  SessionFormat::header(header, channels, rate, sample_bytes, total_frames,
+   cue_offset, cues.size());
+
+  if(error ||
+   !pwrite_all(fd, cue_data.data(), cue_data.size(), cue_offset) ||
+   !pwrite_all(fd, header, sizeof(header), 0))
+  {
+    fprintf(stderr, "dump: failed to finish session file\n");
+    error = true;
+  }
+
+  if(::close(fd) < 0)
+    error = true;
+  fd = -1;
+  return !error;
+}
@@ -0,0 +1,106 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIODUMP_HPP
+#define AUDIODUMP_HPP
+
+#include "AudioBuffer.hpp"
+
+#include <atomic>
+#include <semaphore.h>
+#include <thread>
+
+/**
+ * Streams an AudioBuffer to a session file while it is being captured.
+ * The capture callback only posts a semaphore; a background thread writes
+ * completed blocks straight out of the (preallocated) buffer. If the
+ * program dies mid-capture, the samples written so far can be recovered
+ * with --reprocess. finish() writes the tail, the cue list, and the final
+ * header.
+ */
+class AudioDump : public AudioListener
+{
+  static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+  std::thread thread;
+  std::atomic<size_t> frames{0};
+  std::atomic<bool> stop{false};
+  sem_t sem;
+
+  const uint8_t *samples = nullptr;
+  size_t frame_size = 0;
+  unsigned channels = 0;
+  unsigned rate = 0;
+  unsigned sample_bytes = 0;
+
+  uint8_t *bounce = nullptr;
+  size_t written = 0;
+  bool direct = false;
+  bool error = false;
+  int fd = -1;
+
+  bool write_data(size_t bytes);
+  void run();
+
+public:
+  AudioDump();
+  ~AudioDump();
+
+  /**
+   * Start streaming a buffer to a session file. The buffer must already be
+   * allocated to its full size and must not be resized until finish().
+   *
+   * @param buffer      Buffer to dump; this registers itself as a listener.
+   * @param filename    Output session filename.
+   * @param use_direct  Bypass the page cache with O_DIRECT.
+   * @returns           `true` on success, otherwise `false`.
+   */
+  template<class T>
+  bool start(AudioBuffer<T> &buffer, const char *filename, bool use_direct)
+  {
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(buffer.get_samples());
+    if(!open_file(filename, use_direct, data, buffer.channels, buffer.rate, sizeof(T)))
+      return false;
+
+    if(!buffer.add_listener(this))
+    {
+      close_file(0, {});
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Stop streaming, write the remaining samples and cues, and finalize the
+   * session header.
+   */
+  template<class T>
+  bool finish(AudioBuffer<T> &buffer)
+  {
+    buffer.remove_listener(this);
+    return close_file(buffer.total_frames(), buffer.get_cues());
+  }
+
+  bool open_file(const char *filename, bool use_direct, const uint8_t *data,
+   unsigned channels, unsigned rate, unsigned sample_bytes);
+  bool close_file(size_t total_frames, const std::vector<AudioCue> &cues);
+
+  void frames_written(size_t total_frames) override;
+};
+
+#endif /* AUDIODUMP_HPP */
@@ -19,6 +19,10 @@
 #include "AudioFormat.hpp"
 
 #include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
 
 bool AudioFormat::write_file(const std::vector<uint8_t> &out,
  const char *filename)
@@ -50,6 +54,80 @@ bool AudioFormat::write_file(const void *out, size_t out_len,
   return false;
 }
 
+bool AudioFormat::run_parallel(size_t count,
+ const std::function<bool(size_t)> &job)
+{
+  std::atomic<size_t> next(0);
+  std::atomic<bool> ok(true);
+
+  auto worker = [&]()
+  {
+    size_t i;
+    while(ok && (i = next++) < count)
+    {
+      if(!job(i))
+        ok = false;
+    }
+  };
+
+  unsigned num_threads = std::max(1U, std::thread::hardware_concurrency());
+  if(num_threads > count)
+    num_threads = count;
+
+  std::vector<std::thread> threads;
+  for(unsigned i = 1; i < num_threads; i++)
+    threads.emplace_back(worker);
+
+  worker();
+  for(std::thread &t : threads)
+    t.join();
+
+  return ok;
+}
+
+void AudioFormat::build_keymap(uint8_t (&keymap)[NUM_KEYS * 2],
+ const std::vector<unsigned> &notes, unsigned first_sample, unsigned max_half_steps)
+{
+  memset(keymap, 0, sizeof(keymap));
+
+  /* Build initial keymap from notes with existing samples. */
+  for(size_t i = 0; i < notes.size(); i++)
+  {
+    unsigned idx = notes[i] * 2;
+    if(idx < sizeof(keymap) - 1)
+    {
+      keymap[idx + 0] = MIDIInterface::C4; /* = IT C5 */
+      keymap[idx + 1] = first_sample + i + 1;
+    }
+  }
+
+  /* Fill in unmapped keys by transposing up/down to the half steps limit. */
+  for(size_t i = 0; i < max_half_steps; i++)
+  {
+    for(size_t j = 0; j < 240; j += 2)
+    {
+      if(keymap[j + 1] == 0)
+      {
+        unsigned prev = (j > 0) ? keymap[j - 2 + 1] : 0;
+        unsigned next = (j < 238) ? keymap[j + 2 + 1] : 0;
+        if(prev)
+        {
+          keymap[j + 0] = std::min(119, keymap[j - 2] + 1);
+          keymap[j + 1] = keymap[j - 1];
+          j += 2; // Skip next gap
+        }
+        else
+
+        if(next)
+        {
+          keymap[j + 0] = std::max(0, keymap[j + 2] - 1);
+          keymap[j + 1] = keymap[j + 3];
+        }
+      }
+    }
+  }
+}
+
 bool AudioFormat::convert(ConfigContext &ctx,
  std::vector<uint8_t> &out, const AudioBuffer<uint8_t> &buffer,
  const AudioCue &start, const AudioCue &end) const
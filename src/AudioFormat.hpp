@@ -22,11 +22,33 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <vector>
 
 #include "AudioBuffer.hpp"
 #include "Midi.hpp"
 
+#include <functional>
+
+class ITIConfig : public ConfigInterface
+{
+public:
+  OptionString<25>  Name;
+  Option<unsigned>  MaxHalfSteps;
+  Option<unsigned>  MaxSamples;
+  OptionBool        Compression;
+
+  ITIConfig(ConfigContext &_ctx, const char *_tag, int _id):
+   ConfigInterface(_ctx, _tag, _id),
+   Name(options, "<default>", "Name"),
+   MaxHalfSteps(options, 3, 0, 120, "MaxHalfSteps"),
+   MaxSamples(options, 255, 1, 255, "MaxSamples"),
+   Compression(options, false, "Compression")
+  {}
+
+  virtual ~ITIConfig() {}
+};
+
 class AudioFormat
 {
   virtual bool convert(ConfigContext &ctx,
@@ -40,9 +62,216 @@ class AudioFormat
    const AudioCue &start, const AudioCue &end) const;
 
 protected:
+  static constexpr unsigned NUM_KEYS = 120;
+
+  struct Note
+  {
+    unsigned note;
+    size_t start;
+    size_t end;
+    unsigned velocity = 0;
+    unsigned take = 0;
+
+    size_t length() const
+    {
+      return end - start;
+    }
+  };
+
+  struct Instrument
+  {
+    size_t first;
+    size_t count;
+  };
+
+  struct Layer
+  {
+    size_t first;
+    size_t count;
+    unsigned lovel;
+    unsigned hivel;
+    unsigned take;
+  };
+
   static bool write_file(const std::vector<uint8_t> &out, const char *filename);
   static bool write_file(const void *out, size_t out_len, const char *filename);
 
+  /**
+   * Run a job for every index in [0, count) on a pool of worker threads.
+   * Stops handing out new indices after the first failed job.
+   *
+   * @param count   Number of jobs.
+   * @param job     Job function; returns `false` on failure.
+   * @returns       `true` if every job succeeded, otherwise `false`.
+   */
+  static bool run_parallel(size_t count, const std::function<bool(size_t)> &job);
+
+  /**
+   * Get all complete NoteOn/NoteOff cue pairs within an AudioBuffer.
+   *
+   * @param notes       Destination list of notes.
+   * @param buffer      AudioBuffer containing all note cues.
+   * @param max_notes   Maximum number of notes to return.
+   */
+  template<class N, class T>
+  static void get_notes(std::vector<N> &notes, const AudioBuffer<T> &buffer,
+   size_t max_notes = SIZE_MAX)
+  {
+    const std::vector<AudioCue> &cues = buffer.get_cues();
+    for(size_t i = 1; i < cues.size(); i++)
+    {
+      const AudioCue &on = cues[i - 1];
+      const AudioCue &off = cues[i];
+      if(on.type == AudioCue::NoteOn && off.type == AudioCue::NoteOff &&
+       on.value == off.value && on.frame < off.frame)
+      {
+        if(notes.size() >= max_notes)
+        {
+          fprintf(stderr, "note limit (%zu) reached, ignoring remaining notes\n",
+           max_notes);
+          break;
+        }
+        notes.push_back(Note{ AudioCue::note_of(on.value), on.frame, off.frame,
+         AudioCue::velocity_of(on.value), AudioCue::take_of(on.value) });
+        i++;
+      }
+    }
+  }
+
+  /**
+   * Split a list of notes into instruments. A new instrument starts
+   * whenever the (note, velocity, take) sequence restarts, i.e. when another
+   * patch sweep begins. The notes of each instrument are then reordered by
+   * velocity layer and round robin take so each layer is contiguous.
+   *
+   * @param instruments   Destination list of instruments.
+   * @param notes         List of all cued notes within an AudioBuffer.
+   */
+  template<class N>
+  static void get_instruments(std::vector<Instrument> &instruments,
+   std::vector<N> &notes)
+  {
+    auto sweep_order = [](const N &n)
+    {
+      return (n.note << 16) | (n.velocity << 8) | n.take;
+    };
+    auto layer_order = [](const N &n)
+    {
+      return (n.velocity << 16) | (n.take << 8) | n.note;
+    };
+
+    for(size_t i = 0; i < notes.size(); i++)
+    {
+      if(i == 0 || sweep_order(notes[i]) <= sweep_order(notes[i - 1]))
+        instruments.push_back({ i, 0 });
+
+      instruments.back().count++;
+    }
+
+    for(const Instrument &ins : instruments)
+    {
+      std::stable_sort(notes.begin() + ins.first, notes.begin() + ins.first + ins.count,
+       [&](const N &a, const N &b)
+       {
+         return layer_order(a) < layer_order(b);
+       });
+    }
+  }
+
+  /**
+   * Split the notes of an instrument (as ordered by get_instruments) into
+   * velocity layers/round robin takes. Each layer covers the velocities
+   * above the next softer layer up to its own; the loudest layer extends
+   * to 127.
+   *
+   * @param layers        Destination list of layers.
+   * @param notes         Notes of an instrument.
+   * @param num_notes     Number of notes of the instrument.
+   */
+  template<class N>
+  static void get_layers(std::vector<Layer> &layers, const N *notes, size_t num_notes)
+  {
+    unsigned prev_velocity = 0;
+    unsigned lovel = 0;
+    for(size_t i = 0; i < num_notes; i++)
+    {
+      const N &n = notes[i];
+      if(i == 0 || n.velocity != notes[i - 1].velocity || n.take != notes[i - 1].take)
+      {
+        if(n.velocity != prev_velocity)
+        {
+          lovel = prev_velocity ? prev_velocity + 1 : 0;
+          prev_velocity = n.velocity;
+        }
+        layers.push_back({ i, 0, lovel, n.velocity ? n.velocity : 127, n.take });
+      }
+      layers.back().count++;
+    }
+
+    unsigned top = layers.size() ? layers.back().hivel : 0;
+    for(Layer &l : layers)
+      if(l.hivel == top)
+        l.hivel = 127;
+  }
+
+  /**
+   * Remove round robin takes after the first, and optionally every velocity
+   * layer but the loudest, for formats that can't select between them.
+   *
+   * @param notes           List of notes.
+   * @param all_velocities  Keep every velocity layer.
+   */
+  template<class N>
+  static void filter_layers(std::vector<N> &notes, bool all_velocities)
+  {
+    unsigned top = 0;
+    for(const N &n : notes)
+      top = std::max(top, n.velocity);
+
+    notes.erase(std::remove_if(notes.begin(), notes.end(), [&](const N &n)
+    {
+      return n.take > 1 || (!all_velocities && n.velocity != top);
+    }), notes.end());
+  }
+
+  /**
+   * Build an IT-style keymap of (note, sample) pairs for a set of notes.
+   * Unmapped keys are filled in by transposing the nearest recorded note
+   * up/down to the half steps limit.
+   *
+   * @param keymap          Destination keymap.
+   * @param notes           List of recorded notes, one per sample.
+   * @param num_notes       Number of recorded notes.
+   * @param first_sample    Number of samples preceding these notes' samples.
+   * @param max_half_steps  Maximum distance to transpose a sample.
+   */
+  template<class N>
+  static void build_keymap(uint8_t (&keymap)[NUM_KEYS * 2],
+   const N *notes, size_t num_notes, unsigned first_sample, unsigned max_half_steps)
+  {
+    std::vector<unsigned> tmp(num_notes);
+    for(size_t i = 0; i < num_notes; i++)
+      tmp[i] = notes[i].note;
+
+    build_keymap(keymap, tmp, first_sample, max_half_steps);
+  }
+
+  static void build_keymap(uint8_t (&keymap)[NUM_KEYS * 2],
+   const std::vector<unsigned> &notes, unsigned first_sample, unsigned max_half_steps);
+
+  /**
+   * Get a name for a note for sample filenames and names, including the
+   * velocity layer and round robin take, if any (e.g. "C-4_v100_rr2").
+   */
+  static void note_name(char *dest, size_t dest_len, const Note &n)
+  {
+    int len = snprintf(dest, dest_len, "%s", MIDIInterface::get_note(n.note));
+    if(n.velocity && len >= 0 && (size_t)len < dest_len)
+      len += snprintf(dest + len, dest_len - len, "_v%u", n.velocity);
+    if(n.take && len >= 0 && (size_t)len < dest_len)
+      snprintf(dest + len, dest_len - len, "_rr%u", n.take);
+  }
+
 public:
 
   virtual bool save(ConfigContext &ctx,
@@ -66,6 +295,16 @@ public:
     return write_file(out, filename);
   }
 
+  virtual bool load(AudioBuffer<int16_t> &buffer, const char *filename) const
+  {
+    return false;
+  }
+
+  virtual bool load(AudioBuffer<int32_t> &buffer, const char *filename) const
+  {
+    return false;
+  }
+
   template<class T>
   bool save(ConfigContext &ctx, const AudioBuffer<T> &buffer,
    const char *filename) const
@@ -75,42 +314,47 @@ public:
     return save(ctx, buffer, start, end, filename);
   }
 
+  /**
+   * Save every cued note in a buffer to its own file. The last '%' in the
+   * filename is replaced with the note name. Files are written in parallel.
+   */
   template<class T>
   bool save_all(ConfigContext &ctx, const AudioBuffer<T> &buffer,
    const char *filename) const
   {
-    char name[512];
+    std::vector<Note> notes;
+    get_notes(notes, buffer);
 
-    const std::vector<AudioCue> &cues = buffer.get_cues();
     const char *pos = strrchr(filename, '%');
     int offset = pos ? pos - filename : strlen(filename);
     int offset2 = pos ? offset + 1 : offset;
 
-    for(size_t i = 1; i < cues.size(); i++)
+    return run_parallel(notes.size(), [&](size_t i)
     {
-      const AudioCue &on = cues[i - 1];
-      const AudioCue &off = cues[i];
-      if(on.type == AudioCue::NoteOn && off.type == AudioCue::NoteOff &&
-       on.value == off.value)
-      {
-        const char *note = MIDIInterface::get_note(on.value);
-        snprintf(name, sizeof(name), "%*.*s%s%s",
-         offset, offset, filename, note, filename + offset2);
+      char name[512];
+      const Note &n = notes[i];
+      int value = AudioCue::note_value(n.note, n.velocity, n.take);
+      AudioCue on{ n.start, AudioCue::NoteOn, value };
+      AudioCue off{ n.end, AudioCue::NoteOff, value };
 
-        if(!save(ctx, buffer, on, off, name))
-          return false;
+      char note[32];
+      note_name(note, sizeof(note), n);
+      snprintf(name, sizeof(name), "%*.*s%s%s",
+       offset, offset, filename, note, filename + offset2);
 
-        i++;
-      }
-    }
-    return true;
+      return save(ctx, buffer, on, off, name);
+    });
   }
 };
 
 
 /* Format specializations--see individual format compilation units. */
+extern const AudioFormat &AudioFormatIT;
 extern const AudioFormat &AudioFormatITI;
 extern const AudioFormat &AudioFormatRaw;
+extern const AudioFormat &AudioFormatSession;
+extern const AudioFormat &AudioFormatSF2;
+extern const AudioFormat &AudioFormatSFZ;
 extern const AudioFormat &AudioFormatWAVE;
 
 #endif /* AUDIOOUTPUT_HPP */
@@ -0,0 +1,238 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AudioFormat_IT.hpp"
+
+#include <array>
+
+static const class AudioFormatIT : public AudioFormatITBase
+{
+  static constexpr unsigned IMPM_LENGTH = 0xc0;
+  static constexpr unsigned NUM_ORDERS = 2;
+  static constexpr unsigned NUM_PATTERNS = 1;
+
+  /**
+   * Write an IT module header, order list, and offset tables.
+   *
+   * @param out           Buffer for the output IT header.
+   * @param ctx           Configuration context.
+   * @param instruments   List of instruments.
+   * @param num_samples   Total number of samples.
+   */
+  void write_impm(std::vector<uint8_t> &out, ConfigContext &ctx,
+   const std::vector<Instrument> &instruments, size_t num_samples) const
+  {
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    if(!iti)
+      return;
+
+    char songname[26]{};
+    uint8_t chn_pan[64];
+    uint8_t chn_vol[64];
+    unsigned cwt = iti->Compression ? 0x0214 : 0x0200;
+
+    snprintf(songname, sizeof(songname), "%s", iti->Name.value());
+    memset(chn_pan, 32, sizeof(chn_pan));
+    memset(chn_vol, 64, sizeof(chn_vol));
+
+    uint8_t buf[IMPM_LENGTH];
+    Buffer<IMPM_LENGTH> tmp = Buffer<IMPM_LENGTH>(buf)
+      .append('I','M','P','M')
+      .append(songname)
+      .append<uint16_t>(0x1004)           /* Pattern row highlight */
+      .append<uint16_t>(NUM_ORDERS)       /* Number of orders */
+      .append<uint16_t>(instruments.size()) /* Number of instruments */
+      .append<uint16_t>(num_samples)      /* Number of samples */
+      .append<uint16_t>(NUM_PATTERNS)     /* Number of patterns */
+      .append<uint16_t>(cwt)              /* Created with tracker version */
+      .append<uint16_t>(cwt)              /* Compatible with tracker version */
+      .append<uint16_t>(0x0d)             /* Flags: stereo, instruments, linear */
+      .append<uint16_t>(0)                /* Special */
+      .append<uint8_t>(128)               /* Global volume */
+      .append<uint8_t>(48)                /* Mix volume */
+      .append<uint8_t>(6)                 /* Initial speed */
+      .append<uint8_t>(125)               /* Initial tempo */
+      .append<uint8_t>(128)               /* Pan separation */
+      .append<uint8_t>(0)                 /* Pitch wheel depth */
+      .append<uint16_t>(0)                /* Message length */
+      .append<uint32_t>(0)                /* Message offset */
+      .append<uint32_t>(0)                /* Reserved */
+      .append(chn_pan)
+      .append(chn_vol)
+      .check();
+
+    out.insert(out.end(), tmp.begin(), tmp.end());
+
+    /* One empty pattern followed by the end of song marker. */
+    out.push_back(0);
+    out.push_back(255);
+
+    uint32_t pos = IMPM_LENGTH + NUM_ORDERS +
+     4 * (instruments.size() + num_samples + NUM_PATTERNS);
+
+    for(size_t i = 0; i < instruments.size(); i++, pos += IMPI_LENGTH)
+      put32(out, pos);
+
+    for(size_t i = 0; i < num_samples; i++, pos += IMPS_LENGTH)
+      put32(out, pos);
+
+    /* Offset 0: empty 64 row pattern. */
+    put32(out, 0);
+  }
+
+  static void put32(std::vector<uint8_t> &out, uint32_t value)
+  {
+    out.push_back((value >> 0) & 0xff);
+    out.push_back((value >> 8) & 0xff);
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >> 24) & 0xff);
+  }
+
+  /**
+   * Write all cued notes in an audio buffer to an Impulse Tracker module.
+   * The headers are written first and the sample data is then streamed to
+   * the file one sample at a time, after which the sample offsets in the
+   * headers are filled in.
+   *
+   * @param ctx       Configuration context.
+   * @param buffer    AudioBuffer containing audio data and all note cues.
+   * @param start     unused
+   * @param filename  Output filename.
+   * @returns         `true` on success, otherwise `false`.
+   */
+  template<class T>
+  bool _save(ConfigContext &ctx, const AudioBuffer<T> &buffer,
+   const AudioCue &start, const char *filename) const
+  {
+    /* Reject individual note saves */
+    if(start.value >= 0)
+      return false;
+
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    if(!iti)
+      return false;
+
+    std::vector<Note> notes;
+    std::vector<Instrument> instruments;
+    get_notes(notes, ctx, buffer, true);
+    get_instruments(instruments, notes);
+
+    /* IT keymaps can't select by velocity or take, so every velocity layer
+     * and round robin take gets its own instrument. */
+    std::vector<Instrument> parts;
+    std::vector<std::array<char, 48>> names;
+    for(size_t i = 0; i < instruments.size(); i++)
+    {
+      const Instrument &ins = instruments[i];
+      std::vector<Layer> layers;
+      get_layers(layers, &notes[ins.first], ins.count);
+
+      for(const Layer &l : layers)
+      {
+        const Note &n = notes[ins.first + l.first];
+        names.emplace_back();
+        char *name = names.back().data();
+
+        if(layers.size() > 1)
+        {
+          snprintf(name, 48, "%.*s %zu v%u rr%u", 12, iti->Name.value(), i + 1,
+           n.velocity, n.take);
+        }
+        else
+          snprintf(name, 48, "%.*s %zu", 20, iti->Name.value(), i + 1);
+
+        parts.push_back({ ins.first + l.first, l.count });
+      }
+    }
+
+    std::vector<uint8_t> out;
+    write_impm(out, ctx, parts, notes.size());
+
+    for(size_t i = 0; i < parts.size(); i++)
+    {
+      const Instrument &ins = parts[i];
+      write_impi(out, &notes[ins.first], ins.count, ctx, ins.first, names[i].data());
+    }
+
+    size_t imps_pos = out.size();
+    for(Note &note : notes)
+      write_imps(out, note, ctx, buffer);
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+      return false;
+
+    bool ret = false;
+    size_t sample_pos = out.size();
+    if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+      goto err;
+
+    /* Stream sample data. */
+    for(Note &note : notes)
+    {
+      out.clear();
+      write_sample(out, note, buffer, iti->Compression);
+
+      if(sample_pos > UINT32_MAX)
+      {
+        fprintf(stderr, "IT: module exceeds 4 GiB\n");
+        goto err;
+      }
+      note.file_offset = sample_pos;
+      sample_pos += out.size();
+
+      if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+        goto err;
+    }
+
+    /* Fill in sample offsets. */
+    for(size_t i = 0; i < notes.size(); i++)
+    {
+      uint8_t tmp[4];
+      Buffer<4>(tmp).append<uint32_t>(notes[i].file_offset).check();
+
+      if(fseek(fp, imps_pos + i * IMPS_LENGTH + IMPS_OFFSET_POS, SEEK_SET) ||
+       fwrite(tmp, 1, sizeof(tmp), fp) < sizeof(tmp))
+        goto err;
+    }
+    ret = true;
+
+  err:
+    if(!ret)
+      fprintf(stderr, "error writing file '%s'\n", filename);
+
+    fclose(fp);
+    return ret;
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int16_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(ctx, buffer, start, filename);
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int32_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(ctx, buffer, start, filename);
+  }
+} it;
+
+const AudioFormat &AudioFormatIT = it;
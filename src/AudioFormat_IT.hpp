@@ -0,0 +1,455 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOFORMAT_IT_HPP
+#define AUDIOFORMAT_IT_HPP
+
+#include "AudioFormat.hpp"
+#include "Buffer.hpp"
+
+#include <stdio.h>
+
+/* Sample conversion functions. */
+static inline void cvt(std::vector<uint8_t> &out, uint8_t d)
+{
+  out.push_back(d);
+}
+static inline void cvt(std::vector<uint8_t> &out, int16_t d)
+{
+  out.push_back((d >> 0) & 0xff);
+  out.push_back((d >> 8) & 0xff);
+}
+static inline void cvt(std::vector<uint8_t> &out, int32_t d)
+{
+  out.push_back((d >> 16) & 0xff);
+  out.push_back((d >> 24) & 0xff);
+}
+
+/* Same conversions, but to a value for the sample compressor. */
+static inline int cvt_value(uint8_t d)
+{
+  return static_cast<int8_t>(d);
+}
+static inline int cvt_value(int16_t d)
+{
+  return d;
+}
+static inline int cvt_value(int32_t d)
+{
+  return static_cast<int16_t>(d >> 16);
+}
+
+
+/**
+ * Impulse Tracker 2.14 sample compressor. Samples are delta encoded and
+ * written to a bitstream in blocks of 0x8000 bytes of uncompressed data.
+ * The bit width of each delta is variable and is changed with in-band
+ * escape values, which depend on the current width:
+ *
+ *   width < 7:         (1 << (width - 1)) followed by a 3 or 4 bit new width.
+ *   width <= BITS:     one of 8 or 16 values around (1 << (width - 1)).
+ *   width == BITS + 1: bit BITS is set; low bits are the new width.
+ *
+ * @tparam BITS   8 or 16.
+ */
+template<unsigned BITS>
+class ITCompressor
+{
+  static_assert(BITS == 8 || BITS == 16, "IT compression is 8 or 16 bit only");
+
+  static constexpr unsigned BLOCK_SAMPLES = (BITS == 8) ? 0x8000 : 0x4000;
+  static constexpr unsigned MAX_WIDTH = BITS + 1;
+  static constexpr unsigned A_BITS = (BITS == 8) ? 3 : 4;
+  static constexpr int B_HALF = (BITS == 8) ? 4 : 8;
+  static constexpr unsigned LOOKAHEAD = 16;
+
+  std::vector<uint8_t> &out;
+  std::vector<int> block;
+  std::vector<uint8_t> need;
+  uint32_t bitbuf = 0;
+  unsigned bitcount = 0;
+  int prev = 0;
+
+  /* Get the minimum width that can represent a given delta value. */
+  static unsigned width_for(int v)
+  {
+    for(unsigned w = 1; w < 7; w++)
+    {
+      int max = (1 << (w - 1)) - 1;
+      if(v >= -max && v <= max)
+        return w;
+    }
+    for(unsigned w = 7; w <= BITS; w++)
+    {
+      int max = (1 << (w - 1)) - 1 - B_HALF;
+      if(v >= -max - 1 && v <= max)
+        return w;
+    }
+    return MAX_WIDTH;
+  }
+
+  void put(uint32_t value, unsigned width)
+  {
+    bitbuf |= (value & ((1UL << width) - 1)) << bitcount;
+    bitcount += width;
+    while(bitcount >= 8)
+    {
+      out.push_back(bitbuf & 0xff);
+      bitbuf >>= 8;
+      bitcount -= 8;
+    }
+  }
+
+  void change_width(unsigned current, unsigned next)
+  {
+    unsigned v = (next < current) ? next : next - 1;
+    if(current < 7)
+    {
+      put(1U << (current - 1), current);
+      put(v - 1, A_BITS);
+    }
+    else
+
+    if(current <= BITS)
+    {
+      unsigned border = ((1U << (current - 1)) - 1) - B_HALF;
+      put(border + v, current);
+    }
+    else
+      put((1U << BITS) | (next - 1), MAX_WIDTH);
+  }
+
+  unsigned switch_cost(unsigned current) const
+  {
+    return current + (current < 7 ? A_BITS : 0);
+  }
+
+  void flush_block()
+  {
+    size_t start = out.size();
+    out.push_back(0);
+    out.push_back(0);
+
+    need.resize(block.size());
+    for(size_t i = 0; i < block.size(); i++)
+      need[i] = width_for(block[i]);
+
+    unsigned width = MAX_WIDTH;
+    for(size_t i = 0; i < block.size(); i++)
+    {
+      size_t stop = std::min(block.size(), i + LOOKAHEAD);
+      unsigned next = need[i];
+      for(size_t j = i + 1; j < stop; j++)
+        next = std::max<unsigned>(next, need[j]);
+
+      if(need[i] > width ||
+       (next < width && (width - next) * (stop - i) > switch_cost(width)))
+      {
+        change_width(width, next);
+        width = next;
+      }
+      /* The widest mode only uses the low bits as the value. */
+      if(width == MAX_WIDTH)
+        put(block[i] & ((1U << BITS) - 1), width);
+      else
+        put(block[i], width);
+    }
+
+    if(bitcount)
+      put(0, 8 - bitcount);
+
+    size_t len = out.size() - start - 2;
+    out[start + 0] = len & 0xff;
+    out[start + 1] = (len >> 8) & 0xff;
+
+    block.clear();
+    bitbuf = 0;
+    bitcount = 0;
+  }
+
+public:
+  ITCompressor(std::vector<uint8_t> &_out): out(_out)
+  {
+    block.reserve(BLOCK_SAMPLES);
+  }
+
+  ~ITCompressor()
+  {
+    flush();
+  }
+
+  void push(int value)
+  {
+    int delta = value - prev;
+    prev = value;
+
+    /* Wrap delta to the sample size; the decoder uses wrapping arithmetic. */
+    if(BITS == 8)
+      delta = static_cast<int8_t>(delta);
+    else
+      delta = static_cast<int16_t>(delta);
+
+    block.push_back(delta);
+    if(block.size() >= BLOCK_SAMPLES)
+    {
+      flush_block();
+      prev = 0;
+    }
+  }
+
+  /* Flush the current block. Call between channels of a stereo sample. */
+  void flush()
+  {
+    if(block.size())
+      flush_block();
+    prev = 0;
+  }
+};
+
+
+/**
+ * Shared instrument and sample header writers for the ITI instrument and IT
+ * module formats.
+ */
+class AudioFormatITBase : public AudioFormat
+{
+protected:
+  /* To clarify the nonsense in the documentation: the instrument IS 554 bytes.
+   * There are *4* extra bytes of padding at the end. The documentation count
+   * includes the three envelope padding bytes in its count for no reason
+   * other than to confuse the reader.
+   */
+  static constexpr unsigned IMPI_LENGTH = 0x40 + 240 + 3 * 82 + 4;
+  static constexpr unsigned IMPS_LENGTH = 0x50;
+  static constexpr unsigned IMPS_OFFSET_POS = 0x48;
+
+  struct Note : public AudioFormat::Note
+  {
+    uint32_t file_offset = 0;
+
+    Note(const AudioFormat::Note &n): AudioFormat::Note(n) {}
+  };
+
+  /**
+   * Get all complete NoteOn/NoteOff cue pairs within an AudioBuffer, up to
+   * the configured sample limit.
+   *
+   * @param notes       Destination list of notes.
+   * @param ctx         Configuration context.
+   * @param buffer      AudioBuffer containing all note cues.
+   * @param all_layers  Keep every velocity layer and round robin take;
+   *                    otherwise only the first take of the loudest layer.
+   */
+  template<class T>
+  void get_notes(std::vector<Note> &notes, ConfigContext &ctx,
+   const AudioBuffer<T> &buffer, bool all_layers) const
+  {
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    size_t max_samples = iti ? iti->MaxSamples.value() : 255;
+
+    std::vector<AudioFormat::Note> tmp;
+    AudioFormat::get_notes(tmp, buffer);
+    if(!all_layers)
+      filter_layers(tmp, false);
+
+    if(tmp.size() > max_samples)
+    {
+      fprintf(stderr, "note limit (%zu) reached, ignoring remaining notes\n",
+       max_samples);
+      tmp.resize(max_samples);
+    }
+    notes.assign(tmp.begin(), tmp.end());
+  }
+
+  /**
+   * Write an IT instrument header to the output buffer.
+   *
+   * @param out           Buffer for output ITI file.
+   * @param notes         List of all notes in this instrument.
+   * @param num_notes     Number of notes in this instrument.
+   * @param ctx           Configuration context.
+   * @param first_sample  Number of samples preceding this instrument's samples.
+   * @param name          Instrument name.
+   */
+  void write_impi(std::vector<uint8_t> &out, const Note *notes, size_t num_notes,
+   ConfigContext &ctx, unsigned first_sample, const char *name) const
+  {
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    if(!iti)
+      return;
+
+    uint8_t keymap[NUM_KEYS * 2];
+    char dosname[12]{};
+    char insname[26]{};
+
+    snprintf(insname, sizeof(insname), "%.25s", name);
+    build_keymap(keymap, notes, num_notes, first_sample, iti->MaxHalfSteps);
+
+    uint8_t buf[IMPI_LENGTH]{};
+    Buffer<IMPI_LENGTH> tmp = Buffer<IMPI_LENGTH>(buf)
+      .append('I','M','P','I')
+      .append(dosname)
+      .append<uint8_t>(0)                 /* padding */
+      .append<uint8_t>(2)                 /* NNA: Note off */
+      .append<uint8_t>(1)                 /* DCA: Note check */
+      .append<uint8_t>(2)                 /* DCA: Note fade */
+      .append<uint16_t>(128)              /* Fade out */
+      .append<int8_t>(0)                  /* Pitch pan separation, -32 to 32 */
+      .append<uint8_t>(60)                /* Pitch pan center = C5 */
+      .append<uint8_t>(128)               /* Global volume */
+      .append<uint8_t>(128)               /* Default pan (128 = don't use) */
+      .append<uint8_t>(0)                 /* Random volume variation */
+      .append<uint8_t>(0)                 /* Random pan variation */
+      .append<uint16_t>(0x0202)           /* Tracker version = 2.02 */
+      .append<uint8_t>(num_notes)         /* Number of samples */
+      .append<uint8_t>(0)                 /* padding */
+      .append(insname)
+      .append<uint8_t>(0x7f)              /* initial filter cutoff (127, unused) */
+      .append<uint8_t>(0x00)              /* initial filter resonance (0, unused) */
+      .append<uint8_t>(0)                 /* MIDI channel */
+      .append<uint8_t>(0)                 /* MIDI program */
+      .append<uint16_t>(0)                /* MIDI bank */
+      .append(keymap)
+      .skip<82>()                             /* Volume envelope */
+      .skip<82>()                             /* Pan envelope */
+      .skip<82>()                             /* Filter envelope */
+      .skip<4>()                              /* "7" bytes of padding */
+      .check();
+
+    out.insert(out.end(), tmp.begin(), tmp.end());
+  }
+
+  /**
+   * Write an IT sample header to the output buffer.
+   *
+   * @param out     Buffer for output ITI file.
+   * @param note    Data for the current note/sample.
+   * @param ctx     Configuration context.
+   * @param buffer  AudioBuffer containing the current sample's data.
+   */
+  template<class T>
+  void write_imps(std::vector<uint8_t> &out, const Note &note,
+   ConfigContext &ctx, const AudioBuffer<T> &buffer) const
+  {
+    const auto cfg = ctx.get_interface_as<GlobalConfig>("Global");
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    if(!cfg || !iti)
+      return;
+
+    char dosname[12]{};
+    char smpname[26]{};
+    unsigned flags = (1 << 0);                /* sample is set */
+
+    snprintf(smpname, sizeof(smpname), "%s", iti->Name.value());
+    char notename[32];
+    note_name(notename, sizeof(notename), note);
+    snprintf(dosname, sizeof(dosname), "%.11s", notename);
+
+    if(sizeof(T) >= 2)
+      flags |= (1 << 1);                      /* 16-bit */
+    if(buffer.channels >= 2)
+      flags |= (1 << 2);                      /* stereo */
+    if(iti->Compression)
+      flags |= (1 << 3);                      /* IT 2.14 compressed */
+
+    uint8_t buf[IMPS_LENGTH];
+    Buffer<IMPS_LENGTH> tmp = Buffer<IMPS_LENGTH>(buf)
+      .append('I','M','P','S')
+      .append(dosname)
+      .append<uint8_t>(0)                 /* padding */
+      .append<uint8_t>(64)                /* Global volume */
+      .append<uint8_t>(flags)             /* Flags */
+      .append<uint8_t>(64)                /* Default volume */
+      .append(smpname)
+      .append<uint8_t>(0x01)              /* Convert: bit 0 = samples are signed */
+      .append<int8_t>(0)                  /* Default pan = off */
+      .append<uint32_t>(note.length())    /* Sample length in frames */
+      .append<uint32_t>(0)                /* Loop start */
+      .append<uint32_t>(0)                /* Loop end */
+      .append<uint32_t>(cfg->audio_rate)  /* C5 speed */
+      .append<uint32_t>(0)                /* Sustain loop start */
+      .append<uint32_t>(0)                /* Sustain loop end */
+      .append<uint32_t>(note.file_offset) /* Sample offset in file */
+      .append<uint8_t>(0)                 /* Vibrato speed */
+      .append<uint8_t>(0)                 /* Vibrato depth */
+      .append<uint8_t>(0)                 /* Vibrato waveform */
+      .append<uint8_t>(0)                 /* Vibrato rate */
+      .check();
+
+    out.insert(out.end(), tmp.begin(), tmp.end());
+  }
+
+  /**
+   * Get the saved length of a sample after 32->16 conversion and channel removal.
+   * This is only valid for uncompressed samples.
+   *
+   * @param note    Data for the current note/sample, including start/end in buffer.
+   * @param buffer  AudioBuffer containing the current sample's data.
+   */
+  template<class T>
+  size_t sample_length(const Note &note, const AudioBuffer<T> &buffer) const
+  {
+    return std::min((size_t)2, sizeof(T)) * std::min(2U, buffer.channels) * note.length();
+  }
+
+  /**
+   * Write sample data to the output buffer.
+   *
+   * @param out       Buffer for output ITI file.
+   * @param note      Data for the current note/sample, including start/end in buffer.
+   * @param buffer    AudioBuffer containing the current sample's data.
+   * @param compress  Write IT 2.14 compressed sample data.
+   */
+  template<class T>
+  void write_sample(std::vector<uint8_t> &out,
+   const Note &note, const AudioBuffer<T> &buffer, bool compress) const
+  {
+    if(compress)
+    {
+      ITCompressor<(sizeof(T) >= 2) ? 16 : 8> cmp(out);
+      unsigned channels = std::min(2U, buffer.channels);
+
+      for(unsigned ch = 0; ch < channels; ch++)
+      {
+        size_t j = note.start * buffer.channels + ch;
+        for(size_t i = note.start; i < note.end; i++, j += buffer.channels)
+          cmp.push(cvt_value(buffer[j]));
+
+        cmp.flush();
+      }
+      return;
+    }
+
+    out.reserve(out.size() + sample_length(note, buffer));
+
+    /* Left channel */
+    size_t j = note.start * buffer.channels;
+    for(size_t i = note.start; i < note.end; i++, j += buffer.channels)
+      cvt(out, buffer[j]);
+
+    /* Right channel */
+    if(buffer.channels >= 2)
+    {
+      j = note.start * buffer.channels + 1;
+      for(size_t i = note.start; i < note.end; i++, j += buffer.channels)
+        cvt(out, buffer[j]);
+    }
+  }
+};
+
+#endif /* AUDIOFORMAT_IT_HPP */
@@ -26,7 +26,7 @@ static const class _AudioOutputRaw : public AudioFormat
    const char *filename) const override
   {
     size_t sz = buffer.total_frames() * buffer.frame_size();
-    return write_file(buffer.get_samples().data(), sz, filename);
+    return write_file(buffer.get_samples(), sz, filename);
   }
 } raw;
 
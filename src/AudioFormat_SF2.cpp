@@ -0,0 +1,436 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AudioFormat.hpp"
+#include "Buffer.hpp"
+
+#include <stdio.h>
+
+/**
+ * SoundFont 2.01 writer. Each instrument (note sweep) in the buffer becomes
+ * a preset/instrument pair. Stereo notes are written as linked left/right
+ * sample pairs. All chunk sizes are known in advance, so the sample data is
+ * streamed directly from the buffer into the smpl chunk.
+ */
+static const class AudioFormatSF2 : public AudioFormat
+{
+  static constexpr unsigned SAMPLE_PADDING = 46;  /* Zero points after each sample */
+  static constexpr unsigned PHDR_LENGTH = 38;
+  static constexpr unsigned BAG_LENGTH = 4;
+  static constexpr unsigned MOD_LENGTH = 10;
+  static constexpr unsigned GEN_LENGTH = 4;
+  static constexpr unsigned INST_LENGTH = 22;
+  static constexpr unsigned SHDR_LENGTH = 46;
+
+  enum generator
+  {
+    PAN               = 17,
+    RELEASE_VOL_ENV   = 38,
+    INSTRUMENT        = 41,
+    KEY_RANGE         = 43,
+    VEL_RANGE         = 44,
+    SAMPLE_ID         = 53,
+    ROOT_KEY          = 58,
+  };
+
+  enum sample_type
+  {
+    MONO_SAMPLE       = 1,
+    RIGHT_SAMPLE      = 2,
+    LEFT_SAMPLE       = 4,
+  };
+
+  /* Approximately the same release as the IT instrument fade out. */
+  static constexpr int16_t RELEASE_TIMECENTS = -3284;
+
+  static inline int16_t cvt16(int16_t d)
+  {
+    return d;
+  }
+  static inline int16_t cvt16(int32_t d)
+  {
+    return d >> 16;
+  }
+
+  static void put_header(std::vector<uint8_t> &out, const char *magic, size_t len)
+  {
+    uint8_t buf[8];
+    Buffer<8>(buf)
+      .append(magic[0], magic[1], magic[2], magic[3])
+      .append<uint32_t>(len)
+      .check();
+
+    out.insert(out.end(), std::begin(buf), std::end(buf));
+  }
+
+  static void put_chunk(std::vector<uint8_t> &out, const char *magic,
+   const std::vector<uint8_t> &data)
+  {
+    put_header(out, magic, data.size());
+    out.insert(out.end(), data.begin(), data.end());
+  }
+
+  template<size_t N>
+  static void put(std::vector<uint8_t> &out, uint8_t (&buf)[N])
+  {
+    out.insert(out.end(), std::begin(buf), std::end(buf));
+  }
+
+  static void put_bag(std::vector<uint8_t> &out, size_t gen, size_t mod)
+  {
+    uint8_t buf[BAG_LENGTH];
+    Buffer<BAG_LENGTH>(buf)
+      .append<uint16_t>(gen)
+      .append<uint16_t>(mod)
+      .check();
+    put(out, buf);
+  }
+
+  static void put_gen(std::vector<uint8_t> &out, unsigned oper, uint16_t amount)
+  {
+    uint8_t buf[GEN_LENGTH];
+    Buffer<GEN_LENGTH>(buf)
+      .append<uint16_t>(oper)
+      .append<uint16_t>(amount)
+      .check();
+    put(out, buf);
+  }
+
+  static void put_phdr(std::vector<uint8_t> &out, const char *name,
+   unsigned preset, size_t bag)
+  {
+    char tmp[20]{};
+    snprintf(tmp, sizeof(tmp), "%.19s", name);
+
+    uint8_t buf[PHDR_LENGTH];
+    Buffer<PHDR_LENGTH>(buf)
+      .append(tmp)
+      .append<uint16_t>(preset)           /* Preset number */
+      .append<uint16_t>(0)                /* Bank */
+      .append<uint16_t>(bag)              /* Preset bag index */
+      .append<uint32_t>(0)                /* Library */
+      .append<uint32_t>(0)                /* Genre */
+      .append<uint32_t>(0)                /* Morphology */
+      .check();
+    put(out, buf);
+  }
+
+  static void put_inst(std::vector<uint8_t> &out, const char *name, size_t bag)
+  {
+    char tmp[20]{};
+    snprintf(tmp, sizeof(tmp), "%.19s", name);
+
+    uint8_t buf[INST_LENGTH];
+    Buffer<INST_LENGTH>(buf)
+      .append(tmp)
+      .append<uint16_t>(bag)              /* Instrument bag index */
+      .check();
+    put(out, buf);
+  }
+
+  static void put_shdr(std::vector<uint8_t> &out, const char *name,
+   uint32_t start, uint32_t end, uint32_t rate, uint8_t pitch,
+   uint16_t link, uint16_t type)
+  {
+    char tmp[20]{};
+    snprintf(tmp, sizeof(tmp), "%.19s", name);
+
+    uint8_t buf[SHDR_LENGTH];
+    Buffer<SHDR_LENGTH>(buf)
+      .append(tmp)
+      .append<uint32_t>(start)            /* Start */
+      .append<uint32_t>(end)              /* End */
+      .append<uint32_t>(start)            /* Loop start (unused) */
+      .append<uint32_t>(end)              /* Loop end (unused) */
+      .append<uint32_t>(rate)             /* Sample rate */
+      .append<uint8_t>(pitch)             /* Original pitch */
+      .append<int8_t>(0)                  /* Pitch correction */
+      .append<uint16_t>(link)             /* Linked sample */
+      .append<uint16_t>(type)             /* Sample type */
+      .check();
+    put(out, buf);
+  }
+
+  /**
+   * Build the pdta chunk.
+   *
+   * @param out           Destination buffer.
+   * @param ctx           Configuration context.
+   * @param notes         List of notes.
+   * @param instruments   List of instruments.
+   * @param channels      Number of channels per note (1 or 2).
+   * @param rate          Sample rate.
+   */
+  void write_pdta(std::vector<uint8_t> &out, ConfigContext &ctx,
+   const std::vector<Note> &notes, const std::vector<Instrument> &instruments,
+   unsigned channels, unsigned rate) const
+  {
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    unsigned max_half_steps = iti ? iti->MaxHalfSteps.value() : 0;
+    const char *insname = iti ? iti->Name.value() : "";
+
+    std::vector<uint8_t> phdr, pbag, pmod, pgen, inst, ibag, imod, igen, shdr;
+    size_t num_zones = 0;
+    size_t num_gens = 0;
+
+    for(size_t i = 0; i < instruments.size(); i++)
+    {
+      const Instrument &ins = instruments[i];
+      char name[40];
+      snprintf(name, sizeof(name), "%.*s %zu", 16, insname, i + 1);
+
+      put_phdr(phdr, name, i, i);
+      put_bag(pbag, i, 0);
+      put_gen(pgen, INSTRUMENT, i);
+      put_inst(inst, name, num_zones);
+
+      std::vector<Layer> layers;
+      get_layers(layers, &notes[ins.first], ins.count);
+
+      for(const Layer &l : layers)
+      {
+        size_t first = ins.first + l.first;
+        uint8_t keymap[NUM_KEYS * 2];
+        build_keymap(keymap, &notes[first], l.count, 0, max_half_steps);
+
+        for(size_t j = 0; j < l.count; j++)
+        {
+          unsigned lokey = NUM_KEYS;
+          unsigned hikey = 0;
+          for(unsigned key = 0; key < NUM_KEYS; key++)
+          {
+            if(keymap[key * 2 + 1] == j + 1)
+            {
+              lokey = std::min(lokey, key);
+              hikey = std::max(hikey, key);
+            }
+          }
+          if(lokey > hikey)
+            continue;
+
+          const Note &note = notes[first + j];
+          size_t sample = (first + j) * channels;
+
+          for(unsigned ch = 0; ch < channels; ch++)
+          {
+            put_bag(ibag, num_gens, 0);
+            num_zones++;
+
+            /* keyRange must be first, then velRange; sampleID must be last. */
+            put_gen(igen, KEY_RANGE, lokey | (hikey << 8));
+            num_gens++;
+            if(layers.size() > 1)
+            {
+              put_gen(igen, VEL_RANGE, l.lovel | (l.hivel << 8));
+              num_gens++;
+            }
+            put_gen(igen, RELEASE_VOL_ENV, RELEASE_TIMECENTS);
+            put_gen(igen, ROOT_KEY, note.note);
+            num_gens += 2;
+            if(channels >= 2)
+            {
+              put_gen(igen, PAN, ch ? 500 : -500);
+              num_gens++;
+            }
+            put_gen(igen, SAMPLE_ID, sample + ch);
+            num_gens++;
+          }
+        }
+      }
+    }
+
+    /* Sample headers. */
+    uint32_t pos = 0;
+    for(size_t i = 0; i < notes.size(); i++)
+    {
+      const Note &note = notes[i];
+      size_t sample = i * channels;
+      char note_buf[32];
+      char name[40];
+
+      note_name(note_buf, sizeof(note_buf), note);
+
+      for(unsigned ch = 0; ch < channels; ch++)
+      {
+        uint16_t type = MONO_SAMPLE;
+        uint16_t link = 0;
+        if(channels >= 2)
+        {
+          type = ch ? RIGHT_SAMPLE : LEFT_SAMPLE;
+          link = ch ? sample : sample + 1;
+        }
+        snprintf(name, sizeof(name), "%s%s", note_buf,
+         (channels >= 2) ? (ch ? " R" : " L") : "");
+
+        put_shdr(shdr, name, pos, pos + note.length(), rate, note.note, link, type);
+        pos += note.length() + SAMPLE_PADDING;
+      }
+    }
+
+    /* Terminal records. */
+    put_phdr(phdr, "EOP", 0, instruments.size());
+    put_bag(pbag, instruments.size(), 0);
+    pmod.resize(MOD_LENGTH);
+    put_gen(pgen, 0, 0);
+    put_inst(inst, "EOI", num_zones);
+    put_bag(ibag, num_gens, 0);
+    imod.resize(MOD_LENGTH);
+    put_gen(igen, 0, 0);
+    put_shdr(shdr, "EOS", 0, 0, 0, 0, 0, 0);
+
+    out.push_back('p');
+    out.push_back('d');
+    out.push_back('t');
+    out.push_back('a');
+    put_chunk(out, "phdr", phdr);
+    put_chunk(out, "pbag", pbag);
+    put_chunk(out, "pmod", pmod);
+    put_chunk(out, "pgen", pgen);
+    put_chunk(out, "inst", inst);
+    put_chunk(out, "ibag", ibag);
+    put_chunk(out, "imod", imod);
+    put_chunk(out, "igen", igen);
+    put_chunk(out, "shdr", shdr);
+  }
+
+  /**
+   * Write all cued notes in an audio buffer to a SoundFont 2 file.
+   *
+   * @param ctx       Configuration context.
+   * @param buffer    AudioBuffer containing audio data and all note cues.
+   * @param start     unused
+   * @param filename  Output filename.
+   * @returns         `true` on success, otherwise `false`.
+   */
+  template<class T>
+  bool _save(ConfigContext &ctx, const AudioBuffer<T> &buffer,
+   const AudioCue &start, const char *filename) const
+  {
+    /* Reject individual note saves */
+    if(start.value >= 0)
+      return false;
+
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    const char *name = iti ? iti->Name.value() : "";
+    unsigned channels = std::min(2U, buffer.channels);
+
+    std::vector<Note> notes;
+    std::vector<Instrument> instruments;
+    get_notes(notes, buffer, UINT16_MAX / channels);
+    /* SoundFont 2 has no round robins; velocity layers use velRange. */
+    filter_layers(notes, true);
+    get_instruments(instruments, notes);
+
+    size_t smpl_length = 0;
+    for(const Note &note : notes)
+      smpl_length += (note.length() + SAMPLE_PADDING) * channels * sizeof(int16_t);
+
+    std::vector<uint8_t> pdta;
+    write_pdta(pdta, ctx, notes, instruments, channels, buffer.rate);
+
+    /* INFO list: version, target engine, name. */
+    std::vector<uint8_t> info{ 'I','N','F','O' };
+    std::vector<uint8_t> tmp{ 2, 0, 1, 0 };
+    put_chunk(info, "ifil", tmp);
+    tmp.assign({ 'E','M','U','8','0','0','0', 0 });
+    put_chunk(info, "isng", tmp);
+    tmp.assign(name, name + strlen(name));
+    tmp.resize((tmp.size() + 2) & ~1);
+    put_chunk(info, "INAM", tmp);
+
+    size_t riff_length = 4 + (info.size() + 8) + (12 + smpl_length + 8) +
+     (pdta.size() + 8);
+    if(riff_length > UINT32_MAX)
+    {
+      fprintf(stderr, "SF2: file exceeds 4 GiB\n");
+      return false;
+    }
+
+    std::vector<uint8_t> out;
+    put_header(out, "RIFF", riff_length);
+    out.insert(out.end(), { 's','f','b','k' });
+    put_chunk(out, "LIST", info);
+    put_header(out, "LIST", 4 + 8 + smpl_length);
+    out.insert(out.end(), { 's','d','t','a' });
+    put_header(out, "smpl", smpl_length);
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+      return false;
+
+    bool ret = false;
+    if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+      goto err;
+
+    /* Stream sample data. */
+    out.clear();
+    for(const Note &note : notes)
+    {
+      for(unsigned ch = 0; ch < channels; ch++)
+      {
+        size_t j = note.start * buffer.channels + ch;
+        for(size_t i = note.start; i < note.end; i++, j += buffer.channels)
+        {
+          int16_t d = cvt16(buffer[j]);
+          out.push_back((d >> 0) & 0xff);
+          out.push_back((d >> 8) & 0xff);
+
+          if(out.size() >= 65536)
+          {
+            if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+              goto err;
+            out.clear();
+          }
+        }
+        out.resize(out.size() + SAMPLE_PADDING * sizeof(int16_t));
+      }
+    }
+    if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+      goto err;
+
+    out.clear();
+    put_chunk(out, "LIST", pdta);
+    if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+      goto err;
+
+    ret = true;
+
+  err:
+    if(!ret)
+      fprintf(stderr, "error writing file '%s'\n", filename);
+
+    fclose(fp);
+    return ret;
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int16_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(ctx, buffer, start, filename);
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int32_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(ctx, buffer, start, filename);
+  }
+} sf2;
+
+const AudioFormat &AudioFormatSF2 = sf2;
@@ -0,0 +1,206 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AudioFormat.hpp"
+#include "Platform.hpp"
+
+#include <stdio.h>
+
+/**
+ * SFZ instrument writer. Every note is written to its own WAV file in a
+ * directory named after the SFZ file, and each instrument (note sweep) in
+ * the buffer gets its own SFZ file.
+ */
+static const class AudioFormatSFZ : public AudioFormat
+{
+  /**
+   * Get the name of a file generated from the output filename.
+   *
+   * @param dest      Destination buffer.
+   * @param dest_len  Size of destination buffer.
+   * @param filename  Output filename, including the extension.
+   * @param suffix    Text to replace the extension with.
+   */
+  static void get_filename(char *dest, size_t dest_len,
+   const char *filename, const char *suffix)
+  {
+    const char *ext = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+    int len = (ext && (!slash || ext > slash)) ? ext - filename : strlen(filename);
+
+    snprintf(dest, dest_len, "%.*s%s", len, filename, suffix);
+  }
+
+  /**
+   * Write an SFZ file for one instrument.
+   *
+   * @param ctx         Configuration context.
+   * @param notes       List of notes in this instrument.
+   * @param num_notes   Number of notes in this instrument.
+   * @param first       Index of the first note of this instrument.
+   * @param dir         Sample directory relative to the SFZ file.
+   * @param filename    Output filename.
+   * @returns           `true` on success, otherwise `false`.
+   */
+  bool write_sfz(ConfigContext &ctx, const Note *notes, size_t num_notes,
+   size_t first, const char *dir, const char *filename) const
+  {
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    if(!iti)
+      return false;
+
+    std::vector<Layer> layers;
+    get_layers(layers, notes, num_notes);
+
+    FILE *fp = fopen(filename, "w");
+    if(!fp)
+      return false;
+
+    fprintf(fp, "// %s\n\n", iti->Name.value());
+    fprintf(fp, "<control>\ndefault_path=%s/\n\n", dir);
+    /* Approximately the same release as the IT instrument fade out. */
+    fprintf(fp, "<global>\nampeg_release=0.15\n\n");
+
+    for(const Layer &l : layers)
+    {
+      unsigned seq_length = 0;
+      for(const Layer &other : layers)
+        if(other.lovel == l.lovel)
+          seq_length++;
+
+      /* Velocity layers and round robins are SFZ groups. */
+      if(layers.size() > 1)
+      {
+        fprintf(fp, "<group> lovel=%u hivel=%u", l.lovel, l.hivel);
+        if(l.take)
+          fprintf(fp, " seq_length=%u seq_position=%u", seq_length, l.take);
+        fprintf(fp, "\n");
+      }
+
+      const Note *layer_notes = notes + l.first;
+      uint8_t keymap[NUM_KEYS * 2];
+      build_keymap(keymap, layer_notes, l.count, 0, iti->MaxHalfSteps);
+
+      for(size_t i = 0; i < l.count; i++)
+      {
+        unsigned lokey = NUM_KEYS;
+        unsigned hikey = 0;
+        for(unsigned key = 0; key < NUM_KEYS; key++)
+        {
+          if(keymap[key * 2 + 1] == i + 1)
+          {
+            lokey = std::min(lokey, key);
+            hikey = std::max(hikey, key);
+          }
+        }
+        if(lokey > hikey)
+          continue;
+
+        char note[32];
+        note_name(note, sizeof(note), layer_notes[i]);
+        fprintf(fp, "<region> sample=%03zu-%s.wav lokey=%u hikey=%u pitch_keycenter=%u\n",
+         first + l.first + i + 1, note, lokey, hikey, layer_notes[i].note);
+      }
+      if(layers.size() > 1)
+        fprintf(fp, "\n");
+    }
+
+    bool ret = !ferror(fp);
+    if(fclose(fp) || !ret)
+    {
+      fprintf(stderr, "error writing file '%s'\n", filename);
+      return false;
+    }
+    return true;
+  }
+
+  template<class T>
+  bool _save(ConfigContext &ctx, const AudioBuffer<T> &buffer,
+   const AudioCue &start, const char *filename) const
+  {
+    /* Reject individual note saves */
+    if(start.value >= 0)
+      return false;
+
+    std::vector<Note> notes;
+    std::vector<Instrument> instruments;
+    get_notes(notes, buffer);
+    get_instruments(instruments, notes);
+
+    char path[512];
+    get_filename(path, sizeof(path), filename, "");
+    if(!Platform::mkdir_recursive(path))
+    {
+      fprintf(stderr, "failed to create directory '%s'\n", path);
+      return false;
+    }
+
+    const char *slash = strrchr(path, '/');
+    const char *dir = slash ? slash + 1 : path;
+
+    for(size_t i = 0; i < instruments.size(); i++)
+    {
+      const Instrument &ins = instruments[i];
+      char name[512];
+      char suffix[32];
+
+      if(i > 0)
+      {
+        snprintf(suffix, sizeof(suffix), "-%zu.sfz", i + 1);
+        get_filename(name, sizeof(name), filename, suffix);
+      }
+      else
+        snprintf(name, sizeof(name), "%s", filename);
+
+      if(!write_sfz(ctx, &notes[ins.first], ins.count, ins.first, dir, name))
+        return false;
+    }
+
+    /* Per-note sample files. */
+    return run_parallel(notes.size(), [&](size_t i)
+    {
+      char name[1024];
+      char note[32];
+      const Note &n = notes[i];
+      int value = AudioCue::note_value(n.note, n.velocity, n.take);
+      AudioCue on{ n.start, AudioCue::NoteOn, value };
+      AudioCue off{ n.end, AudioCue::NoteOff, value };
+
+      note_name(note, sizeof(note), n);
+      snprintf(name, sizeof(name), "%s/%03zu-%s.wav", path, i + 1, note);
+
+      return AudioFormatWAVE.save(ctx, buffer, on, off, name);
+    });
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int16_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(ctx, buffer, start, filename);
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int32_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(ctx, buffer, start, filename);
+  }
+} sfz;
+
+const AudioFormat &AudioFormatSFZ = sfz;
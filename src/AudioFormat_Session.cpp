@@ -0,0 +1,232 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AudioFormat.hpp"
+#include "AudioFormat_Session.hpp"
+#include "Buffer.hpp"
+#include "Platform.hpp"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+static constexpr char magic[8] = { 'I','T','I','R','S','E','S','S' };
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+ "session sample data is stored in native byte order");
+
+void SessionFormat::header(uint8_t (&out)[HEADER_LENGTH], unsigned channels,
+ unsigned rate, unsigned sample_bytes, uint64_t frames, uint64_t cue_offset,
+ uint64_t num_cues)
+{
+  char tmp[8];
+  memcpy(tmp, magic, sizeof(tmp));
+
+  Buffer<HEADER_LENGTH>(out)
+    .append(tmp)
+    .append<uint16_t>(VERSION)
+    .append<uint16_t>(channels)
+    .append<uint32_t>(rate)
+    .append<uint16_t>(sample_bytes)
+    .append<uint16_t>(0)
+    .append<uint32_t>(CUE_LENGTH)
+    .append<uint32_t>(frames & 0xffffffff)
+    .append<uint32_t>(frames >> 32)
+    .append<uint32_t>(DATA_ALIGN)
+    .append<uint32_t>(0)
+    .append<uint32_t>(cue_offset & 0xffffffff)
+    .append<uint32_t>(cue_offset >> 32)
+    .append<uint32_t>(num_cues & 0xffffffff)
+    .append<uint32_t>(num_cues >> 32)
+    .skip<8>()
+    .check();
+}
+
+void SessionFormat::cues(std::vector<uint8_t> &out, const std::vector<AudioCue> &cues)
+{
+  out.reserve(out.size() + cues.size() * CUE_LENGTH);
+  for(const AudioCue &cue : cues)
+  {
+    uint8_t buf[CUE_LENGTH];
+    Buffer<CUE_LENGTH>(buf)
+      .append<uint32_t>(cue.frame & 0xffffffff)
+      .append<uint32_t>(static_cast<uint64_t>(cue.frame) >> 32)
+      .append<uint32_t>(cue.type)
+      .append<int32_t>(cue.value)
+      .check();
+
+    out.insert(out.end(), std::begin(buf), std::end(buf));
+  }
+}
+
+
+static const class AudioFormatSession : public AudioFormat, private SessionFormat
+{
+  template<class T>
+  bool _save(const AudioBuffer<T> &buffer, const AudioCue &start,
+   const char *filename) const
+  {
+    /* Reject individual note saves */
+    if(start.value >= 0)
+      return false;
+
+    const std::vector<AudioCue> &cues = buffer.get_cues();
+    uint64_t frames = buffer.total_frames();
+    uint64_t data_length = frames * buffer.frame_size();
+    uint64_t cue_offset = DATA_ALIGN + data_length;
+
+    uint8_t head[HEADER_LENGTH];
+    header(head, buffer.channels, buffer.rate, sizeof(T), frames,
+     cue_offset, cues.size());
+
+    std::vector<uint8_t> cue_data;
+    SessionFormat::cues(cue_data, cues);
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+      return false;
+
+    /* Sample data starts at DATA_ALIGN; the gap reads as zeroes. */
+    bool ret = fwrite(head, 1, sizeof(head), fp) == sizeof(head) &&
+     !fseek(fp, DATA_ALIGN, SEEK_SET) &&
+     fwrite(buffer.get_samples(), 1, data_length, fp) == data_length &&
+     fwrite(cue_data.data(), 1, cue_data.size(), fp) == cue_data.size();
+
+    if(fclose(fp) || !ret)
+    {
+      fprintf(stderr, "error writing file '%s'\n", filename);
+      return false;
+    }
+    return true;
+  }
+
+  static uint16_t get16(const uint8_t *pos)
+  {
+    return pos[0] | (pos[1] << 8);
+  }
+
+  static uint32_t get32(const uint8_t *pos)
+  {
+    return get16(pos) | (static_cast<uint32_t>(get16(pos + 2)) << 16);
+  }
+
+  static uint64_t get64(const uint8_t *pos)
+  {
+    return get32(pos) | (static_cast<uint64_t>(get32(pos + 4)) << 32);
+  }
+
+  template<class T>
+  bool _load(AudioBuffer<T> &buffer, const char *filename) const
+  {
+    size_t size;
+    std::shared_ptr<const void> file = Platform::map_file(filename, size);
+    if(!file)
+    {
+      fprintf(stderr, "failed to open session '%s'\n", filename);
+      return false;
+    }
+
+    const uint8_t *data = static_cast<const uint8_t *>(file.get());
+    if(size < HEADER_LENGTH || memcmp(data, magic, sizeof(magic)))
+    {
+      fprintf(stderr, "'%s' is not a session file\n", filename);
+      return false;
+    }
+
+    unsigned version      = get16(data + 0x08);
+    unsigned channels     = get16(data + 0x0a);
+    unsigned rate         = get32(data + 0x0c);
+    unsigned sample_bytes = get16(data + 0x10);
+    unsigned cue_length   = get32(data + 0x14);
+    uint64_t frames       = get64(data + 0x18);
+    uint64_t data_offset  = get64(data + 0x20);
+    uint64_t cue_offset   = get64(data + 0x28);
+    uint64_t num_cues     = get64(data + 0x30);
+
+    if(version != VERSION || sample_bytes != sizeof(T) || channels < 1 ||
+     cue_length < CUE_LENGTH || data_offset % alignof(T))
+    {
+      fprintf(stderr, "unsupported session '%s' (version %u, %u-bit)\n",
+       filename, version, sample_bytes * 8);
+      return false;
+    }
+
+    /* Unfinished dump (e.g. crashed during capture): recover all samples. */
+    if(!cue_offset && data_offset <= size)
+    {
+      frames = (size - data_offset) / channels / sizeof(T);
+      num_cues = 0;
+      fprintf(stderr, "session '%s' is unfinished; recovered %" PRIu64 " frames, no cues\n",
+       filename, frames);
+    }
+
+    if(data_offset > size || frames > (size - data_offset) / channels / sizeof(T) ||
+     cue_offset > size || num_cues > (size - cue_offset) / cue_length)
+    {
+      fprintf(stderr, "session '%s' is truncated\n", filename);
+      return false;
+    }
+
+    std::vector<AudioCue> cues(num_cues);
+    for(size_t i = 0; i < num_cues; i++)
+    {
+      const uint8_t *pos = data + cue_offset + i * cue_length;
+      uint32_t type = get32(pos + 8);
+      if(type > AudioCue::Patch)
+      {
+        fprintf(stderr, "session '%s' has an unknown cue type %" PRIu32 "\n",
+         filename, type);
+        return false;
+      }
+      cues[i].frame = get64(pos);
+      cues[i].type  = static_cast<AudioCue::Type>(type);
+      cues[i].value = static_cast<int32_t>(get32(pos + 12));
+    }
+
+    buffer.channels = channels;
+    buffer.rate = rate;
+    buffer.assign(file, reinterpret_cast<const T *>(data + data_offset),
+     frames, std::move(cues));
+    return true;
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int16_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(buffer, start, filename);
+  }
+
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int32_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
+  {
+    return _save(buffer, start, filename);
+  }
+
+  bool load(AudioBuffer<int16_t> &buffer, const char *filename) const override
+  {
+    return _load(buffer, filename);
+  }
+
+  bool load(AudioBuffer<int32_t> &buffer, const char *filename) const override
+  {
+    return _load(buffer, filename);
+  }
+} session;
+
+const AudioFormat &AudioFormatSession = session;
@@ -0,0 +1,63 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOFORMAT_SESSION_HPP
+#define AUDIOFORMAT_SESSION_HPP
+
+#include "AudioBuffer.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Capture session container: the unprocessed recording buffer plus its
+ * metadata and full cue list, so the post-capture pipeline can be re-run
+ * without recording again. Sample data is stored in native byte order and
+ * aligned so it can be memory mapped directly.
+ *
+ *   0x00  "ITIRSESS"
+ *   0x08  uint16 version
+ *   0x0a  uint16 channels
+ *   0x0c  uint32 rate
+ *   0x10  uint16 bytes per sample
+ *   0x12  uint16 reserved
+ *   0x14  uint32 size of one cue record
+ *   0x18  uint64 frames
+ *   0x20  uint64 sample data offset
+ *   0x28  uint64 cue list offset (0: unfinished dump, no cues)
+ *   0x30  uint64 number of cues
+ *   0x38  8 bytes reserved
+ *
+ * Cue records: uint64 frame, uint32 type, int32 value.
+ */
+class SessionFormat
+{
+public:
+  static constexpr unsigned VERSION = 1;
+  static constexpr unsigned HEADER_LENGTH = 64;
+  static constexpr unsigned CUE_LENGTH = 16;
+  static constexpr size_t DATA_ALIGN = 4096;
+
+  static void header(uint8_t (&out)[HEADER_LENGTH], unsigned channels,
+   unsigned rate, unsigned sample_bytes, uint64_t frames, uint64_t cue_offset,
+   uint64_t num_cues);
+
+  static void cues(std::vector<uint8_t> &out, const std::vector<AudioCue> &cues);
+};
+
+#endif /* AUDIOFORMAT_SESSION_HPP */
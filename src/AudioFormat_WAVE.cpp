@@ -18,10 +18,58 @@
 
 #include "AudioFormat.hpp"
 
+#include <stdio.h>
+
+class WAVConfig : public ConfigInterface
+{
+public:
+  enum formats
+  {
+    AUTO,
+    S16,
+    S24,
+    S32,
+    FLOAT,
+  };
+
+  static constexpr EnumValue Formats[] =
+  {
+    { "auto", AUTO },
+    { "s16", S16 },
+    { "s24", S24 },
+    { "s32", S32 },
+    { "float", FLOAT },
+    { }
+  };
+
+  Enum<Formats>     Format;
+
+  WAVConfig(ConfigContext &_ctx, const char *_tag, int _id):
+   ConfigInterface(_ctx, _tag, _id),
+   Format(options, "auto", "Format")
+  {}
+
+  virtual ~WAVConfig() {}
+};
+
+class WAVConfigRegister : public ConfigRegister
+{
+public:
+  WAVConfigRegister(const char *_tag): ConfigRegister(_tag) {}
+
+  std::shared_ptr<ConfigInterface> generate(ConfigContext &ctx,
+   const char *tag, int id) const
+  {
+    return std::shared_ptr<ConfigInterface>(new WAVConfig(ctx, tag, id));
+  }
+} reg_wav("WAV");
+
+
 class Chunk
 {
   std::vector<std::reference_wrapper<Chunk>> subchunks;
   std::vector<uint8_t> data;
+  uint64_t streamed = 0;
   char magic[4];
 
 public:
@@ -33,12 +81,13 @@ public:
     magic[3] = d;
   }
 
-  size_t length() const
+  /* Length of the chunk contents, excluding the header and padding. */
+  uint64_t length() const
   {
-    size_t len = data.size();
+    uint64_t len = data.size() + streamed;
 
     for(const Chunk &c : subchunks)
-      len += c.length() + 8;
+      len += c.length() + (c.length() & 1) + 8;
 
     return len;
   }
@@ -58,23 +107,43 @@ public:
     subchunks.push_back(c);
   }
 
+  void insert_string(const char *str)
+  {
+    data.insert(data.end(), str, str + strlen(str) + 1);
+  }
+
   void reserve(size_t sz)
   {
     data.reserve(sz);
   }
 
+  /* Contents will be written by the caller after this chunk is flushed.
+   * This must be the last chunk in the file. */
+  void stream(uint64_t len)
+  {
+    streamed = len;
+  }
+
+  /* Lengths over 4 GiB are written as 0xFFFFFFFF (RF64); the real length
+   * must be stored in the ds64 chunk. */
   void flush(std::vector<uint8_t> &out)
   {
     for(char c : magic)
       out.push_back(c);
 
-    size_t len = length();
+    uint64_t len = length();
+    if(len > UINT32_MAX)
+      len = UINT32_MAX;
+
     out.push_back(len & 0xff);
     out.push_back((len >> 8) & 0xff);
     out.push_back((len >> 16) & 0xff);
     out.push_back((len >> 24) & 0xff);
 
     out.insert(out.end(), data.begin(), data.end());
+    if(!streamed && (data.size() & 1))
+      out.push_back(0);
+
     data = std::vector<uint8_t>(); /* Delete contents. */
 
     for(Chunk &c : subchunks)
@@ -123,60 +192,282 @@ void Chunk::insert(int32_t v)
   insert(static_cast<uint32_t>(v));
 }
 
+template<>
+void Chunk::insert(uint64_t v)
+{
+  insert(
+    static_cast<uint32_t>(v & 0xffffffff),
+    static_cast<uint32_t>(v >> 32)
+  );
+}
+
 
 static const class _AudioFormatWAVE : public AudioFormat
 {
+  static constexpr uint16_t WAVE_FORMAT_PCM = 0x0001;
+  static constexpr uint16_t WAVE_FORMAT_IEEE_FLOAT = 0x0003;
+  static constexpr uint16_t WAVE_FORMAT_EXTENSIBLE = 0xfffe;
+
+  /* KSDATAFORMAT_SUBTYPE_xxx GUID, minus the leading format tag. */
+  static constexpr uint8_t SUBTYPE_GUID[14] =
+  {
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+    0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+  };
+
+  struct format
+  {
+    unsigned bits;
+    bool is_float;
+
+    unsigned bytes() const
+    {
+      return bits / 8;
+    }
+  };
+
   template<class T>
-  bool _convert(std::vector<uint8_t> &out, const AudioBuffer<T> &buffer,
-   const AudioCue &start, const AudioCue &end) const
+  static format get_format(ConfigContext &ctx)
   {
-    Chunk riff('R','I','F','F');
-    riff.insert('W','A','V','E');
+    const auto wav = ctx.get_interface_as<WAVConfig>("WAV");
+    unsigned value = wav ? wav->Format.value() : 0;
+    switch(value)
+    {
+      case WAVConfig::S16:    return { 16, false };
+      case WAVConfig::S24:    return { 24, false };
+      case WAVConfig::S32:    return { 32, false };
+      case WAVConfig::FLOAT:  return { 32, true };
+    }
+    return { static_cast<unsigned>(8 * sizeof(T)), false };
+  }
+
+  /* Sample conversion via a left-aligned 32-bit value. */
+  static inline int32_t to_s32(int16_t d)
+  {
+    return static_cast<uint32_t>(d) << 16;
+  }
+  static inline int32_t to_s32(int32_t d)
+  {
+    return d;
+  }
+
+  template<class T>
+  static inline void cvt(uint8_t *&pos, T d, const format &fmt)
+  {
+    uint32_t v;
+    if(fmt.is_float)
+    {
+      float f = to_s32(d) / 2147483648.0f;
+      memcpy(&v, &f, sizeof(v));
+    }
+    else
+      v = to_s32(d) >> (32 - fmt.bits);
+
+    for(size_t i = 0; i < fmt.bytes(); i++)
+      *(pos++) = v >> (i * 8);
+  }
+
+  /**
+   * Build a fmt chunk. WAVE_FORMAT_EXTENSIBLE is used for anything that
+   * isn't 8/16-bit mono/stereo integer PCM.
+   */
+  static void write_fmt(Chunk &fmt_, const format &fmt, unsigned channels,
+   unsigned rate)
+  {
+    uint16_t tag = fmt.is_float ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    bool extensible = fmt.is_float || fmt.bits > 16 || channels > 2;
+
+    fmt_.insert<uint16_t>(extensible ? WAVE_FORMAT_EXTENSIBLE : tag);
+    fmt_.insert<uint16_t>(channels);
+    fmt_.insert<uint32_t>(rate);
+    fmt_.insert<uint32_t>(rate * channels * fmt.bytes());
+    fmt_.insert<uint16_t>(channels * fmt.bytes());
+    fmt_.insert<uint16_t>(fmt.bits);
+
+    if(extensible)
+    {
+      uint32_t mask = (channels == 1) ? 0x4 : (1UL << channels) - 1;
+
+      fmt_.insert<uint16_t>(22);          /* Extension size */
+      fmt_.insert<uint16_t>(fmt.bits);    /* Valid bits per sample */
+      fmt_.insert<uint32_t>(mask);        /* Channel mask */
+      fmt_.insert<uint16_t>(tag);         /* Subformat GUID */
+      for(uint8_t b : SUBTYPE_GUID)
+        fmt_.insert<uint8_t>(b);
+    }
+  }
+
+  /**
+   * Build a smpl chunk for a single note. There are no loop points since
+   * notes are recorded as one-shots.
+   */
+  static void write_smpl(Chunk &smpl, unsigned note, unsigned rate)
+  {
+    smpl.insert<uint32_t>(0);             /* Manufacturer */
+    smpl.insert<uint32_t>(0);             /* Product */
+    smpl.insert<uint32_t>(1000000000UL / rate); /* Sample period (ns) */
+    smpl.insert<uint32_t>(note);          /* MIDI unity note */
+    smpl.insert<uint32_t>(0);             /* MIDI pitch fraction */
+    smpl.insert<uint32_t>(0);             /* SMPTE format */
+    smpl.insert<uint32_t>(0);             /* SMPTE offset */
+    smpl.insert<uint32_t>(0);             /* Number of loops */
+    smpl.insert<uint32_t>(0);             /* Sampler data */
+  }
+
+  template<class T>
+  bool _save(ConfigContext &ctx, const AudioBuffer<T> &buffer,
+   const AudioCue &start, const AudioCue &end, const char *filename) const
+  {
+    format fmt = get_format<T>(ctx);
+    uint64_t frames = end.frame - start.frame;
+    uint64_t data_length = frames * buffer.channels * fmt.bytes();
 
     Chunk fmt_('f','m','t',' ');
-    riff.insert(fmt_);
-    fmt_.insert<int16_t>(1);
-    fmt_.insert<uint16_t>(buffer.channels);
-    fmt_.insert<uint32_t>(buffer.rate);
-    fmt_.insert<uint32_t>(buffer.rate * buffer.channels * sizeof(T));
-    fmt_.insert<uint16_t>(buffer.channels * sizeof(T));
-    fmt_.insert<uint16_t>(8 * sizeof(T));
+    write_fmt(fmt_, fmt, buffer.channels, buffer.rate);
+
+    /* Individual notes get a smpl chunk with their root note. Full buffers
+     * get cue points and labels for every note cue in the buffer instead. */
+    Chunk smpl('s','m','p','l');
+    Chunk cue_('c','u','e',' ');
+    Chunk list('L','I','S','T');
+    std::vector<Chunk> labels;
+    std::vector<AudioCue> cues;
+
+    if(start.value >= 0)
+      write_smpl(smpl, AudioCue::note_of(start.value), buffer.rate);
+    else
+    {
+      for(const AudioCue &c : buffer.get_cues())
+      {
+        if((c.type == AudioCue::NoteOn || c.type == AudioCue::NoteOff) &&
+         c.frame >= start.frame && c.frame <= end.frame)
+          cues.push_back(c);
+      }
+
+      cue_.insert<uint32_t>(cues.size());
+      list.insert('a','d','t','l');
+      labels.reserve(cues.size());
+      for(size_t i = 0; i < cues.size(); i++)
+      {
+        cue_.insert<uint32_t>(i + 1);     /* ID */
+        cue_.insert<uint32_t>(cues[i].frame - start.frame); /* Position */
+        cue_.insert('d','a','t','a');     /* Chunk */
+        cue_.insert<uint32_t>(0);         /* Chunk start */
+        cue_.insert<uint32_t>(0);         /* Block start */
+        cue_.insert<uint32_t>(cues[i].frame - start.frame); /* Sample offset */
+
+        char text[48];
+        int value = cues[i].value;
+        if(AudioCue::velocity_of(value))
+        {
+          snprintf(text, sizeof(text), "%s %s v%u rr%u", AudioCue::type_str(cues[i].type),
+           MIDIInterface::get_note(AudioCue::note_of(value)),
+           AudioCue::velocity_of(value), AudioCue::take_of(value));
+        }
+        else
+          snprintf(text, sizeof(text), "%s %s", AudioCue::type_str(cues[i].type),
+           MIDIInterface::get_note(AudioCue::note_of(value)));
+
+        labels.emplace_back('l','a','b','l');
+        labels.back().insert<uint32_t>(i + 1);
+        labels.back().insert_string(text);
+        list.insert(labels.back());
+      }
+    }
+
+    std::vector<std::reference_wrapper<Chunk>> chunks{ fmt_ };
+    if(start.value >= 0)
+      chunks.push_back(smpl);
+    else
+
+    if(cues.size())
+    {
+      chunks.push_back(cue_);
+      chunks.push_back(list);
+    }
 
     Chunk data('d','a','t','a');
-    riff.insert(data);
+    data.stream(data_length);
+    chunks.push_back(data);
+
+    /* Promote to RF64 if the RIFF length doesn't fit. */
+    uint64_t riff_length = 4;
+    for(const Chunk &c : chunks)
+      riff_length += c.length() + (c.length() & 1) + 8;
 
-    const std::vector<T> &smp = buffer.get_samples();
-    size_t pos = start.frame * buffer.channels;
-    size_t stop = end.frame * buffer.channels;
+    bool rf64 = (riff_length > UINT32_MAX);
+    Chunk ds64('d','s','6','4');
+    if(rf64)
+    {
+      riff_length += 8 + 28;
+      ds64.insert<uint64_t>(riff_length); /* RIFF size */
+      ds64.insert<uint64_t>(data_length); /* data size */
+      ds64.insert<uint64_t>(frames);      /* Sample count */
+      ds64.insert<uint32_t>(0);           /* Table length */
+      chunks.insert(chunks.begin(), ds64);
+    }
 
-    data.reserve((stop - pos) * sizeof(T));
-    for(; pos < stop; pos++)
-      data.insert(smp[pos]);
+    Chunk riff = rf64 ? Chunk('R','F','6','4') : Chunk('R','I','F','F');
+    riff.insert('W','A','V','E');
+    for(Chunk &c : chunks)
+      riff.insert(c);
 
-    out.reserve(riff.length() + 8);
+    std::vector<uint8_t> out;
     riff.flush(out);
-    return true;
-  }
 
-  virtual bool convert(ConfigContext &ctx,
-   std::vector<uint8_t> &out, const AudioBuffer<uint8_t> &buffer,
-   const AudioCue &start, const AudioCue &end) const override
-  {
-    return _convert(out, buffer, start, end);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+      return false;
+
+    bool ret = false;
+    if(fwrite(out.data(), 1, out.size(), fp) < out.size())
+      goto err;
+
+    /* Stream sample data. */
+    {
+      static constexpr size_t BLOCK_FRAMES = 16384;
+      size_t pos = start.frame * buffer.channels;
+      size_t stop = end.frame * buffer.channels;
+
+      out.resize(BLOCK_FRAMES * buffer.channels * fmt.bytes() + 1);
+      while(pos < stop)
+      {
+        size_t block_end = std::min(stop, pos + BLOCK_FRAMES * buffer.channels);
+        uint8_t *dest = out.data();
+        for(; pos < block_end; pos++)
+          cvt(dest, buffer[pos], fmt);
+
+        /* Pad byte */
+        if(pos >= stop && (data_length & 1))
+          *(dest++) = 0;
+
+        size_t len = dest - out.data();
+        if(fwrite(out.data(), 1, len, fp) < len)
+          goto err;
+      }
+    }
+    ret = true;
+
+  err:
+    if(!ret)
+      fprintf(stderr, "error writing file '%s'\n", filename);
+
+    fclose(fp);
+    return ret;
   }
 
-  virtual bool convert(ConfigContext &ctx,
-   std::vector<uint8_t> &out, const AudioBuffer<int16_t> &buffer,
-   const AudioCue &start, const AudioCue &end) const override
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int16_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
   {
-    return _convert(out, buffer, start, end);
+    return _save(ctx, buffer, start, end, filename);
   }
 
-  virtual bool convert(ConfigContext &ctx,
-   std::vector<uint8_t> &out, const AudioBuffer<int32_t> &buffer,
-   const AudioCue &start, const AudioCue &end) const override
+  bool save(ConfigContext &ctx,
+   const AudioBuffer<int32_t> &buffer, const AudioCue &start, const AudioCue &end,
+   const char *filename) const override
   {
-    return _convert(out, buffer, start, end);
+    return _save(ctx, buffer, start, end, filename);
   }
 } wave;
 
@@ -127,6 +127,9 @@ std::shared_ptr<ConfigInterface> ConfigRegister::generate_config(ConfigContext &
 
 std::shared_ptr<ConfigInterface> ConfigContext::get_interface(const char *tag, int id)
 {
+  /* Output formats may look up interfaces from multiple threads. */
+  std::lock_guard<std::mutex> guard(interfaces_lock);
+
   for(auto &interface : interfaces)
   {
     if(!strcasecmp(tag, interface->tag) && interface->id == id)
@@ -357,7 +360,8 @@ bool ConfigContext::parse_config_file(const char *filename)
   if(fstat(fd, &st) != 0)
     goto err;
 
-  contents.resize(st.st_size);
+  /* Parser expects a nul-terminated string. */
+  contents.resize(st.st_size + 1);
 
   if(fread(contents.data(), st.st_size, 1, fp) < 1)
     goto err;
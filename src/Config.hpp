@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 class ConfigOption
@@ -326,6 +327,7 @@ public:
 class ConfigContext
 {
   std::vector<std::shared_ptr<ConfigInterface>> interfaces;
+  std::mutex interfaces_lock;
   int current_cfg;
   int current_line;
 
@@ -365,6 +367,30 @@ class GlobalConfig : public ConfigInterface
 public:
   static constexpr unsigned max_inputs = 32;
 
+  enum midi_queue_modes
+  {
+    MIDI_QUEUE_OFF,
+    MIDI_QUEUE_SYSTEM,
+    MIDI_QUEUE_PCM,
+  };
+
+  static constexpr EnumValue MIDIQueueModes[] =
+  {
+    { "off", MIDI_QUEUE_OFF },
+    { "system", MIDI_QUEUE_SYSTEM },
+    { "pcm", MIDI_QUEUE_PCM },
+    { }
+  };
+
+  /* Matches Log::Level. */
+  static constexpr EnumValue LogLevels[] =
+  {
+    { "error", 0 },
+    { "info", 1 },
+    { "debug", 2 },
+    { }
+  };
+
   /* Audio recording options. */
   OptionString<31>  audio_driver;
   OptionString<31>  audio_device;
@@ -374,14 +400,24 @@ public:
   Option<unsigned>  output_noise_threshold;
   Option<unsigned>  output_noise_ms;
   OptionBool        output_debug;
+  OptionBool        output_timing;
   OptionBool        output_dump;
+  OptionBool        output_dump_direct;
+  OptionBool        output_session;
   OptionBool        output_flac;
   OptionBool        output_wav;
+  OptionBool        output_session_wav;
   OptionBool        output_sam;
   OptionBool        output_iti;
+  OptionBool        output_it;
+  OptionBool        output_sfz;
+  OptionBool        output_sf2;
 
   /* Patch playback configuration. */
   OptionBool        program_on;
+  OptionBool        program_changes;
+  Enum<MIDIQueueModes> midi_queue;
+  Enum<LogLevels>   log_level;
 
   GlobalConfig(ConfigContext &_ctx, const char *_tag, int _id):
    ConfigInterface(_ctx, _tag, _id),
@@ -393,12 +429,22 @@ public:
    output_noise_threshold(options, 5, 0, INT16_MAX, "OutputNoiseThreshold"),
    output_noise_ms(options, 30*1000, 1000, UINT_MAX, "OutputNoiseMS"),
    output_debug(options, false, "OutputDebugFiles"),
+   output_timing(options, false, "OutputTiming"),
    output_dump(options, false, "OutputDump"),
+   output_dump_direct(options, false, "OutputDumpDirect"),
+   output_session(options, true, "OutputSession"),
    output_flac(options, false, "OutputFLAC"),
    output_wav(options, true, "OutputWAV"),
+   output_session_wav(options, false, "OutputSessionWAV"),
    output_sam(options, false, "OutputSAM"),
    output_iti(options, true, "OutputITI"),
-   program_on(options, true, "Program")
+   output_it(options, false, "OutputIT"),
+   output_sfz(options, false, "OutputSFZ"),
+   output_sf2(options, false, "OutputSF2"),
+   program_on(options, true, "Program"),
+   program_changes(options, true, "ProgramChanges"),
+   midi_queue(options, "off", "MIDIQueue"),
+   log_level(options, "debug", "LogLevel")
   {}
 
   virtual ~GlobalConfig() {}
@@ -408,12 +454,24 @@ class InputConfig : public ConfigInterface
 {
 public:
   OptionString<32>  midi_device;
+  OptionString<32>  seq_device;
   Option<unsigned>  midi_channel;
+  Option<unsigned>  byte_rate;
+  Option<unsigned>  sysex_delay_ms;
+  Option<unsigned>  latency_us;
+  Option<unsigned>  latency_jitter_us;
+  Option<unsigned>  audio_pair;
 
   InputConfig(ConfigContext &_ctx, const char *_tag, int _id):
    ConfigInterface(_ctx, _tag, _id),
    midi_device(options, "hw:1,0,0", "Device"),
-   midi_channel(options, 1, 1, 16, "Channel")
+   seq_device(options, "", "SeqDevice"),
+   midi_channel(options, 1, 1, 16, "Channel"),
+   byte_rate(options, 0, 0, 1000000, "ByteRate"),
+   sysex_delay_ms(options, 0, 0, 10000, "SysExDelay_ms"),
+   latency_us(options, 0, 0, 1000000, "Latency_us"),
+   latency_jitter_us(options, 0, 0, 1000000, "LatencyJitter_us"),
+   audio_pair(options, 0, 0, 32, "AudioPair")
   {}
 
   virtual ~InputConfig() {}
@@ -20,126 +20,192 @@
 #define EVENT_HPP
 
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <memory>
-#include <queue>
+#include <algorithm>
+#include <vector>
 
+/* Events are plain records stored in a contiguous timeline. Variable-length
+ * payloads (MIDI data, messages) are stored in a byte arena owned by the
+ * schedule, so building even a very large schedule doesn't allocate per
+ * event. The task function receives the event and its payload. */
 class Event
 {
 public:
-  int time_ms;
-
-  Event(int _time_ms): time_ms(_time_ms) {}
-
-  virtual void task() const = 0;
-};
-
-class EventCompare
-{
-public:
-  bool operator()(const std::shared_ptr<Event> &a,
-   const std::shared_ptr<Event> &b) const
-  {
-    return a->time_ms > b->time_ms;
-  }
+  typedef void (*Task)(const Event &e, const uint8_t *data);
+
+  /* Absolute offset from the start of the timeline in microseconds.
+   * Negative times are run before the timeline starts. */
+  int64_t time_us;
+
+  Task task;
+  const void *target;
+  unsigned param;
+  int value;
+  uint32_t data_offset;
+  uint32_t data_length;
 };
 
 class EventSchedule
 {
-  static constexpr int START_TIME = -3;
-  int prev_time_ms = START_TIME;
-  int max_time_ms = 0;
+  static constexpr int64_t START_TIME = -3;
+  int64_t prev_time_us = START_TIME;
+  int64_t max_time_us = 0;
 
-  std::priority_queue<
-    std::shared_ptr<Event>,
-    std::vector<std::shared_ptr<Event>>,
-    EventCompare> queue;
+  std::vector<Event> timeline;
+  std::vector<uint8_t> arena;
+  size_t position = 0;
+  bool sorted = true;
 
-  std::vector<std::shared_ptr<Event>> dont_free;
+  void sort()
+  {
+    /* Stable: events at the same time run in the order they were added. */
+    std::stable_sort(timeline.begin() + position, timeline.end(),
+     [](const Event &a, const Event &b)
+     {
+       return a.time_us < b.time_us;
+     });
+    sorted = true;
+  }
 
 public:
-  static constexpr int NOTICE_TIME = -2;
-  static constexpr int PROGRAM_TIME = -1;
+  static constexpr int64_t NOTICE_TIME = -2;
+  static constexpr int64_t PROGRAM_TIME = -1;
 
-  void push(const std::shared_ptr<Event> &e)
+  void reserve(size_t events, size_t data_bytes)
   {
-    max_time_ms = std::max(max_time_ms, e->time_ms);
-    queue.push(e);
-    dont_free.push_back(e);
+    timeline.reserve(timeline.size() + events);
+    arena.reserve(arena.size() + data_bytes);
   }
 
-  void push(std::shared_ptr<Event> &&e)
+  void push(int64_t time_us, Event::Task task, const void *target,
+   unsigned param = 0, int value = 0,
+   const void *data = nullptr, size_t data_length = 0)
   {
-    max_time_ms = std::max(max_time_ms, e->time_ms);
-    dont_free.push_back(e);
-    queue.push(std::move(e));
+    Event e;
+    e.time_us = time_us;
+    e.task = task;
+    e.target = target;
+    e.param = param;
+    e.value = value;
+    e.data_offset = arena.size();
+    e.data_length = data_length;
+
+    if(data_length)
+    {
+      const uint8_t *d = static_cast<const uint8_t *>(data);
+      arena.insert(arena.end(), d, d + data_length);
+    }
+
+    if(timeline.size() > position && time_us < timeline.back().time_us)
+      sorted = false;
+
+    max_time_us = std::max(max_time_us, time_us);
+    timeline.push_back(e);
   }
 
-  std::shared_ptr<Event> pop()
+  const Event &peek()
   {
-    std::shared_ptr<Event> p = queue.top();
-
-    prev_time_ms = p->time_ms;
+    if(!sorted)
+      sort();
 
-    queue.pop();
-    return p;
+    return timeline[position];
   }
 
-  const std::shared_ptr<Event> &peek() const
+  /* Run the next event and advance the timeline. */
+  void run_next()
   {
-    return queue.top();
+    const Event &e = peek();
+    prev_time_us = e.time_us;
+    position++;
+
+    e.task(e, arena.data() + e.data_offset);
   }
 
   bool has_next() const
   {
-    return !queue.empty();
+    return position < timeline.size();
   }
 
-  int previous_time() const
+  size_t remaining_events() const
   {
-    return prev_time_ms;
+    return timeline.size() - position;
   }
 
-  int next_time() const
+  /* Call f(event, data) for each remaining event at a given time. */
+  template<class F>
+  void for_each_at(int64_t time_us, F &&f) const
   {
-    return peek()->time_ms;
+    for(size_t i = position; i < timeline.size(); i++)
+      if(timeline[i].time_us == time_us)
+        f(timeline[i], arena.data() + timeline[i].data_offset);
   }
 
-  int remaining_duration() const
+  /**
+   * Copy the remaining events of another schedule into this one.
+   *
+   * @param other       Schedule to copy events and payloads from.
+   * @param offset_us   Offset added to the times of timeline events.
+   * @param program_us  New time for PROGRAM_TIME events.
+   */
+  void append(EventSchedule &other, int64_t offset_us, int64_t program_us)
   {
-    return max_time_ms - prev_time_ms;
+    if(!other.sorted)
+      other.sort();
+
+    reserve(other.timeline.size() - other.position, other.arena.size());
+    for(size_t i = other.position; i < other.timeline.size(); i++)
+    {
+      const Event &e = other.timeline[i];
+      int64_t time_us = e.time_us;
+      if(time_us >= 0)
+        time_us += offset_us;
+      else
+
+      if(time_us == PROGRAM_TIME)
+        time_us = program_us;
+
+      push(time_us, e.task, e.target, e.param, e.value,
+       other.arena.data() + e.data_offset, e.data_length);
+    }
   }
 
-  int total_duration() const
+  int64_t previous_time() const
   {
-    return max_time_ms;
+    return prev_time_us;
   }
-};
 
+  int64_t next_time()
+  {
+    return peek().time_us;
+  }
 
-/* Events */
-class NoticeEvent : public Event
-{
-  std::vector<char> message;
+  int64_t remaining_duration() const
+  {
+    return max_time_us - prev_time_us;
+  }
 
-public:
-  NoticeEvent(const char *_message, int _time_ms): Event(_time_ms)
+  int64_t total_duration() const
   {
-    size_t len = strlen(_message);
-    message.insert(message.begin(), _message, _message + len + 1);
+    return max_time_us;
   }
+};
 
-  //virtual ~NoticeEvent() {}
 
-  virtual void task() const
+/* Events */
+class NoticeEvent
+{
+  static void task(const Event &e, const uint8_t *data)
   {
-    fprintf(stderr, "%s\n", message.data());
+    fprintf(stderr, "%s\n", reinterpret_cast<const char *>(data));
   }
 
+public:
   static void schedule(EventSchedule &ev, const char *_message)
   {
-    ev.push(std::shared_ptr<Event>(new NoticeEvent(_message, EventSchedule::NOTICE_TIME)));
+    ev.push(EventSchedule::NOTICE_TIME, task, nullptr, 0, 0,
+     _message, strlen(_message) + 1);
   }
 };
 
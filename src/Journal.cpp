@@ -0,0 +1,187 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Journal.hpp"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+Journal::~Journal()
+{
+  close();
+}
+
+bool Journal::load(const char *filename)
+{
+  FILE *in = fopen(filename, "r");
+  if(!in)
+  {
+    fprintf(stderr, "failed to open journal '%s'\n", filename);
+    return false;
+  }
+
+  char line[1024];
+  unsigned line_num = 0;
+  while(fgets(line, sizeof(line), in))
+  {
+    uint64_t start;
+    uint64_t end;
+    int value;
+    int len;
+
+    line_num++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if(!line[0] || line[0] == '#')
+      continue;
+
+    if(!strncmp(line, "session ", 8) && line[8])
+    {
+      runs.push_back({ line + 8, {} });
+    }
+    else
+
+    /* An interrupted write can leave a partial last line; ignore it. */
+    if(sscanf(line, "note %" SCNu64 " %" SCNu64 " %d%n", &start, &end, &value, &len) == 3 &&
+     !line[len] && !runs.empty() && start < end)
+    {
+      runs.back().regions.push_back({ start, end, value });
+    }
+    else
+      fprintf(stderr, "journal '%s' line %u: ignoring '%s'\n", filename, line_num, line);
+  }
+  fclose(in);
+  return true;
+}
+
+bool Journal::open(const char *filename, bool append, const char *session,
+ const std::vector<AudioCue> &_cues)
+{
+  close();
+  fp = fopen(filename, append ? "a" : "w");
+  if(!fp)
+  {
+    fprintf(stderr, "failed to open journal '%s'\n", filename);
+    return false;
+  }
+  if(!append)
+  {
+    runs.clear();
+    fprintf(fp, "# ITI Recorder capture journal\n");
+  }
+
+  runs.push_back({ session, {} });
+  cues = &_cues;
+
+  fprintf(fp, "session %s\n", session);
+  fflush(fp);
+  fdatasync(fileno(fp));
+
+  thread = std::thread(&Journal::run, this);
+  return true;
+}
+
+/* Stop the writer once every queued region has been written. */
+void Journal::close()
+{
+  if(thread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+  pending.clear();
+  stop = false;
+
+  if(fp)
+    fclose(fp);
+
+  fp = nullptr;
+  cues = nullptr;
+}
+
+void Journal::run()
+{
+  /* Leave signals (capture callback, abort) to the main thread. */
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  std::vector<Region> regions;
+  std::unique_lock<std::mutex> guard(lock);
+  while(true)
+  {
+    cond.wait(guard, [this]{ return stop || pending.size(); });
+    if(pending.empty())
+      break;
+
+    regions.swap(pending);
+    guard.unlock();
+
+    for(const Region &r : regions)
+      fprintf(fp, "note %" PRIu64 " %" PRIu64 " %d\n", r.start, r.end, r.value);
+    fflush(fp);
+    fdatasync(fileno(fp));
+    regions.clear();
+
+    guard.lock();
+  }
+}
+
+void Journal::record()
+{
+  if(!fp || !cues || cues->size() < 2)
+    return;
+
+  const AudioCue &on = (*cues)[cues->size() - 2];
+  const AudioCue &off = (*cues)[cues->size() - 1];
+  if(on.type != AudioCue::NoteOn || off.type != AudioCue::NoteOff ||
+   on.value != off.value || on.frame >= off.frame)
+    return;
+
+  Region region{ on.frame, off.frame, on.value };
+  runs.back().regions.push_back(region);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending.push_back(region);
+  }
+  cond.notify_one();
+}
+
+void Journal::truncate(size_t run, uint64_t frames)
+{
+  if(run >= runs.size())
+    return;
+
+  std::vector<Region> &regions = runs[run].regions;
+  size_t count = regions.size();
+
+  regions.erase(std::remove_if(regions.begin(), regions.end(),
+   [frames](const Region &r){ return r.end > frames; }), regions.end());
+
+  if(regions.size() < count)
+  {
+    fprintf(stderr, "journal: %zu note(s) missing from '%s' will be recorded again\n",
+     count - regions.size(), runs[run].session.c_str());
+  }
+}
@@ -0,0 +1,123 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include "AudioBuffer.hpp"
+#include "Event.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Text log of the note regions completed during a capture. Each run names
+ * the session file its audio is dumped to, followed by one line per note as
+ * soon as its off cue is placed. Lines are written and synced to disk by a
+ * writer thread, keeping disk I/O out of the event loop, so a crashed or
+ * aborted capture can be continued with --resume.
+ */
+class Journal
+{
+public:
+  struct Region
+  {
+    uint64_t start;
+    uint64_t end;
+    int value;
+  };
+
+  struct Run
+  {
+    std::string session;
+    std::vector<Region> regions;
+  };
+
+private:
+  std::vector<Run> runs;
+  const std::vector<AudioCue> *cues = nullptr;
+  FILE *fp = nullptr;
+
+  /* Regions recorded but not yet written by the writer thread. */
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<Region> pending;
+  bool stop = false;
+
+  void run();
+
+public:
+  ~Journal();
+
+  /**
+   * Read an existing journal.
+   *
+   * @param filename  Journal filename.
+   * @returns         `true` on success, otherwise `false`.
+   */
+  bool load(const char *filename);
+
+  /**
+   * Open the journal for writing and start a new run.
+   *
+   * @param filename  Journal filename.
+   * @param append    Keep the existing journal (resume) instead of replacing it.
+   * @param session   Session file the audio of this run is dumped to.
+   * @param _cues     Cue list of the buffer being captured.
+   * @returns         `true` on success, otherwise `false`.
+   */
+  bool open(const char *filename, bool append, const char *session,
+   const std::vector<AudioCue> &_cues);
+  void close();
+
+  /* Queue the most recent note region of the current run, if complete,
+   * to be written by the writer thread. */
+  void record();
+
+  /* Drop the regions of a run that weren't completely written to its session. */
+  void truncate(size_t run, uint64_t frames);
+
+  const std::vector<Run> &get_runs() const
+  {
+    return runs;
+  }
+};
+
+class JournalEvent
+{
+  static void task(const Event &e, const uint8_t *data)
+  {
+    /* Journal events only target journals passed as non-const in schedule(). */
+    const_cast<Journal *>(static_cast<const Journal *>(e.target))->record();
+  }
+
+public:
+  /* Schedule after the off cue of a note so the region gets logged. */
+  static void schedule(EventSchedule &ev, Journal &journal, int64_t _time_us)
+  {
+    ev.push(_time_us, task, &journal);
+  }
+};
+
+#endif /* JOURNAL_HPP */
@@ -0,0 +1,272 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Log.hpp"
+
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/* Records are 8-aligned and never wrap; a skip record fills the end of the
+ * ring when the next record doesn't fit. */
+static constexpr size_t RING_SIZE = 1 << 20;
+static constexpr size_t MAX_TEXT = 1024;
+
+enum record_type : uint32_t
+{
+  RECORD_TEXT,
+  RECORD_HEX,
+  RECORD_SKIP,
+};
+
+struct Record
+{
+  uint32_t size;
+  record_type type;
+};
+
+static_assert(sizeof(Record) == 8, "records must stay 8-aligned");
+
+alignas(8) static uint8_t ring[RING_SIZE];
+static std::atomic<size_t> head{0};
+static std::atomic<size_t> tail{0};
+static std::atomic<size_t> dropped{0};
+static std::atomic<int> log_level{Log::DEBUG};
+static std::atomic<bool> running{false};
+static std::atomic<bool> stopping{false};
+static std::atomic_flag producer_lock = ATOMIC_FLAG_INIT;
+static std::thread writer;
+static sem_t sem;
+
+/* Serializes producers. Records are short copies, so spin. */
+class ProducerLock
+{
+public:
+  ProducerLock()
+  {
+    while(producer_lock.test_and_set(std::memory_order_acquire));
+  }
+
+  ~ProducerLock()
+  {
+    producer_lock.clear(std::memory_order_release);
+  }
+};
+
+static void write_hex(const uint8_t *data, size_t length)
+{
+  for(size_t i = 0; i < length; i++)
+  {
+    fprintf(stderr, "%02x ", data[i]);
+    if(data[i] == 0xf7)
+      fprintf(stderr, "\n");
+  }
+  fprintf(stderr, "\n");
+}
+
+static void write_record(const Record *r)
+{
+  const uint8_t *payload = reinterpret_cast<const uint8_t *>(r + 1);
+  size_t length = r->size - sizeof(Record);
+
+  if(r->type == RECORD_TEXT)
+    fputs(reinterpret_cast<const char *>(payload), stderr);
+  else
+
+  if(r->type == RECORD_HEX)
+  {
+    /* The length is padded; the real length precedes the data. */
+    uint32_t real_length;
+    memcpy(&real_length, payload, sizeof(real_length));
+    if(real_length <= length - sizeof(real_length))
+      write_hex(payload + sizeof(real_length), real_length);
+  }
+}
+
+static void drain()
+{
+  size_t pos = tail.load(std::memory_order_relaxed);
+  size_t end = head.load(std::memory_order_acquire);
+
+  while(pos < end)
+  {
+    const Record *r = reinterpret_cast<const Record *>(ring + pos % RING_SIZE);
+    write_record(r);
+    pos += r->size;
+  }
+  tail.store(pos, std::memory_order_release);
+
+  size_t lost = dropped.exchange(0);
+  if(lost)
+    fprintf(stderr, "log: %zu message(s) dropped\n", lost);
+}
+
+static void run()
+{
+  /* Leave signals (capture callback, abort) to the main thread. */
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  while(true)
+  {
+    sem_wait(&sem);
+    drain();
+    if(stopping && tail == head)
+      break;
+  }
+}
+
+/* Copy a record into the ring; drops it if the ring is full. Returns `false`
+ * if the writer isn't running, in which case the caller prints it. */
+static bool push(record_type type, const void *a, size_t a_len,
+ const void *b, size_t b_len)
+{
+  ProducerLock guard;
+  if(!running)
+    return false;
+
+  size_t size = (sizeof(Record) + a_len + b_len + 7) & ~(size_t)7;
+  size_t pos = head.load(std::memory_order_relaxed);
+  size_t used = pos - tail.load(std::memory_order_acquire);
+  size_t index = pos % RING_SIZE;
+  size_t skip = (RING_SIZE - index < size) ? RING_SIZE - index : 0;
+
+  if(size > RING_SIZE / 2 || used + skip + size > RING_SIZE)
+  {
+    dropped++;
+    sem_post(&sem);
+    return true;
+  }
+
+  if(skip)
+  {
+    Record r{ static_cast<uint32_t>(skip), RECORD_SKIP };
+    memcpy(ring + index, &r, sizeof(r));
+    pos += skip;
+    index = 0;
+  }
+
+  Record r{ static_cast<uint32_t>(size), type };
+  uint8_t *dest = ring + index;
+  memcpy(dest, &r, sizeof(r));
+  memcpy(dest + sizeof(r), a, a_len);
+  if(b_len)
+    memcpy(dest + sizeof(r) + a_len, b, b_len);
+
+  head.store(pos + size, std::memory_order_release);
+  sem_post(&sem);
+  return true;
+}
+
+void Log::set_level(Level level)
+{
+  log_level = level;
+}
+
+bool Log::enabled(Level level)
+{
+  return level <= log_level;
+}
+
+bool Log::start()
+{
+  if(running)
+    return true;
+
+  if(sem_init(&sem, 0, 0))
+    return false;
+
+  stopping = false;
+  writer = std::thread(run);
+  running = true;
+  return true;
+}
+
+void Log::stop()
+{
+  if(!running)
+    return;
+
+  stopping = true;
+  sem_post(&sem);
+  writer.join();
+  {
+    ProducerLock guard;
+    running = false;
+  }
+  /* Write anything another thread logged while the writer was exiting. */
+  drain();
+  sem_destroy(&sem);
+}
+
+void Log::flush()
+{
+  while(running && tail != head)
+  {
+    sem_post(&sem);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void Log::print(Level level, const char *fmt, ...)
+{
+  if(!enabled(level))
+    return;
+
+  va_list args;
+  va_start(args, fmt);
+  if(!running)
+  {
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    return;
+  }
+
+  char text[MAX_TEXT];
+  int len = vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  if(len < 0)
+    return;
+
+  len = std::min<int>(len, sizeof(text) - 1);
+  if(!push(RECORD_TEXT, text, len + 1, nullptr, 0))
+    fputs(text, stderr);
+}
+
+void Log::hex(Level level, const uint8_t *data, size_t length)
+{
+  if(!enabled(level))
+    return;
+
+  if(!running)
+  {
+    write_hex(data, length);
+    return;
+  }
+
+  uint32_t len = length;
+  if(!push(RECORD_HEX, &len, sizeof(len), data, length))
+    write_hex(data, length);
+}
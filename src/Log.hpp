@@ -0,0 +1,58 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Logging for the event loop. Messages are copied into a lock-free ring and
+ * written to stderr by a background thread, so scheduled events don't wait
+ * on the terminal. MIDI data is stored raw and only formatted by the writer.
+ * Any thread may log; producers share the ring through a short spin lock.
+ * Before start() and after stop(), messages are printed immediately.
+ */
+class Log
+{
+public:
+  enum Level
+  {
+    ERROR,
+    INFO,
+    DEBUG,
+  };
+
+  static void set_level(Level level);
+  static bool enabled(Level level);
+
+  /* Start or stop (after writing everything queued) the writer thread. */
+  static bool start();
+  static void stop();
+  /* Wait until everything queued has been written. */
+  static void flush();
+
+  static void print(Level level, const char *fmt, ...)
+   __attribute__((format(printf, 2, 3)));
+
+  /* Hex dump of MIDI data; SysEx messages are printed on separate lines. */
+  static void hex(Level level, const uint8_t *data, size_t length);
+};
+
+#endif /* LOG_HPP */
@@ -20,24 +20,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <algorithm>
+#include <map>
 
 #include "Config.hpp"
+#include "Log.hpp"
 #include "Midi.hpp"
 #include "Soundcard.hpp"
 
-void MIDIEvent::task() const
+void MIDIEvent::task(const Event &e, const uint8_t *data)
 {
-  //*
-  for(uint8_t d : data)
+  const MIDIInterface &interface = *static_cast<const MIDIInterface *>(e.target);
+  Log::hex(Log::DEBUG, data, e.data_length);
+
+  Soundcard &card = Soundcard::get();
+  if(e.time_us >= 0 && card.midi_queue_running())
+    card.midi_write_at(data, e.data_length, interface.device, e.time_us);
+  else
+    card.midi_write(data, e.data_length, interface.device);
+}
+
+/**
+ * Estimate how long the MIDI output of the events at a given time takes to
+ * send. Each output sends at MIDI speed or its input's ByteRate, whichever
+ * is slower, and pauses for its SysExDelay after each SysEx message.
+ * Separate outputs send at the same time.
+ *
+ * @param ev        Schedule containing the events.
+ * @param time_us   Time of the events, e.g. EventSchedule::PROGRAM_TIME.
+ * @returns         Estimated transfer time in microseconds.
+ */
+int64_t MIDIEvent::transfer_us(const EventSchedule &ev, int64_t time_us)
+{
+  static constexpr int64_t MIDI_BYTE_US = 320; /* 31250 baud, 10 bits */
+  int64_t output_us[GlobalConfig::max_inputs + 1]{};
+  int64_t total_us = 0;
+
+  ev.for_each_at(time_us, [&](const Event &e, const uint8_t *data)
   {
-    fprintf(stderr, "%02x ", d);
-    if(d == 0xf7)
-      fprintf(stderr, "\n");
-  }
-  fprintf(stderr, "\n");
-  //*/
-  Soundcard::get().midi_write(data, interface.device);
+    if(e.task != task)
+      return;
+
+    const MIDIInterface &interface = *static_cast<const MIDIInterface *>(e.target);
+    const InputConfig *cfg = interface.get_input_config();
+    unsigned device = std::min<unsigned>(interface.device, GlobalConfig::max_inputs);
+    int64_t byte_us = MIDI_BYTE_US;
+    int64_t &us = output_us[device];
+
+    if(cfg && cfg->byte_rate)
+      byte_us = std::max<int64_t>(byte_us, 1000000 / cfg->byte_rate);
+
+    us += e.data_length * byte_us;
+    if(cfg)
+      us += std::count(data, data + e.data_length, 0xf7) * cfg->sysex_delay_ms * 1000LL;
+
+    total_us = std::max(total_us, us);
+  });
+  return total_us;
 }
 
 void MIDIInterface::cc(std::vector<uint8_t> &out, unsigned param, unsigned value) const
@@ -97,6 +136,138 @@ void MIDIInterface::all_off(std::vector<uint8_t> &out) const
   out.insert(out.end(), std::begin(midi), std::end(midi));
 }
 
+/* Parameters last programmed to each synth, by tag, device, and channel. */
+static std::map<std::string, std::vector<uint8_t>> program_states;
+
+/**
+ * Remember the parameters programmed to this synth and get the parameters
+ * that were programmed to it before, if any. Parameters are only compared
+ * between programming data of the same kind and size.
+ *
+ * @param what    Kind of programming data (e.g. "sysex").
+ * @param params  Parameters being programmed.
+ * @param prev    Receives the previously programmed parameters.
+ * @returns       `true` if only the changes to `prev` need to be sent.
+ */
+bool MIDIInterface::program_state(const char *what,
+ const std::vector<uint8_t> &params, std::vector<uint8_t> &prev) const
+{
+  const InputConfig *ic = get_input_config();
+  char key[80];
+
+  snprintf(key, sizeof(key), "%s:%s:%u:%u", tag, what, device.value(),
+   ic ? ic->midi_channel.value() : 0);
+
+  std::vector<uint8_t> &state = program_states[key];
+  bool has_prev = state.size() == params.size();
+  prev.swap(state);
+  state = params;
+
+  auto cfg = ctx.get_interface_as<GlobalConfig>("global");
+  return has_prev && cfg && cfg->program_changes;
+}
+
+/* Reduce a list of 3-byte control change messages to the changed ones. */
+void MIDIInterface::cc_changes(std::vector<uint8_t> &out) const
+{
+  std::vector<uint8_t> prev;
+  if(!program_state("cc", out, prev))
+    return;
+
+  std::vector<uint8_t> changes;
+  for(size_t i = 0; i + 3 <= out.size(); i += 3)
+    if(memcmp(out.data() + i, prev.data() + i, 3))
+      changes.insert(changes.end(), out.begin() + i, out.begin() + i + 3);
+
+  out.swap(changes);
+}
+
+/**
+ * Reduce a list of Roland DT1 (data set) messages to the data that changed
+ * since the same messages were last programmed. Changed bytes are sent as
+ * new messages covering the smallest ranges where starting a new message
+ * costs more than resending the unchanged bytes between two changes.
+ *
+ * @param out       DT1 messages; replaced by the changes.
+ * @param header    Length of the message before the address.
+ * @param addr_len  Length of the (7-bit) address.
+ * @param align     Size of a parameter in bytes.
+ */
+void MIDIInterface::roland_changes(std::vector<uint8_t> &out,
+ unsigned header, unsigned addr_len, unsigned align) const
+{
+  std::vector<uint8_t> prev;
+  if(!program_state("roland", out, prev))
+    return;
+
+  const size_t overhead = header + addr_len + 2;
+  std::vector<uint8_t> changes;
+  size_t pos = 0;
+  while(pos < out.size())
+  {
+    size_t end = pos;
+    while(end < out.size() && out[end] != 0xf7)
+      end++;
+    if(end >= out.size())
+      break;
+    end++;
+
+    const uint8_t *msg = out.data() + pos;
+    const uint8_t *old = prev.data() + pos;
+    size_t len = end - pos;
+    pos = end;
+
+    /* Different layout (e.g. different part): send it all. */
+    if(len < overhead || memcmp(msg, old, header + addr_len) || old[len - 1] != 0xf7)
+    {
+      changes.insert(changes.end(), msg, msg + len);
+      continue;
+    }
+
+    unsigned addr = 0;
+    for(unsigned i = 0; i < addr_len; i++)
+      addr = (addr << 7) | msg[header + i];
+
+    const uint8_t *data = msg + header + addr_len;
+    const uint8_t *old_data = old + header + addr_len;
+    size_t data_len = len - overhead;
+
+    size_t i = 0;
+    while(i < data_len)
+    {
+      if(data[i] == old_data[i])
+      {
+        i++;
+        continue;
+      }
+      size_t start = i - i % align;
+      size_t last = start;
+      for(size_t j = start; j < data_len; j++)
+      {
+        if(data[j] != old_data[j])
+          last = j;
+        else
+
+        if(j - last > overhead)
+          break;
+      }
+      size_t stop = std::min(data_len, (last / align + 1) * align);
+
+      size_t first = changes.size();
+      unsigned a = addr + start;
+      changes.insert(changes.end(), msg, msg + header);
+      for(unsigned k = addr_len; k > 0; k--)
+        changes.push_back((a >> (7 * (k - 1))) & 0x7f);
+      changes.insert(changes.end(), data + start, data + stop);
+      changes.push_back(roland_checksum(changes.data() + first + header,
+       addr_len + stop - start));
+      changes.push_back(0xf7);
+      i = stop;
+    }
+  }
+  out.swap(changes);
+}
+
 const char *MIDIInterface::get_note(unsigned note)
 {
   static constexpr const char *notes[128] =
@@ -220,29 +391,106 @@ uint8_t MIDIInterface::roland_checksum(const uint8_t *d, size_t sz)
   return (-sum) & 0x7f;
 }
 
-bool MIDIInterface::load_file(std::vector<uint8_t> &out, const char *path)
+/**
+ * Receive SysEx messages from a MIDI input. Only complete messages are kept;
+ * realtime bytes (e.g. active sensing) and anything outside of SysEx are
+ * discarded.
+ *
+ * @param card        Sound device to read from.
+ * @param num         MIDI input number.
+ * @param out         Received messages are appended to this vector.
+ * @param count       Stop after this many messages have been received.
+ * @param timeout_ms  Stop if no data is received for this long.
+ * @returns           The number of complete messages received.
+ */
+size_t MIDIInterface::receive_sysex(Soundcard &card, unsigned num,
+ std::vector<uint8_t> &out, unsigned count, unsigned timeout_ms)
 {
-  struct stat st;
+  uint8_t buf[256];
+  size_t received = 0;
+  size_t start = out.size();
+  bool in_sysex = false;
 
-  if(stat(path, &st) == 0 && S_ISREG(st.st_mode))
+  while(received < count)
   {
-    FILE *fp = fopen(path, "rb");
-    if(fp)
+    ssize_t len = card.midi_read(buf, sizeof(buf), num, timeout_ms);
+    if(len <= 0)
+      break;
+
+    for(ssize_t i = 0; i < len; i++)
     {
-      out.resize(st.st_size);
+      uint8_t b = buf[i];
+      if(b >= 0xf8)
+        continue;
+
+      if(b == 0xf0)
+      {
+        out.resize(start);
+        out.push_back(b);
+        in_sysex = true;
+      }
+      else
+
+      if(b == 0xf7 && in_sysex)
+      {
+        out.push_back(b);
+        start = out.size();
+        in_sysex = false;
+        received++;
+      }
+      else
+
+      if(b >= 0x80)
+      {
+        /* Any other status byte cancels an incomplete message. */
+        out.resize(start);
+        in_sysex = false;
+      }
+      else
+
+      if(in_sysex)
+        out.push_back(b);
+    }
+  }
+  out.resize(start);
+  return received;
+}
 
-      off_t sz = fread(out.data(), 1, st.st_size, fp);
-      if(sz < st.st_size)
-        out.resize(sz);
+/**
+ * Request the current patch from the synth and load the reply. The input
+ * with this interface's device number must be open for reading.
+ *
+ * @param card        Sound device the synth is connected to.
+ * @param timeout_ms  Give up if the synth doesn't send anything for this long.
+ * @returns           `true` if the patch was received and loaded.
+ */
+bool MIDIInterface::fetch(Soundcard &card, unsigned timeout_ms)
+{
+  std::vector<uint8_t> request;
+  std::vector<uint8_t> in;
 
-      fclose(fp);
-      return true;
-    }
+  unsigned count = dump_request(request);
+  if(!count)
+  {
+    fprintf(stderr, "%s: dump request not supported\n", tag);
+    return false;
   }
-  else
-    fprintf(stderr, "couldn't find file '%s', ignoring\n", path);
 
-  return false;
+  card.midi_write(request.data(), request.size(), device);
+
+  size_t received = receive_sysex(card, device, in, count, timeout_ms);
+  fprintf(stderr, "%s: received %zu of %u messages (%zu bytes)\n",
+   tag, received, count, in.size());
+
+  if(!received)
+    return false;
+
+  if(!load_data(in.data(), in.size()))
+  {
+    fprintf(stderr, "%s: failed to load received dump\n", tag);
+    return false;
+  }
+  return true;
 }
 
 /*
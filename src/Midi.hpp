@@ -21,40 +21,33 @@
 
 #include <limits.h>
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 #include "Config.hpp"
 #include "Event.hpp"
 
 class MIDIInterface;
+class Soundcard;
 
-class MIDIEvent : public Event
+class MIDIEvent
 {
-  const MIDIInterface &interface;
-  std::vector<uint8_t> data;
+  static void task(const Event &e, const uint8_t *data);
 
 public:
-  MIDIEvent(const MIDIInterface &_i,
-   const std::vector<uint8_t> &_data, int _time_ms):
-   Event(_time_ms), interface(_i), data(_data) {}
-
-  MIDIEvent(const MIDIInterface &_i,
-   std::vector<uint8_t> &&_data, int _time_ms):
-   Event(_time_ms), interface(_i), data(std::move(_data)) {}
-
-  virtual void task() const;
-
   static void schedule(EventSchedule &ev, const MIDIInterface &_i,
-   const std::vector<uint8_t> &_data, int _time_ms)
+   const uint8_t *_data, size_t _length, int64_t _time_us)
   {
-    ev.push(std::shared_ptr<Event>(new MIDIEvent(_i, _data, _time_ms)));
+    ev.push(_time_us, task, &_i, 0, 0, _data, _length);
   }
 
   static void schedule(EventSchedule &ev, const MIDIInterface &_i,
-   std::vector<uint8_t> &&_data, int _time_ms)
+   const std::vector<uint8_t> &_data, int64_t _time_us)
   {
-    ev.push(std::shared_ptr<Event>(new MIDIEvent(_i, std::move(_data), _time_ms)));
+    schedule(ev, _i, _data.data(), _data.size(), _time_us);
   }
+
+  static int64_t transfer_us(const EventSchedule &ev, int64_t time_us);
 };
 
 class MIDIInterface : public ConfigInterface
@@ -82,6 +75,40 @@ public:
     return false;
   }
 
+  /* Load a MIDI/SysEx dump from memory. */
+  virtual bool load_data(const uint8_t *data, size_t size)
+  {
+    return false;
+  }
+
+  /* Generate the SysEx messages requesting the synth's current patch.
+   * Returns the number of reply messages to expect, or 0 if unsupported. */
+  virtual unsigned dump_request(std::vector<uint8_t> &out) const
+  {
+    return 0;
+  }
+
+  /* Read a patch bank from the SysExPath dump, if it contains one.
+   * Returns the number of patches in the bank, or 0. */
+  virtual unsigned read_bank(std::vector<uint8_t> &bank)
+  {
+    return 0;
+  }
+
+  /* Load patch `num` (starting from 1) of a bank from read_bank. */
+  virtual bool load_bank(const std::vector<uint8_t> &bank, unsigned num)
+  {
+    return false;
+  }
+
+  bool fetch(Soundcard &card, unsigned timeout_ms);
+
+  bool program_state(const char *what, const std::vector<uint8_t> &params,
+   std::vector<uint8_t> &prev) const;
+  void cc_changes(std::vector<uint8_t> &out) const;
+  void roland_changes(std::vector<uint8_t> &out, unsigned header,
+   unsigned addr_len, unsigned align) const;
+
   void cc(std::vector<uint8_t> &out, unsigned param, unsigned value) const;
   void program_change(std::vector<uint8_t> &out, unsigned program) const;
   void note_on(std::vector<uint8_t> &out, unsigned note, unsigned velocity) const;
@@ -101,7 +128,8 @@ public:
   static const char *get_note(unsigned note);
   static int get_note_value(const char *note);
   static uint8_t roland_checksum(const uint8_t *d, size_t sz);
-  static bool load_file(std::vector<uint8_t> &out, const char *path);
+  static size_t receive_sysex(Soundcard &card, unsigned num,
+   std::vector<uint8_t> &out, unsigned count, unsigned timeout_ms);
 };
 
 
@@ -163,10 +191,15 @@ public:
   Option<unsigned>  On_ms;
   Option<unsigned>  Off_ms;
   Option<unsigned>  Quiet_ms;
+  OptionBool        AdaptiveRelease;
+  Option<unsigned>  ReleaseHold_ms;
   Option<unsigned>  OnVelocity;
   Option<unsigned>  OffVelocity;
+  OptionString<63>  Velocities;
+  Option<unsigned>  RoundRobin;
   OptionNote        MinNote;
   OptionNote        MaxNote;
+  Option<unsigned>  NoteStep;
 
   PlaybackConfig(ConfigContext &_ctx, const char *_tag, int _id):
    ConfigInterface(_ctx, _tag, _id),
@@ -174,10 +207,15 @@ public:
    On_ms(options, 1000, 10, UINT_MAX, "On_ms"),
    Off_ms(options, 1000, 10, UINT_MAX, "Off_ms"),
    Quiet_ms(options, 100, 10, UINT_MAX, "Quiet_ms"),
+   AdaptiveRelease(options, false, "AdaptiveRelease"),
+   ReleaseHold_ms(options, 200, 10, UINT_MAX, "ReleaseHold_ms"),
    OnVelocity(options, 127, 0, 127, "OnVelocity"),
    OffVelocity(options, 64, 0, 127, "OffVelocity"),
+   Velocities(options, "", "Velocities"),
+   RoundRobin(options, 1, 1, 255, "RoundRobin"),
    MinNote(options, "C2", "C-1", "G9", 0, "MinNote"),
-   MaxNote(options, "C7", "C-1", "G9", 0, "MaxNote")
+   MaxNote(options, "C7", "C-1", "G9", 0, "MaxNote"),
+   NoteStep(options, 1, 0, 120, "NoteStep")
   {}
 
   virtual ~PlaybackConfig() {}
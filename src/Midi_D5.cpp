@@ -19,6 +19,7 @@
 #include "Config.hpp"
 #include "Event.hpp"
 #include "Midi.hpp"
+#include "SysEx.hpp"
 
 #include <ctype.h>
 
@@ -38,6 +39,12 @@ static constexpr unsigned address_add(unsigned m, unsigned a)
 
 static constexpr unsigned MemoryToneGroup = 2;
 
+/* Message prefixes: Roland, device ID (ORed in), model ID 16h, command. */
+static constexpr auto D5_DT1 =
+ sysex_prefix<SysExParser::ROLAND, 0x00, 0x16, SysExParser::ROLAND_DT1>;
+static constexpr auto D5_RQ1 =
+ sysex_prefix<SysExParser::ROLAND, 0x00, 0x16, SysExParser::ROLAND_RQ1>;
+
 class OptionTone : public ConfigOption
 {
   unsigned gr = 0; // 0=a 1=b 2=c/i 3=r
@@ -324,7 +331,7 @@ public:
   {}
 
   /* Not an independent SysEx, but repeated 4 times in the tone SysEx. */
-  void program(uint8_t *buf, bool is_mt32) const;
+  void program(uint8_t (&buf)[58], bool is_mt32) const;
   void load(const uint8_t *buf, bool is_mt32);
 };
 
@@ -564,10 +571,18 @@ public:
       lower.program(out, UnitID, 2, is_mt32 || is_d110);
     }
 
-    MIDIEvent::schedule(ev, *this, std::move(out), EventSchedule::PROGRAM_TIME);
+    /* Only send the parameters that changed since the previous patch. */
+    roland_changes(out, 5, 3, 1);
+
+    if(out.size())
+      MIDIEvent::schedule(ev, *this, std::move(out), EventSchedule::PROGRAM_TIME);
   }
 
   virtual bool load();
+  virtual bool load_data(const uint8_t *data, size_t size);
+  void load_tone(RolandImage &image, VATone &tone, const OptionTone &ref,
+   unsigned part);
+  virtual unsigned dump_request(std::vector<uint8_t> &out) const;
 };
 
 
@@ -575,187 +590,169 @@ public:
  * Programming functions *
  *************************/
 
-void VAPartial::program(uint8_t *buf, bool is_mt32) const
+void VAPartial::program(uint8_t (&buf)[58], bool is_mt32) const
 {
-  buf[0]  = WGPitchCoarse;
-  buf[1]  = WGPitchFine + 50;
-  buf[2]  = WGPitchKeyfollow;
-  buf[3]  = WGPitchBender;
-  buf[4]  = ((WGPCMBank - 1) << 1) | WGWaveform;
-  buf[5]  = WGPCMWave - 1;
-  buf[6]  = WGPulseWidth;
-  buf[7]  = WGPulseWidthVelocity + 7;
-  buf[8]  = PEnvDepth;
-  buf[9]  = PEnvVelocity;
-  buf[10] = PEnvTimeKeyfollow;
-  buf[11] = PEnvTime1;
-  buf[12] = PEnvTime2;
-  buf[13] = PEnvTime3;
-  buf[14] = PEnvTime4;
-  buf[15] = PEnvLevel0 + 50;
-  buf[16] = PEnvLevel1 + 50;
-  buf[17] = PEnvLevel2 + 50;
-  buf[18] = PEnvSustainLevel + 50;
-  buf[19] = PEnvEndLevel + 50;
-  buf[20] = LFORate;
-  buf[21] = LFODepth;
-  buf[22] = LFOModulation;
-  buf[23] = TVFCutoff;
-  buf[24] = TVFResonance;
-  buf[25] = std::min(TVFKeyfollow.value(), 14U);
-  buf[26] = TVFBiasPoint;
-  buf[27] = TVFBiasLevel + 7;
-  buf[28] = TVFEnvDepth;
-  buf[29] = TVFEnvVelocity;
-  buf[30] = TVFEnvDepthKeyfollow;
-  buf[31] = TVFEnvTimeKeyfollow;
-  buf[32] = TVFEnvTime1;
-  buf[33] = TVFEnvTime2;
-  buf[34] = TVFEnvTime3;
-  buf[35] = TVFEnvTime4;
-  buf[36] = is_mt32 ? TVFEnvTime5 : TVFEnvTime4;
-  buf[37] = TVFEnvLevel1;
-  buf[38] = TVFEnvLevel2;
-  buf[39] = TVFEnvLevel3;
-  buf[40] = TVFEnvSustainLevel;
-  buf[41] = TVALevel;
-  buf[42] = TVAVelocity + 50;
-  buf[43] = TVABiasPoint1;
-  buf[44] = TVABiasLevel1 + 12;
-  buf[45] = TVABiasPoint2;
-  buf[46] = TVABiasLevel2 + 12;
-  buf[47] = TVAEnvTimeKeyfollow;
-  buf[48] = TVAEnvVelocity;
-  buf[49] = TVAEnvTime1;
-  buf[50] = TVAEnvTime2;
-  buf[51] = TVAEnvTime3;
-  buf[52] = TVAEnvTime4;
-  buf[53] = is_mt32 ? TVAEnvTime5 : TVFEnvTime4;
-  buf[54] = TVAEnvLevel1;
-  buf[55] = TVAEnvLevel2;
-  buf[56] = TVAEnvLevel3;
-  buf[57] = TVAEnvSustainLevel;
+  sysex_data(Buffer<58>(buf),
+   WGPitchCoarse,
+   WGPitchFine + 50,
+   WGPitchKeyfollow,
+   WGPitchBender,
+   ((WGPCMBank - 1) << 1) | WGWaveform,
+   WGPCMWave - 1,
+   WGPulseWidth,
+   WGPulseWidthVelocity + 7,
+   PEnvDepth,
+   PEnvVelocity,
+   PEnvTimeKeyfollow,
+   PEnvTime1,
+   PEnvTime2,
+   PEnvTime3,
+   PEnvTime4,
+   PEnvLevel0 + 50,
+   PEnvLevel1 + 50,
+   PEnvLevel2 + 50,
+   PEnvSustainLevel + 50,
+   PEnvEndLevel + 50,
+   LFORate,
+   LFODepth,
+   LFOModulation,
+   TVFCutoff,
+   TVFResonance,
+   std::min(TVFKeyfollow.value(), 14U),
+   TVFBiasPoint,
+   TVFBiasLevel + 7,
+   TVFEnvDepth,
+   TVFEnvVelocity,
+   TVFEnvDepthKeyfollow,
+   TVFEnvTimeKeyfollow,
+   TVFEnvTime1,
+   TVFEnvTime2,
+   TVFEnvTime3,
+   TVFEnvTime4,
+   is_mt32 ? TVFEnvTime5 : TVFEnvTime4,
+   TVFEnvLevel1,
+   TVFEnvLevel2,
+   TVFEnvLevel3,
+   TVFEnvSustainLevel,
+   TVALevel,
+   TVAVelocity + 50,
+   TVABiasPoint1,
+   TVABiasLevel1 + 12,
+   TVABiasPoint2,
+   TVABiasLevel2 + 12,
+   TVAEnvTimeKeyfollow,
+   TVAEnvVelocity,
+   TVAEnvTime1,
+   TVAEnvTime2,
+   TVAEnvTime3,
+   TVAEnvTime4,
+   is_mt32 ? TVAEnvTime5 : TVFEnvTime4,
+   TVAEnvLevel1,
+   TVAEnvLevel2,
+   TVAEnvLevel3,
+   TVAEnvSustainLevel).check();
 }
 
 void VATone::program(std::vector<uint8_t> &out, unsigned UnitID, unsigned part, bool is_mt32) const
 {
-  uint8_t buf[256];
+  /* Address 04-00-00h + f6h * (part - 1) */
   unsigned offset = 0xf6 * (part - 1);
-  buf[0]  = 0xf0; /* SysEx */
-  buf[1]  = 0x41; /* Roland */
-  buf[2]  = UnitID - 1;
-  buf[3]  = 0x16; /* Model ID */
-  buf[4]  = 0x12; /* Command: Data set 1 */
-  buf[5]  = 0x04; /* Address 040-00-00h + f6h * (part - 1) */
-  buf[6]  = offset >> 7;
-  buf[7]  = offset & 0x7f;
-
-  for(int i = 0; i < 10; i++)
-    buf[8 + i] = Name[i];
+  auto msg = sysex_frame<3, 0xf6>(D5_DT1, UnitID - 1,
+   0x040000 | ((offset >> 7) << 8) | (offset & 0x7f));
 
-  buf[18] = Structure12;
-  buf[19] = Structure34;
-  buf[20] = (p1.Mute) | (p2.Mute << 1) | (p3.Mute << 2) | (p4.Mute << 3);
-  buf[21] = Sustain ? 0 : 1;
+  uint8_t name[10];
+  uint8_t partials[4][58];
 
-  p1.program(buf + 22, is_mt32);
-  p2.program(buf + 80, is_mt32);
-  p3.program(buf + 138, is_mt32);
-  p4.program(buf + 196, is_mt32);
-
-  buf[254] = MIDIInterface::roland_checksum(buf + 5, 249);
-  buf[255] = 0xf7; /* End SysEx */
-
-  out.insert(out.end(), std::begin(buf), std::end(buf));
+  for(int i = 0; i < 10; i++)
+    name[i] = Name[i];
+
+  p1.program(partials[0], is_mt32);
+  p2.program(partials[1], is_mt32);
+  p3.program(partials[2], is_mt32);
+  p4.program(partials[3], is_mt32);
+
+  sysex_data(msg.data().append(name),
+   Structure12,
+   Structure34,
+   (p1.Mute) | (p2.Mute << 1) | (p3.Mute << 2) | (p4.Mute << 3),
+   Sustain ? 0 : 1)
+   .append(partials[0])
+   .append(partials[1])
+   .append(partials[2])
+   .append(partials[3]).check();
+
+  msg.write(out);
 }
 
 void VAPatch::program_patch(std::vector<uint8_t> &out, unsigned UnitID) const
 {
-  uint8_t buf[48];
-  buf[0]  = 0xf0; /* SysEx */
-  buf[1]  = 0x41; /* Roland */
-  buf[2]  = UnitID - 1;
-  buf[3]  = 0x16; /* Model ID */
-  buf[4]  = 0x12; /* Command: Data set 1 */
-  buf[5]  = 0x03; /* Address 030400h */
-  buf[6]  = 0x04;
-  buf[7]  = 0x00;
-  buf[8]  = KeyMode;
-  buf[9]  = SplitPoint;
-  buf[10] = LowerTone.group();
-  buf[11] = LowerTone.tone() - 1;
-  buf[12] = UpperTone.group();
-  buf[13] = UpperTone.tone() - 1;
-  buf[14] = LowerKeyShift + 24;
-  buf[15] = UpperKeyShift + 24;
-  buf[16] = LowerFinetune + 50;
-  buf[17] = UpperFinetune + 50;
-  buf[18] = LowerBenderRange;
-  buf[19] = UpperBenderRange;
-  buf[20] = LowerAssignMode;
-  buf[21] = UpperAssignMode;
-  buf[22] = LowerReverb;
-  buf[23] = UpperReverb;
-  buf[24] = ReverbMode;
-  buf[25] = ReverbTime;
-  buf[26] = ReverbLevel;
-  buf[27] = Balance;
-  buf[28] = Level;
-  for(int i = 0; i < 16; i++)
-    buf[29 + i] = Name[i] & 0x7f;
-  buf[45] = 0x00;
-  buf[46] = MIDIInterface::roland_checksum(buf + 5, 41);
-  buf[47] = 0xf7; /* End SysEx */
+  /* Address 03-04-00h */
+  auto msg = sysex_frame<3, 0x26>(D5_DT1, UnitID - 1, 0x030400);
+  uint8_t name[16];
 
-  out.insert(out.end(), std::begin(buf), std::end(buf));
+  for(int i = 0; i < 16; i++)
+    name[i] = Name[i] & 0x7f;
+
+  sysex_data(msg.data(),
+   KeyMode,
+   SplitPoint,
+   LowerTone.group(),
+   LowerTone.tone() - 1,
+   UpperTone.group(),
+   UpperTone.tone() - 1,
+   LowerKeyShift + 24,
+   UpperKeyShift + 24,
+   LowerFinetune + 50,
+   UpperFinetune + 50,
+   LowerBenderRange,
+   UpperBenderRange,
+   LowerAssignMode,
+   UpperAssignMode,
+   LowerReverb,
+   UpperReverb,
+   ReverbMode,
+   ReverbTime,
+   ReverbLevel,
+   Balance,
+   Level)
+   .append(name)
+   .append(uint8_t(0x00)).check();
+
+  msg.write(out);
 }
 
 void VAPatch::program_timbre(std::vector<uint8_t> &out, unsigned UnitID, unsigned part) const
 {
-  uint8_t buf[18];
-  buf[0]  = 0xf0; /* SysEx */
-  buf[1]  = 0x41; /* Roland */
-  buf[2]  = UnitID - 1;
-  buf[3]  = 0x16; /* Model ID */
-  buf[4]  = 0x12; /* Command: Data set 1 */
-  buf[5]  = 0x03; /* Address 03-00-00h + 10h * (part - 1) */
-  buf[6]  = 0x00;
-  buf[7]  = 0x10 * (part - 1);
-  buf[8]  = UpperTone.group();
-  buf[9]  = UpperTone.tone() - 1;
-  buf[10] = UpperKeyShift + 24;
-  buf[11] = UpperFinetune + 50;
-  buf[12] = UpperBenderRange;
-  buf[13] = UpperAssignMode;
-  buf[14] = UpperReverb; // TODO: D-110 has "Output Assign" here instead.
-  buf[15] = 0x00;
-  buf[16] = MIDIInterface::roland_checksum(buf + 5, 11);
-  buf[17] = 0xf7; /* End SysEx */
-
-  out.insert(out.end(), std::begin(buf), std::end(buf));
+  /* Address 03-00-00h + 10h * (part - 1) */
+  auto msg = sysex_frame<3, 8>(D5_DT1, UnitID - 1, 0x030000 + 0x10 * (part - 1));
+
+  msg.set(
+   UpperTone.group(),
+   UpperTone.tone() - 1,
+   UpperKeyShift + 24,
+   UpperFinetune + 50,
+   UpperBenderRange,
+   UpperAssignMode,
+   UpperReverb, // TODO: D-110 has "Output Assign" here instead.
+   0x00);
+
+  msg.write(out);
 }
 
 void VAPatchFX::program(std::vector<uint8_t> &out, unsigned UnitID) const
 {
-  uint8_t buf[16];
-  buf[0]  = 0xf0; /* SysEx */
-  buf[1]  = 0x41; /* Roland */
-  buf[2]  = UnitID - 1;
-  buf[3]  = 0x16; /* Model ID */
-  buf[4]  = 0x12; /* Command: Data set 1 */
-  buf[5]  = 0x03; /* Address 03-04-40h */
-  buf[6]  = 0x04;
-  buf[7]  = 0x40;
-  buf[8]  = Mode;
-  buf[9]  = Rate;
-  buf[10] = HarmonyBalance + 12;
-  buf[11] = ChaseShift + 12;
-  buf[12] = ChaseLevel;
-  buf[13] = ArpeggioMode;
-  buf[14] = MIDIInterface::roland_checksum(buf + 5, 9);
-  buf[15] = 0xf7; /* End SysEx */
-
-  out.insert(out.end(), std::begin(buf), std::end(buf));
+  /* Address 03-04-40h */
+  auto msg = sysex_frame<3, 6>(D5_DT1, UnitID - 1, 0x030440);
+
+  msg.set(
+   Mode,
+   Rate,
+   HarmonyBalance + 12,
+   ChaseShift + 12,
+   ChaseLevel,
+   ArpeggioMode);
+
+  msg.write(out);
 }
 
 
@@ -778,9 +775,9 @@ void VAPartial::load(const uint8_t *buf, bool is_mt32)
   PEnvVelocity          = buf[9];
   PEnvTimeKeyfollow     = buf[10];
   PEnvTime1             = buf[11];
-  PEnvTime1             = buf[12];
-  PEnvTime1             = buf[13];
-  PEnvTime1             = buf[14];
+  PEnvTime2             = buf[12];
+  PEnvTime3             = buf[13];
+  PEnvTime4             = buf[14];
   PEnvLevel0            = (int)buf[15] - 50;
   PEnvLevel1            = (int)buf[16] - 50;
   PEnvLevel2            = (int)buf[17] - 50;
@@ -901,151 +898,133 @@ void VAPatchFX::load(const uint8_t *buf)
   ArpeggioMode      = buf[5];
 }
 
-/* std::vector and cohorts feel the need to individually initialize each byte... */
-template<size_t START, size_t END, size_t SECTIONS=1>
-class D5Memory
+bool D5Interface::load()
 {
-  static_assert(END > START, "wtf");
-  static constexpr bool use_buf() { return END - START <= 256; }
-  static constexpr size_t buf_size() { return use_buf() ? END - START : 1; }
-  static constexpr size_t section_size() { return (END - START) / SECTIONS; }
+  SysExFile file;
 
-  uint8_t *ptr;
-  uint8_t buf[buf_size()]{};
-  bool has_section[SECTIONS]{};
+  if(!SysExPath[0] || !file.open(SysExPath))
+    return false;
 
-public:
-  D5Memory()
-  {
-    if(!use_buf())
-      ptr = reinterpret_cast<uint8_t *>(calloc(1, END - START));
-    else
-      ptr = buf;
-  }
-  ~D5Memory()
-  {
-    if(!use_buf())
-      free(ptr);
-  }
+  return load_data(file.data(), file.size());
+}
 
-  uint8_t *get_ptr(size_t addr) { return ptr + addr - START; }
-  uint8_t &operator[](size_t addr) { return ptr[addr - START]; }
-  operator bool() const { return !!ptr; }
+/* Load a tone used by a patch or timbre: user tones from the tone memory,
+ * otherwise the temporary tone of a part (if given). Preset tones loaded
+ * from memory aren't in the dump and don't need to be. */
+void D5Interface::load_tone(RolandImage &image, VATone &tone,
+ const OptionTone &ref, unsigned part)
+{
+  static constexpr char groups[4] = { 'a', 'b', 'i', 'r' };
+  uint8_t buf[0xf6];
 
-  void load(std::vector<uint8_t> &in, unsigned &inpos, unsigned &sum,
-   unsigned &pos, unsigned offset = 0)
+  if(ref.group() == MemoryToneGroup &&
+     image.read(address(0x80000) + 0x100 * (ref.tone() - 1), buf))
   {
-    unsigned start = START + offset;
-    unsigned end = END + offset;
-    if(pos > end)
-      return;
+    tone.load(buf, is_mt32 || is_d110);
+  }
+  else
 
-    /* Skip any bytes prior to start. */
-    while(pos < start && inpos < in.size() && in[inpos] < 0x80)
-    {
-      sum += in[inpos++];
-      pos++;
-    }
-    /* Read bytes up until end. */
-    unsigned i = pos - start;
-    while(pos < end && inpos < in.size() && in[inpos] < 0x80)
-    {
-      if(!(pos & 0xf) && SECTIONS > 1)
-        has_section[(i / section_size()) % SECTIONS] = true;
-      else
-        has_section[0] = true;
-
-      sum += in[inpos];
-      ptr[i++] = in[inpos++];
-      pos++;
-    }
+  if(part && image.read(address(0x40000) + 0xf6 * (part - 1), buf))
+  {
+    tone.load(buf, is_mt32 || is_d110);
   }
+  else
 
-  bool has(unsigned section = 0) const
+  if(part || ref.group() == MemoryToneGroup)
   {
-    return section < SECTIONS ? has_section[section] : false;
+    fprintf(stderr, "%s: tone %c%02u not in dump, ignoring\n", tag,
+     groups[ref.group()], ref.tone());
   }
-};
+}
 
-bool D5Interface::load()
+bool D5Interface::load_data(const uint8_t *data, size_t size)
 {
-  std::vector<uint8_t> in;
-
-  if(!SysExPath[0] || !MIDIInterface::load_file(in, SysExPath))
-    return false;
+  SysExParser parser(data, size, 1, 3);
+  SysExMessage msg;
+  RolandImage image;
 
-  D5Memory<address(0x30000), address(0x30100),   8> timbre_temp;
-  D5Memory<address(0x30400), address(0x30426),   1> patch_temp;
-  D5Memory<address(0x30440), address(0x30446),   1> patchfx_temp;
-  D5Memory<address(0x40000), address(0x40f30),   8> tone_temp;
-
-  D5Memory<address(0x50000), address(0x50008),   1> timbre_mem; // Only load 1
-  D5Memory<address(0x70000), address(0x70026),   1> patch_mem; // Only load 1
-  D5Memory<address(0x80000), address(0x90000),  64> tone_mem;
-  D5Memory<address(0xd0000), address(0xd0600), 128> patchfx_mem;
-
-  if(!timbre_temp || !patch_temp || !patchfx_temp || !tone_temp ||
-     !timbre_mem  || !patch_mem  || !patchfx_mem  || !tone_mem)
-    return false;
-
-  unsigned timbre_start = (SysExPatch - 1) * address(0x8);
-  unsigned patch_start  = (SysExPatch - 1) * address(0x26);
-
-  unsigned inpos = 0;
-
-  /* Load SysEx to memory buffer. */
-  while(inpos < in.size())
+  /* Index the dump in one pass. */
+  while(parser.next(msg))
   {
-    while(inpos < in.size() && in[inpos] != 0xf0)
-      inpos++;
-
-    if(inpos + 10 >= in.size())
-      break;
-
-    if(in[inpos + 1] != 0x41 || /* Roland*/
-       in[inpos + 3] != 0x16 || /* Model ID */
-       in[inpos + 4] != 0x12)   /* Command: Set data 1 */
+    if(msg.status != 0xf0 ||
+       msg.manufacturer != SysExParser::ROLAND ||
+       msg.model != 0x16 || /* Model ID */
+       msg.command != SysExParser::ROLAND_DT1)
       continue;
 
-    unsigned pos = address(in[inpos + 5], in[inpos + 6], in[inpos + 7]);
-    unsigned sum = in[inpos + 5] + in[inpos + 6] + in[inpos + 7];
-    inpos += 8;
-
-    /* Load memory ranges of interest to their respective buffers.
-     * These need to be loaded in order. Unrelated bytes are ignored.
-     */
-    timbre_temp.load(in, inpos, sum, pos);  /* 0x30000 */
-    patch_temp.load(in, inpos, sum, pos);   /* 0x30400 */
-    patchfx_temp.load(in, inpos, sum, pos); /* 0x30440 */
-    tone_temp.load(in, inpos, sum, pos);    /* 0x40000 */
-    timbre_mem.load(in, inpos, sum, pos, timbre_start);
-    patch_mem.load(in, inpos, sum, pos, patch_start);
-    tone_mem.load(in, inpos, sum, pos);     /* 0x80000 */
-    patchfx_mem.load(in, inpos, sum, pos);  /* 0xd0000 */
-
-    /* Skip any remaining bytes and check sum. */
-    while(inpos < in.size() && in[inpos] < 0x80)
-      sum += in[inpos++];
-
-    if((sum & 0x7f) || inpos >= in.size() || in[inpos] != 0xf7)
+    if(!msg.valid)
       return false;
+
+    image.add(address(msg.address), msg.payload, msg.payload_length);
   }
 
-  /* Load patch information from memory. */
-  // FIXME: check temp timbres
-  // FIXME: check temp patch
+  /* Load patch information from memory if the dump contains the selected
+   * patch or timbre; otherwise load the temporary area, e.g. from --fetch. */
+  unsigned part = std::max(Part.value(), 1U);
+  bool from_mem;
+
   if(SysExMode) // Load Timbre from bulk dump
   {
-    //
+    uint8_t timbre[8];
+
+    from_mem = image.read(address(0x50000) + 0x8 * (SysExPatch - 1), timbre);
+    if(!from_mem && !image.read(address(0x30000) + 0x10 * (part - 1), timbre))
+    {
+      fprintf(stderr, "%s: timbre not in dump\n", tag);
+      return false;
+    }
+    patch.load_timbre(timbre);
+    load_tone(image, upper, patch.UpperTone, from_mem ? 0 : part);
   }
   else // Load Patch from bulk dump
   {
-    //
-  }
+    uint8_t buf[0x26];
+    uint8_t fx[6];
 
+    from_mem = image.read(address(0x70000) + 0x26 * (SysExPatch - 1), buf);
+    if(!from_mem && !image.read(address(0x30400), buf))
+    {
+      fprintf(stderr, "%s: patch not in dump\n", tag);
+      return false;
+    }
+    patch.load_patch(buf);
+
+    if(from_mem ? image.read(address(0xd0000) + 0x6 * (SysExPatch - 1), fx) :
+                  image.read(address(0x30440), fx))
+      patchfx.load(fx);
+
+    load_tone(image, upper, patch.UpperTone, from_mem ? 0 : 1);
+    load_tone(image, lower, patch.LowerTone, from_mem ? 0 : 2);
+  }
   return true;
 }
 
+/* Request data from start to end (addresses in Roland format).
+ * Returns the number of packets the reply is split into. */
+static unsigned d5_request(std::vector<uint8_t> &out, unsigned UnitID,
+ unsigned start, unsigned end)
+{
+  unsigned size = address(end) - address(start);
+  auto msg = sysex_frame<3, 3>(D5_RQ1, UnitID - 1, start);
+
+  msg.set(size >> 14, (size >> 7) & 0x7f, size & 0x7f); /* Size (3) */
+  msg.write(out);
+
+  /* Replies are sent in packets of up to 256 bytes. */
+  return (size + 255) / 256;
+}
+
+unsigned D5Interface::dump_request(std::vector<uint8_t> &out) const
+{
+  unsigned count = 0;
+  count += d5_request(out, UnitID, 0x30000, 0x30100); /* Timbre temporary */
+  count += d5_request(out, UnitID, 0x30400, 0x30426); /* Patch temporary */
+  if(is_d5)
+    count += d5_request(out, UnitID, 0x30440, 0x30446); /* Patch FX temporary */
+  count += d5_request(out, UnitID, 0x40000, 0x40f30); /* Tone temporary */
+  return count;
+}
+
 static class D5Register : public ConfigRegister
 {
 public:
@@ -19,6 +19,15 @@
 #include "Config.hpp"
 #include "Event.hpp"
 #include "Midi.hpp"
+#include "SysEx.hpp"
+
+/* Message prefixes: Yamaha, sub-status (channel ORed in), format/data. */
+static constexpr auto DX7_PARAM =
+ sysex_prefix<SysExParser::YAMAHA, SysExParser::YAMAHA_PARAM>;
+static constexpr auto DX7_REQUEST =
+ sysex_prefix<SysExParser::YAMAHA, SysExParser::YAMAHA_REQUEST>;
+static constexpr auto DX7_VOICE = /* Format 0: single voice, 155 bytes */
+ sysex_prefix<SysExParser::YAMAHA, SysExParser::YAMAHA_BULK, 0x00, (155 >> 7), (155 & 0x7f)>;
 
 class DX7Operator : public ConfigSubinterface
 {
@@ -201,6 +210,10 @@ public:
   virtual ~DX7Interface() {}
 
   virtual bool load();
+  virtual bool load_data(const uint8_t *data, size_t size);
+  virtual unsigned read_bank(std::vector<uint8_t> &bank);
+  virtual bool load_bank(const std::vector<uint8_t> &bank, unsigned num);
+  bool load_dump(const uint8_t *data, size_t size, std::vector<uint8_t> *bank);
   void load_voice(const uint8_t *buf);
   void load_voice_packed(const uint8_t *buf);
   void load_param(unsigned param, unsigned value);
@@ -208,46 +221,44 @@ public:
   void param(std::vector<uint8_t> &out, unsigned num, unsigned v) const
   {
     const InputConfig *in = get_input_config();
-    uint8_t buf[7];
 
-    buf[0] = 0xf0;
-    buf[1] = 0x43; // Yamaha
-    buf[2] = 0x10 | (in ? in->midi_channel - 1 : 0);
-    buf[3] = (num >> 7);   // Voice
-    buf[4] = (num & 0x7f); // Voice
-    buf[5] = v & 0x7f;
-    buf[6] = 0xf7;
+    sysex_message(out, DX7_PARAM, in ? in->midi_channel - 1 : 0,
+     num >> 7, num & 0x7f, v & 0x7f); // Parameter (2), value
+  }
 
-    out.insert(out.end(), std::begin(buf), std::end(buf));
+  virtual unsigned dump_request(std::vector<uint8_t> &out) const
+  {
+    const InputConfig *in = get_input_config();
+
+    sysex_message(out, DX7_REQUEST, in ? in->midi_channel - 1 : 0,
+     0x00); // Format: single voice (edit buffer)
+    return 1;
   }
 
-  void program_op(std::vector<uint8_t> &out, const DX7Operator &op) const
+  void program_op(uint8_t (&buf)[21], const DX7Operator &op) const
   {
-    uint8_t buf[21];
-
-    buf[0]  = op.EGRate1;
-    buf[1]  = op.EGRate2;
-    buf[2]  = op.EGRate3;
-    buf[3]  = op.EGRate4;
-    buf[4]  = op.EGLevel1;
-    buf[5]  = op.EGLevel2;
-    buf[6]  = op.EGLevel3;
-    buf[7]  = op.EGLevel4;
-    buf[8]  = op.KSLBreakPoint;
-    buf[9]  = op.KSLLeftDepth;
-    buf[10] = op.KSLRightDepth;
-    buf[11] = op.KSLLeftCurve;
-    buf[12] = op.KSLRightCurve;
-    buf[13] = op.RateScaling;
-    buf[14] = op.ModulationLevel;
-    buf[15] = op.KeyVelocityLevel;
-    buf[16] = op.Level;
-    buf[17] = op.Mode ? 1 : 0;
-    buf[18] = op.Coarse;
-    buf[19] = op.Fine;
-    buf[20] = op.Detune + 7;
-
-    out.insert(out.end(), std::begin(buf), std::end(buf));
+    sysex_data(Buffer<21>(buf),
+     op.EGRate1,
+     op.EGRate2,
+     op.EGRate3,
+     op.EGRate4,
+     op.EGLevel1,
+     op.EGLevel2,
+     op.EGLevel3,
+     op.EGLevel4,
+     op.KSLBreakPoint,
+     op.KSLLeftDepth,
+     op.KSLRightDepth,
+     op.KSLLeftCurve,
+     op.KSLRightCurve,
+     op.RateScaling,
+     op.ModulationLevel,
+     op.KeyVelocityLevel,
+     op.Level,
+     op.Mode ? 1 : 0,
+     op.Coarse,
+     op.Fine,
+     op.Detune + 7).check();
   }
 
   virtual void program(EventSchedule &ev) const
@@ -256,50 +267,45 @@ public:
     std::vector<uint8_t> out;
 
     /* Programmable parameters. */
-    uint8_t buf[29];
-
-    out.resize(6);
-    out[0] = 0xf0;
-    out[1] = 0x43;
-    out[2] = 0x00 | (in ? in->midi_channel - 1 : 0);
-    out[3] = 0x00;
-    out[4] = (155 >> 7);
-    out[5] = (155 & 0x7f);
-
-    for(int i = 5; i >= 0; i--)
-      program_op(out, ops[i]);
-
-    buf[0]  = pitcheg.EGRate1;
-    buf[1]  = pitcheg.EGRate2;
-    buf[2]  = pitcheg.EGRate3;
-    buf[3]  = pitcheg.EGRate4;
-    buf[4]  = pitcheg.EGLevel1;
-    buf[5]  = pitcheg.EGLevel2;
-    buf[6]  = pitcheg.EGLevel3;
-    buf[7]  = pitcheg.EGLevel4;
-    buf[8]  = Algorithm - 1;
-    buf[9]  = Feedback;
-    buf[10] = OscillatorSync;
-    buf[11] = LFOSpeed;
-    buf[12] = LFODelay;
-    buf[13] = LFOPitchModDepth;
-    buf[14] = LFOAmpModDepth;
-    buf[15] = LFOSync;
-    buf[16] = LFOWaveform;
-    buf[17] = PitchModLevel;
-    buf[18] = Transpose + 24;
-
-    for(int i = 0; i < 10; i++)
-      buf[19 + i] = Name[i] & 0x7f;
+    auto msg = sysex_frame<0, 155>(DX7_VOICE, in ? in->midi_channel - 1 : 0);
+    uint8_t op[6][21];
+    uint8_t name[10];
 
-    out.insert(out.end(), std::begin(buf), std::end(buf));
-
-    unsigned sum = 0;
-    for(size_t i = 0; i < 155; i++)
-      sum += out[i + 6];
+    for(int i = 0; i < 6; i++)
+      program_op(op[i], ops[5 - i]);
 
-    out.push_back((-sum) & 0x7f);
-    out.push_back(0xf7);
+    for(int i = 0; i < 10; i++)
+      name[i] = Name[i] & 0x7f;
+
+    sysex_data(msg.data()
+     .append(op[0])
+     .append(op[1])
+     .append(op[2])
+     .append(op[3])
+     .append(op[4])
+     .append(op[5]),
+     pitcheg.EGRate1,
+     pitcheg.EGRate2,
+     pitcheg.EGRate3,
+     pitcheg.EGRate4,
+     pitcheg.EGLevel1,
+     pitcheg.EGLevel2,
+     pitcheg.EGLevel3,
+     pitcheg.EGLevel4,
+     Algorithm - 1,
+     Feedback,
+     OscillatorSync,
+     LFOSpeed,
+     LFODelay,
+     LFOPitchModDepth,
+     LFOAmpModDepth,
+     LFOSync,
+     LFOWaveform,
+     PitchModLevel,
+     Transpose + 24)
+     .append(name).check();
+
+    msg.write(out);
 
     // Set operator enable flags.
     unsigned enable = 0;
@@ -309,9 +315,26 @@ public:
 
     param(out, 155, enable);
 
+    /* If this voice follows another, only send the parameters that changed
+     * unless the bulk dump is shorter (7 bytes per parameter change). */
+    std::vector<uint8_t> voice(std::begin(msg.get()), std::end(msg.get()));
+    std::vector<uint8_t> prev;
+    voice.push_back(enable);
+    if(program_state("voice", voice, prev))
+    {
+      std::vector<uint8_t> changes;
+      for(size_t i = 0; i < voice.size(); i++)
+        if(voice[i] != prev[i])
+          param(changes, i, voice[i]);
+
+      if(changes.size() < out.size())
+        out.swap(changes);
+    }
+
     /* FIXME: function parameters */
 
-    MIDIEvent::schedule(ev, *this, std::move(out), EventSchedule::PROGRAM_TIME);
+    if(out.size())
+      MIDIEvent::schedule(ev, *this, std::move(out), EventSchedule::PROGRAM_TIME);
   }
 };
 
@@ -514,98 +537,88 @@ void DX7Interface::load_param(unsigned param, unsigned value)
 
 bool DX7Interface::load()
 {
-  std::vector<uint8_t> in;
-  uint8_t buf[4097];
+  SysExFile file;
 
-  if(!SysExPath[0] || !MIDIInterface::load_file(in, SysExPath))
+  if(!SysExPath[0] || !file.open(SysExPath))
     return false;
 
-  unsigned inpos = 0;
-  unsigned stop = in.size() - 7;
-  while(inpos < stop)
-  {
-    if(in[inpos++] != 0xf0)
-      continue;
-    if(in[inpos++] != 0x43)
-      continue;
+  return load_data(file.data(), file.size());
+}
+
+bool DX7Interface::load_data(const uint8_t *data, size_t size)
+{
+  return load_dump(data, size, nullptr);
+}
 
-    uint8_t sub  = in[inpos + 0];
-    uint8_t type = in[inpos + 1];
-    uint8_t hi   = in[inpos + 2];
-    uint8_t lo   = in[inpos + 3];
+unsigned DX7Interface::read_bank(std::vector<uint8_t> &bank)
+{
+  SysExFile file;
+
+  if(!SysExPath[0] || !file.open(SysExPath))
+    return 0;
 
-    if(sub >= 0x80 || type >= 0x80 || hi >= 0x80 || lo >= 0x80)
+  bank.clear();
+  if(!load_dump(file.data(), file.size(), &bank) || bank.empty())
+    return 0;
+
+  return 32;
+}
+
+bool DX7Interface::load_bank(const std::vector<uint8_t> &bank, unsigned num)
+{
+  if(num < 1 || num * 128 > bank.size())
+    return false;
+
+  SysExPatch = num;
+  load_voice_packed(bank.data() + (num - 1) * 128);
+  return true;
+}
+
+/* Load the first voice or voice bank in a dump. If `bank` is provided, a
+ * 32-voice bank is copied to it instead of loading SysExPatch. */
+bool DX7Interface::load_dump(const uint8_t *data, size_t size,
+ std::vector<uint8_t> *bank)
+{
+  SysExParser parser(data, size);
+  SysExMessage msg;
+
+  while(parser.next(msg))
+  {
+    if(msg.status != 0xf0 || msg.manufacturer != SysExParser::YAMAHA)
       continue;
 
-    inpos += 4;
+    if(!msg.valid)
+      return false;
 
-    if((sub & 0x70) == 1)
+    if(msg.command == SysExParser::YAMAHA_PARAM)
     {
-      /* Parameter change */
-      if(in[inpos++] != 0xf7)
-        return false;
-
-      load_param((type << 7) | hi, lo);
+      load_param(msg.address, msg.payload[0]);
       continue;
     }
     else
-    /* Bulk data */
-    if((sub & 0x70) != 0)
-      return false;
 
-    unsigned sum = 0;
-    unsigned count = 0;
-    unsigned sz = (hi << 7) | lo;
-    bool read = true;
+    if(msg.command != SysExParser::YAMAHA_BULK)
+      return false;
 
-    type |= (sub & 0x70) << 4;
-    switch(type)
+    switch(msg.model)
     {
     case 0x00:  /* Single voice */
-      if(sz != 155)
+      if(msg.payload_length != 155)
         return false;
-      break;
+
+      load_voice(msg.payload);
+      return true;
 
     case 0x09:  /* 32-voice bank */
-      if(sz != 4096)
+      if(msg.payload_length != 4096)
         return false;
-      break;
 
-    default:
-      read = false;
-      break;
-    }
-
-    if(read)
-    {
-      /* Read sz plus one extra byte into buf (checksum) */
-      while(inpos < in.size() && in[inpos] < 0x80 && count <= sz)
-      {
-        sum += in[inpos];
-        buf[count++] = in[inpos++];
-      }
-    }
-    else
-    {
-      while(inpos < in.size() && in[inpos] < 0x80)
+      if(bank)
       {
-        sum += in[inpos++];
-        count++;
+        bank->assign(msg.payload, msg.payload + 4096);
+        return true;
       }
-    }
-    if(inpos >= in.size() || in[inpos] != 0xf7 || count != sz + 1 || (sum & 0x7f))
-      return false;
-    inpos++;
-
-    switch(type)
-    {
-    case 0x000:  /* Single voice */
-      load_voice(buf);
-      return true;
-
-    case 0x009:  /* 32-voice bank */
-      unsigned offset = (SysExPatch - 1) * 128;
-      load_voice_packed(buf + offset);
+      load_voice_packed(msg.payload + (SysExPatch - 1) * 128);
       return true;
     }
   }
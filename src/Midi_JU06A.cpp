@@ -22,6 +22,10 @@
 
 #include "Config.hpp"
 #include "Midi.hpp"
+#include "SysEx.hpp"
+
+#include <algorithm>
+#include <iterator>
 
 namespace CC
 {
@@ -67,6 +71,12 @@ namespace CC
   };
 };
 
+/* Message prefixes: Roland, device 10h, model 00 00 00 62h, command. */
+static constexpr auto JU06A_DT1 =
+ sysex_prefix<SysExParser::ROLAND, 0x10, 0x00, 0x00, 0x00, 0x62, SysExParser::ROLAND_DT1>;
+static constexpr auto JU06A_RQ1 =
+ sysex_prefix<SysExParser::ROLAND, 0x10, 0x00, 0x00, 0x00, 0x62, SysExParser::ROLAND_RQ1>;
+
 class JU06AInterface final : public MIDIInterface
 {
 public:
@@ -261,18 +271,18 @@ public:
    *       a patch, but it's not clear if there's a way to access it.
    */
 
-  template<class V>
-  void sysex_write(uint8_t *buf, V value) const
+  template<size_t N, size_t I>
+  Buffer<N, uint8_t, I> sysex_write(Buffer<N, uint8_t, I> buf) const
   {
-    buf[0] = (value >> 4) & 0xf;
-    buf[1] = (value >> 0) & 0xf;
+    return buf;
   }
 
-  template<class V, class... REST>
-  void sysex_write(uint8_t *buf, V value, REST... values) const
+  template<size_t N, size_t I, class V, class... REST>
+  Buffer<N, uint8_t, I + 2 * (sizeof...(REST) + 1)>
+  sysex_write(Buffer<N, uint8_t, I> buf, const V &value, const REST &...values) const
   {
-    sysex_write<V>(buf, value);
-    sysex_write<REST...>(buf + 2, values...);
+    return sysex_write(sysex_data(buf, (value >> 4) & 0xf, (value >> 0) & 0xf),
+     values...);
   }
 
   /* Note: addr is encoded with bit 7 as padding.
@@ -282,55 +292,48 @@ public:
    * The actual calculation involves bytes 8 through (end - 2) only.
    */
   template<class... REST>
-  void sysex(std::vector<uint8_t> &out, unsigned addr, REST... values) const
+  void sysex(std::vector<uint8_t> &out, unsigned addr, const REST &...values) const
   {
-    constexpr unsigned len = 2 * sizeof...(values);
-    uint8_t buf[len + 14];
-    buf[0]  = 0xf0; /* SysEx */
-    buf[1]  = 0x41; /* Roland */
-    buf[2]  = 0x10; /* Device number */
-    buf[3]  = 0x00; /* Model ID (4): Boutique JU-06A */
-    buf[4]  = 0x00;
-    buf[5]  = 0x00;
-    buf[6]  = 0x62;
-    buf[7]  = 0x12; /* Command: set parameter */
-    buf[8]  = 0x03; /* Address (4) */
-    buf[9]  = 0x00;
-    buf[10] = addr >> 8;
-    buf[11] = addr & 0x7f;
-
-    sysex_write<REST...>(buf + 12, values...);
-
-    buf[len + 12] = MIDIInterface::roland_checksum(buf + 8, len + 4);
-    buf[len + 13] = 0xf7; /* End SysEx */
-
-    out.insert(out.end(), std::begin(buf), std::end(buf));
+    /* Address (4): 03 00 hi lo */
+    auto msg = sysex_frame<4, 2 * sizeof...(values)>(JU06A_DT1, 0, 0x03000000 | addr);
+
+    sysex_write(msg.data(), values...).check();
+    msg.write(out);
   }
 
   /* Special case for the name string... */
   template<size_t N>
   void sysex_name(std::vector<uint8_t> &out, unsigned addr, const OptionString<N> &s) const
   {
-    uint8_t buf[N + 14];
-    buf[0]  = 0xf0; /* SysEx */
-    buf[1]  = 0x41; /* Roland */
-    buf[2]  = 0x10; /* Device Number */
-    buf[3]  = 0x00; /* Model ID (4): Boutique JU-06A */
-    buf[4]  = 0x00;
-    buf[5]  = 0x00;
-    buf[6]  = 0x62;
-    buf[7]  = 0x12; /* Command: set parameter */
-    buf[8]  = 0x03; /* Address (4) */
-    buf[9]  = 0x00;
-    buf[10] = addr >> 8;
-    buf[11] = addr & 0x7f;
-
-    memcpy(buf + 12, s.value(), N);
-
-    buf[N + 12] = MIDIInterface::roland_checksum(buf + 8, N + 4);
-    buf[N + 13] = 0xf7; /* End SysEx */
-
-    out.insert(out.end(), std::begin(buf), std::end(buf));
+    auto msg = sysex_frame<4, N>(JU06A_DT1, 0, 0x03000000 | addr);
+    uint8_t name[N];
+
+    memcpy(name, s.value(), N);
+
+    msg.data().append(name).check();
+    msg.write(out);
+  }
+
+  /* Request `size` bytes of parameters starting at addr. */
+  void sysex_request(std::vector<uint8_t> &out, unsigned addr, unsigned size) const
+  {
+    auto msg = sysex_frame<4, 4>(JU06A_RQ1, 0, 0x03000000 | addr);
+
+    msg.set(0x00, 0x00, size >> 7, size & 0x7f); /* Size (4) */
+    msg.write(out);
+  }
+
+  virtual unsigned dump_request(std::vector<uint8_t> &out) const
+  {
+    sysex_request(out, 0x0600, 0x08); /* LFO */
+    sysex_request(out, 0x0700, 0x12); /* DCO */
+    sysex_request(out, 0x0800, 0x0e); /* VCF */
+    sysex_request(out, 0x0900, 0x04); /* VCA */
+    sysex_request(out, 0x0a00, 0x08); /* ENV */
+    sysex_request(out, 0x1000, 0x0c); /* FX (1) */
+    sysex_request(out, 0x1100, 0x0c); /* FX (2) */
+    sysex_request(out, 0x1300, 0x10); /* Name */
+    return 8;
   }
 
   virtual void program(EventSchedule &ev) const
@@ -412,7 +415,14 @@ public:
       cc(out, CC::BendRange, BendRange);
     }
 
-    MIDIEvent::schedule(ev, *this, std::move(out), EventSchedule::PROGRAM_TIME);
+    /* Only send the parameters that changed since the previous patch. */
+    if(SendSysEx)
+      roland_changes(out, 8, 4, 2);
+    else
+      cc_changes(out);
+
+    if(out.size())
+      MIDIEvent::schedule(ev, *this, std::move(out), EventSchedule::PROGRAM_TIME);
 
     /* Manual parameters. */
     snprintf(buf, sizeof(buf),
@@ -545,256 +555,223 @@ public:
 
   virtual bool load()
   {
-    std::vector<uint8_t> in;
+    SysExFile file;
 
-    if(!SysExPath[0] || !MIDIInterface::load_file(in, SysExPath))
+    if(!SysExPath[0] || !file.open(SysExPath))
       return false;
 
-    if(in.size() < 3)
+    return load_data(file.data(), file.size());
+  }
+
+  /* Parameter blocks (address, size). Parameters are stored as two
+   * nibbles, with the low nibble at the odd address. A DT1 message running
+   * past the end of a block continues at the start of the next block. */
+  static constexpr unsigned blocks[][2] =
+  {
+    { 0x0600, 0x0e }, /* LFO */
+    { 0x0700, 0x1a }, /* DCO */
+    { 0x0800, 0x18 }, /* VCF */
+    { 0x0900, 0x0e }, /* VCA */
+    { 0x0a00, 0x12 }, /* Envelope */
+    { 0x1000, 0x14 }, /* Effects 1 */
+    { 0x1100, 0x16 }, /* Effects 2 */
+    { 0x1300, 0x10 }, /* Name */
+  };
+
+  /* Index a DT1 segment. */
+  bool add_segment(RolandImage &image, unsigned addr, const uint8_t *data, size_t len)
+  {
+    size_t i;
+    for(i = 0; i < std::size(blocks); i++)
+      if(addr >= blocks[i][0] && addr < blocks[i][0] + blocks[i][1])
+        break;
+
+    /* Skip messages starting at unmapped memory areas. */
+    if(i >= std::size(blocks))
       return false;
 
-    unsigned inpos = 0;
-    unsigned end = in.size() - 3;
-    while(inpos < end)
+    for(; i < std::size(blocks) && len; i++)
     {
-      unsigned code = in[inpos++];
-      if(code == 0xb0)
+      size_t n = std::min<size_t>(len, blocks[i][0] + blocks[i][1] - addr);
+      image.add(RolandImage::linear(addr), data, n);
+      data += n;
+      len -= n;
+
+      if(i + 1 < std::size(blocks))
+        addr = blocks[i + 1][0];
+    }
+    return true;
+  }
+
+  void load_param(unsigned addr, unsigned value)
+  {
+    switch(addr)
+    {
+    case 0x0601:  /* LFO */
+      LFORate = value;
+      break;
+    case 0x0603:
+      LFODelay = value;
+      break;
+    case 0x0605:
+      LFOWaveform = value;
+      break;
+    case 0x0607:
+      LFOKeyTrigger = value;
+      break;
+
+    case 0x0701: /* DCO */
+      DCORange = value;
+      break;
+    case 0x0703:
+      DCOLFOLevel = value;
+      break;
+    case 0x0705:
+      DCOPWMLevel = value;
+      break;
+    case 0x0707:
+      DCOPWMSource = value;
+      break;
+    case 0x0709:
+      DCOPW = value;
+      break;
+    case 0x070b:
+      DCOSaw = value;
+      break;
+    case 0x070d:
+      DCOSubLevel = value;
+      break;
+    case 0x070f:
+      DCONoiseLevel = value;
+      break;
+    case 0x0711:
+      DCOSub = value;
+      break;
+
+    case 0x0801: /* VCF */
+      HPFCutoff = value;
+      break;
+    case 0x0803:
+      VCFCutoff = value;
+      break;
+    case 0x0805:
+      VCFResonance = value;
+      break;
+    case 0x0807:
+      VCFEnvPolarity = value;
+      break;
+    case 0x0809:
+      VCFEnvLevel = value;
+      break;
+    case 0x080b:
+      VCFLFOLevel = value;
+      break;
+    case 0x080d:
+      VCFKeyLevel = value;
+      break;
+
+    case 0x0901: /* VCA */
+      VCAEnv = value;
+      break;
+    case 0x0903:
+      VCALevel = value;
+      break;
+
+    case 0x0a01: /* Envelope */
+      EnvAttack = value;
+      break;
+    case 0x0a03:
+      EnvDecay = value;
+      break;
+    case 0x0a05:
+      EnvSustain = value;
+      break;
+    case 0x0a07:
+      EnvRelease = value;
+      break;
+
+    case 0x1001: /* Effects 1 */
+      Chorus = value;
+      break;
+    case 0x1003:
+      DelayLevel = value;
+      break;
+    case 0x1005:
+      DelayTime = value;
+      break;
+    case 0x1007:
+      DelayFeedback = value;
+      break;
+    case 0x100b:
+      Delay = value;
+      break;
+
+    case 0x1101: /* Effects 2 */
+      Portamento = value;
+      break;
+    case 0x1103:
+      PortamentoTime = value;
+      break;
+    case 0x1107:
+      AssignMode = value;
+      break;
+    case 0x1109:
+      BendRange = value;
+      break;
+    case 0x110b:
+      TempoSync = value;
+      break;
+    }
+  }
+
+  virtual bool load_data(const uint8_t *data, size_t size)
+  {
+    SysExParser parser(data, size, 4, 4);
+    SysExMessage msg;
+    RolandImage image;
+
+    while(parser.next(msg))
+    {
+      if(msg.status == 0xb0)
       {
         /* MIDI CC */
-        unsigned param = in[inpos++];
-        unsigned value = in[inpos++];
-        load_cc(param, value);
+        load_cc(msg.payload[0], msg.payload[1]);
         continue;
       }
 
       /* SysEx */
-      if(code != 0xf0 || inpos + 12 > in.size())
-        continue;
-      if(in[inpos++] != 0x41)
+      if(msg.status != 0xf0 || msg.manufacturer != SysExParser::ROLAND)
         continue;
 
-      uint8_t unitid = in[inpos + 0];  /* 10h */
-      uint8_t model0 = in[inpos + 1];  /*  0h */
-      uint8_t model1 = in[inpos + 2];  /*  0h */
-      uint8_t model2 = in[inpos + 3];  /*  0h */
-      uint8_t model3 = in[inpos + 4];  /* 62h (JU-06A) or 0x1d (JU-06)*/
-      uint8_t command = in[inpos + 5]; /* 12h */
-      uint8_t addr0 = in[inpos + 6];
-      uint8_t addr1 = in[inpos + 7];
-      uint8_t addr2 = in[inpos + 8];
-      uint8_t addr3 = in[inpos + 9];
-
-      if((unitid & 0x80) || (command != 0x12) || model0 != 0 || model1 != 0 ||
-         model2 != 0 || (model3 != 0x62 && model3 != 0x1d))
+      /* Model 00 00 00 62h (JU-06A) or 00 00 00 1dh (JU-06) */
+      if(msg.command != SysExParser::ROLAND_DT1 ||
+         (msg.model != 0x62 && msg.model != 0x1d))
         continue;
 
-      inpos += 10;
-
-      unsigned sum = (unsigned)addr0 + addr1 + addr2 + addr3;
-      unsigned addr = (addr2 << 8) | addr3;
-
-      unsigned end2 = inpos;
-      while(end2 < in.size() && in[end2] < 0x80)
-        end2++;
-      if(end2 >= in.size() || in[end2] != 0xf7 || end2 - inpos < 2)
+      if(!msg.valid)
         return false;
-      /* Do not load checksum. */
-      end2--;
-
-      /* Skip messages starting at unmapped memory areas. */
-      if(addr < 0x0600 ||
-         (addr >= 0x060e && addr < 0x0700) ||
-         (addr >= 0x071a && addr < 0x0800) ||
-         (addr >= 0x0818 && addr < 0x0900) ||
-         (addr >= 0x090e && addr < 0x0a00) ||
-         (addr >= 0x0a12 && addr < 0x1000) ||
-         (addr >= 0x1014 && addr < 0x1100) ||
-         (addr >= 0x1116 && addr < 0x1300) ||
-         (addr >= 0x1310))
-      {
-        while(inpos < end2)
-          sum += in[inpos++];
 
-        sum += in[inpos++];
-        fprintf(stderr, "bad addr %04x, sum=%02x\n", addr, sum);
-        if(sum & 0x7f)
-          return false;
+      unsigned addr = msg.address & 0xffff;
+      if(!add_segment(image, addr, msg.payload, msg.payload_length))
+        fprintf(stderr, "bad addr %04x\n", addr);
+    }
 
-        continue;
-      }
+    for(auto &block : blocks)
+    {
+      unsigned end = block[0] + block[1];
+      unsigned v;
 
-      unsigned hi = 0;
-      while(inpos < end2 && addr < 0x1310)
+      if(block[0] == 0x1300)
       {
-        unsigned lo = in[inpos++];
-        sum += lo;
-
-        switch(addr)
-        {
-        default:
-          hi = lo;
-          break;
-
-        case 0x0601:  /* LFO */
-          LFORate = value(hi, lo);
-          break;
-        case 0x0603:
-          LFODelay = value(hi, lo);
-          break;
-        case 0x0605:
-          LFOWaveform = value(hi, lo);
-          break;
-        case 0x0607:
-          LFOKeyTrigger = value(hi, lo);
-          break;
-        case 0x060f:
-          addr = 0x0701;
-          /* fall-through */
-
-        case 0x0701: /* DCO */
-          DCORange = value(hi, lo);
-          break;
-        case 0x0703:
-          DCOLFOLevel = value(hi, lo);
-          break;
-        case 0x0705:
-          DCOPWMLevel = value(hi, lo);
-          break;
-        case 0x0707:
-          DCOPWMSource = value(hi, lo);
-          break;
-        case 0x0709:
-          DCOPW = value(hi, lo);
-          break;
-        case 0x070b:
-          DCOSaw = value(hi, lo);
-          break;
-        case 0x070d:
-          DCOSubLevel = value(hi, lo);
-          break;
-        case 0x070f:
-          DCONoiseLevel = value(hi, lo);
-          break;
-        case 0x0711:
-          DCOSub = value(hi, lo);
-          break;
-        case 0x071b:
-          addr = 0x0801;
-          /* fall-through */
-
-        case 0x0801: /* VCF */
-          HPFCutoff = value(hi, lo);
-          break;
-        case 0x0803:
-          VCFCutoff = value(hi, lo);
-          break;
-        case 0x0805:
-          VCFResonance = value(hi, lo);
-          break;
-        case 0x0807:
-          VCFEnvPolarity = value(hi, lo);
-          break;
-        case 0x0809:
-          VCFEnvLevel = value(hi, lo);
-          break;
-        case 0x080b:
-          VCFLFOLevel = value(hi, lo);
-          break;
-        case 0x080d:
-          VCFKeyLevel = value(hi, lo);
-          break;
-        case 0x0819:
-          addr = 0x0901;
-          /* fall-through */
-
-        case 0x0901: /* VCA */
-          VCAEnv = value(hi, lo);
-          break;
-        case 0x0903:
-          VCALevel = value(hi, lo);
-          break;
-        case 0x090f:
-          addr = 0x0a01;
-          /* fall-through */
-
-        case 0x0a01: /* Envelope */
-          EnvAttack = value(hi, lo);
-          break;
-        case 0x0a03:
-          EnvDecay = value(hi, lo);
-          break;
-        case 0x0a05:
-          EnvSustain = value(hi, lo);
-          break;
-        case 0x0a07:
-          EnvRelease = value(hi, lo);
-          break;
-        case 0x0a13:
-          addr = 0x1001;
-          /* fall-through */
-
-        case 0x1001: /* Effects 1 */
-          Chorus = value(hi, lo);
-          break;
-        case 0x1003:
-          DelayLevel = value(hi, lo);
-          break;
-        case 0x1005:
-          DelayTime = value(hi, lo);
-          break;
-        case 0x1007:
-          DelayFeedback = value(hi, lo);
-          break;
-        case 0x100b:
-          Delay = value(hi, lo);
-          break;
-        case 0x1015:
-          addr = 0x1101;
-          /* fall-through */
-
-        case 0x1101: /* Effects 2 */
-          Portamento = value(hi, lo);
-          break;
-        case 0x1103:
-          PortamentoTime = value(hi, lo);
-          break;
-        case 0x1107:
-          AssignMode = value(hi, lo);
-          break;
-        case 0x1109:
-          BendRange = value(hi, lo);
-          break;
-        case 0x110b:
-          TempoSync = value(hi, lo);
-          break;
-        case 0x1106:
-          addr = 0x1300;
-          /* fall-through */
-
-        case 0x1300:
-        case 0x1301:
-        case 0x1302:
-        case 0x1303:
-        case 0x1304:
-        case 0x1305:
-        case 0x1306:
-        case 0x1307:
-        case 0x1308:
-        case 0x1309:
-        case 0x130a:
-        case 0x130b:
-        case 0x130c:
-        case 0x130d:
-        case 0x130e:
-        case 0x130f:
-          Name[addr & 0xf] = lo;
-          break;
-        }
-        addr++;
+        for(unsigned addr = block[0]; addr < end; addr++)
+          if(image.get(RolandImage::linear(addr), v))
+            Name[addr & 0xf] = v;
+        continue;
       }
-      sum += in[inpos++];
-      if(sum & 0x7f)
-        return false;
+
+      for(unsigned addr = block[0] + 1; addr < end; addr += 2)
+        if(image.get_nibbles(RolandImage::linear(addr - 1), v))
+          load_param(addr, v);
     }
     return true;
   }
@@ -19,6 +19,8 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -82,7 +84,69 @@ void Platform::delay(unsigned ms)
   }
 }
 
+int64_t Platform::clock_us()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+bool Platform::sleep_until(int64_t time_us, const volatile sig_atomic_t *cancel)
+{
+  struct timespec req;
+
+  req.tv_sec = time_us / 1000000;
+  req.tv_nsec = (time_us % 1000000) * 1000;
+
+  /* The deadline is absolute, so an interrupted sleep can simply be
+   * restarted without accumulating error. */
+  while(int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, nullptr))
+  {
+    if(err != EINTR)
+      break;
+    if(cancel && *cancel)
+      return false;
+  }
+  return true;
+}
+
 void Platform::wait_input()
 {
   for(int c = 0; c != '\n' && c != EOF; c = fgetc(stdin));
 }
+
+std::shared_ptr<const void> Platform::map_file(const char *filename, size_t &size)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0)
+    return nullptr;
+
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  size = st.st_size;
+  if(!size)
+  {
+    close(fd);
+    static constexpr uint8_t empty = 0;
+    return std::shared_ptr<const void>(&empty, [](const void *){});
+  }
+
+  void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(ptr == MAP_FAILED)
+    return nullptr;
+
+  /* Samples and dumps are read front to back. */
+  madvise(ptr, size, MADV_SEQUENTIAL);
+
+  return std::shared_ptr<const void>(ptr, [size](void *p)
+  {
+    munmap(p, size);
+  });
+}
@@ -19,6 +19,11 @@
 #ifndef PLATFORM_HPP
 #define PLATFORM_HPP
 
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
 template<class T>
 static inline constexpr T cast_multiply(T a, T b)
 {
@@ -31,7 +36,18 @@ public:
   static bool mkdir_recursive(char *path);
   static bool mkdir_recursive(const char *path);
   static void delay(unsigned ms);
+
+  /* Monotonic clock in microseconds from an arbitrary origin. */
+  static int64_t clock_us();
+  /* Sleep until clock_us() reaches an absolute deadline. Returns `false`
+   * early if a signal handler set `cancel`. */
+  static bool sleep_until(int64_t time_us,
+   const volatile sig_atomic_t *cancel = nullptr);
   static void wait_input();
+
+  /* Map a regular file read-only. Returns nullptr on failure; an empty
+   * file is mapped with a size of 0. */
+  static std::shared_ptr<const void> map_file(const char *filename, size_t &size);
 };
 
 #endif /* PLATFORM_HPP */
@@ -0,0 +1,153 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RELEASEDETECTOR_HPP
+#define RELEASEDETECTOR_HPP
+
+#include "AudioBuffer.hpp"
+#include "Event.hpp"
+
+#include <math.h>
+#include <atomic>
+
+/**
+ * Envelope follower run from the capture callback. After a note is
+ * released, it watches the tail and signals once the level has stayed below
+ * the threshold for the hold time, so the scheduler can start the next note
+ * instead of waiting out the fixed Off_ms + Quiet_ms.
+ */
+template<class T>
+class ReleaseDetector : public AudioListener
+{
+  static constexpr double ENVELOPE_MS = 10.0;
+
+  const AudioBuffer<T> &buffer;
+  unsigned threshold;
+  size_t hold_frames;
+  float decay;
+
+  /* Capture callback state. */
+  float envelope = 0.0f;
+  size_t pos = 0;
+  std::atomic<size_t> last_loud{0};
+
+  std::atomic<size_t> arm_frame{0};
+  std::atomic<bool> armed{false};
+  std::atomic<bool> released{false};
+  int64_t resume_us = 0;
+
+public:
+  ReleaseDetector(const AudioBuffer<T> &_buffer, unsigned _threshold,
+   unsigned hold_ms):
+   buffer(_buffer), threshold(_threshold),
+   hold_frames(static_cast<uint64_t>(_buffer.rate) * hold_ms / 1000),
+   decay(exp(-1000.0 / (_buffer.rate * ENVELOPE_MS))) {}
+
+  /**
+   * Start watching for the end of a release.
+   *
+   * @param _resume_us  Timeline time the scheduler may skip ahead to.
+   */
+  void arm(int64_t _resume_us)
+  {
+    resume_us = _resume_us;
+    released = false;
+    arm_frame = buffer.total_frames();
+    armed = true;
+  }
+
+  void disarm()
+  {
+    armed = false;
+    released = false;
+  }
+
+  bool is_armed() const
+  {
+    return armed;
+  }
+
+  /* Returns `true` once if the release ended; the detector is disarmed. */
+  bool check_released()
+  {
+    if(!released.exchange(false))
+      return false;
+
+    armed = false;
+    return true;
+  }
+
+  int64_t resume_time() const
+  {
+    return resume_us;
+  }
+
+  void frames_written(size_t total_frames) override
+  {
+    const T *samples = buffer.get_samples();
+    unsigned channels = buffer.channels;
+
+    for(; pos < total_frames; pos++)
+    {
+      float peak = 0.0f;
+      for(unsigned i = 0; i < channels; i++)
+        peak = std::max(peak, fabsf(samples[pos * channels + i]));
+
+      envelope = std::max(peak, envelope * decay);
+      if(envelope >= threshold)
+        last_loud.store(pos + 1, std::memory_order_relaxed);
+    }
+
+    if(armed)
+    {
+      size_t quiet_from = std::max<size_t>(last_loud, arm_frame);
+      if(total_frames - quiet_from >= hold_frames)
+        released = true;
+    }
+  }
+};
+
+class ReleaseEvent
+{
+  template<class T>
+  static void task(const Event &e, const uint8_t *data)
+  {
+    ReleaseDetector<T> &detector =
+     *const_cast<ReleaseDetector<T> *>(static_cast<const ReleaseDetector<T> *>(e.target));
+
+    detector.arm(e.time_us + e.param);
+  }
+
+public:
+  /**
+   * Arm a release detector at the given time.
+   *
+   * @param ev          Event schedule.
+   * @param detector    Release detector to arm.
+   * @param _time_us    Time of the note off.
+   * @param _resume_us  Time the remaining timeline may be moved up to.
+   */
+  template<class T>
+  static void schedule(EventSchedule &ev, ReleaseDetector<T> &detector,
+   int64_t _time_us, int64_t _resume_us)
+  {
+    ev.push(_time_us, task<T>, &detector, _resume_us - _time_us);
+  }
+};
+
+#endif /* RELEASEDETECTOR_HPP */
@@ -50,7 +50,7 @@ public:
     return true;
   }
 
-  virtual void midi_write(const std::vector<uint8_t> &data, int num)
+  virtual void midi_write(const uint8_t *data, size_t length, int num)
   {
     return;
   }
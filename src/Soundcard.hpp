@@ -21,6 +21,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
 #include <functional>
 #include <vector>
 
@@ -34,6 +35,7 @@ class Soundcard
 protected:
   unsigned in_channels = 0;
   unsigned in_rate = 0;
+  bool queue_running = false;
 
 public:
   const char * const name;
@@ -50,8 +52,110 @@ public:
   virtual bool audio_capture_start(AudioInput &dest) = 0;
   virtual bool audio_capture_stop() = 0;
 
+  /* Capture stopped on an error it couldn't recover from. */
+  virtual bool audio_capture_failed() const
+  {
+    return false;
+  }
+
+  /* MIDI output failed; data may have been lost. */
+  virtual bool midi_output_failed() const
+  {
+    return false;
+  }
+
   virtual bool init_midi_out(const char *interface, unsigned num) = 0;
-  virtual void midi_write(const std::vector<uint8_t> &data, int num) = 0;
+  virtual void midi_write(const uint8_t *data, size_t length, int num) = 0;
+
+  /* Completion times of MIDI output written in the background (optional).
+   * While tracking, each midi_write() handed to a background writer gets an
+   * id, and its completion time is when all of its data has been accepted
+   * by the device. Output written synchronously gets no id. */
+  struct MIDIWriteTime
+  {
+    uint64_t id;
+    int64_t done_us;
+  };
+
+  virtual void midi_track_writes(bool enable) {}
+
+  /* Id of the most recent tracked midi_write(), or 0 if none. */
+  virtual uint64_t midi_write_id() const
+  {
+    return 0;
+  }
+
+  /* Wait for background output to be sent and move the completion times
+   * recorded so far to `out`. */
+  virtual void midi_write_times(std::vector<MIDIWriteTime> &out) {}
+
+  /* Output written in the background hasn't been completely sent yet. */
+  virtual bool midi_output_pending()
+  {
+    return false;
+  }
+
+  /* MIDI input (optional), used to receive SysEx dumps from a device. */
+  virtual bool init_midi_in(const char *interface, unsigned num)
+  {
+    return false;
+  }
+
+  /* Read up to `length` received bytes, waiting at most `timeout_ms` for
+   * data to arrive. Returns the number of bytes read, 0 on timeout, or -1
+   * on error. */
+  virtual ssize_t midi_read(uint8_t *data, size_t length, unsigned num,
+   unsigned timeout_ms)
+  {
+    return -1;
+  }
+
+  /* Pace output to a device (optional): at most `bytes_per_sec` bytes per
+   * second (0: no limit) and a pause after each SysEx message. */
+  virtual void midi_flow_control(unsigned num, unsigned bytes_per_sec,
+   unsigned sysex_delay_ms) {}
+
+  /* Timestamped MIDI output (optional). Once the queue is started, data
+   * written with midi_write_at is sent by the driver time_us after the
+   * start of the queue regardless of when this process runs. */
+  virtual bool init_midi_queue(const char *address, unsigned num, bool pcm_clock)
+  {
+    return false;
+  }
+
+  virtual bool midi_queue_start()
+  {
+    return false;
+  }
+
+  /* Stop the queue; with `drain`, wait for queued events to be sent first,
+   * otherwise discard them. */
+  virtual void midi_queue_stop(bool drain = true) {}
+
+  /* Send timestamped output that didn't fit in the driver's buffer when it
+   * was written. Call periodically while the queue runs; returns `true`
+   * while output is still waiting for room. */
+  virtual bool midi_queue_refill()
+  {
+    return false;
+  }
+
+  virtual void midi_write_at(const uint8_t *data, size_t length, int num,
+   int64_t time_us)
+  {
+    midi_write(data, length, num);
+  }
+
+  bool midi_queue_running() const
+  {
+    return queue_running;
+  }
+
+  /* Estimate the capture position at a Platform::clock_us() time. */
+  virtual bool audio_capture_position(int64_t time_us, uint64_t &frame) const
+  {
+    return false;
+  }
 
   void select()
   {
@@ -18,26 +18,395 @@
 
 #include "AudioBuffer.hpp"
 #include "Config.hpp"
+#include "Log.hpp"
+#include "Platform.hpp"
 #include "Soundcard.hpp"
 
 #include <alsa/asoundlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 static void async_callback(snd_async_handler_t *a);
 
+/**
+ * Output queue for a rawmidi stream. A writer thread sends the queued data
+ * and retries short writes. SysEx messages are sent in chunks paced to the
+ * device's byte rate, with a pause after each message, so large dumps are
+ * neither truncated by a full device buffer nor sent faster than older
+ * devices can take them. Output stays in the order it was written: channel
+ * messages queued while SysEx is still going out (or pausing) are sent
+ * behind it, and only channel messages queued after that are sent unpaced.
+ * Writes given an id are timestamped once all of their data is written.
+ */
+class RawMidiWriter
+{
+  static constexpr size_t CHUNK_SIZE = 64;
+  static constexpr int64_t STALL_US = 1000000;
+
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<uint8_t> paced;
+  std::vector<uint8_t> channel;
+  size_t paced_pos = 0;
+  int64_t paced_until_us = 0;
+  bool in_sysex = false;
+  bool behind_sysex = false;
+  bool writing = false;
+  bool stop = false;
+  std::atomic<bool> failed{false};
+
+  /* Ids of queued writes and the queue size at the end of their data. */
+  std::vector<std::pair<size_t, uint64_t>> paced_ids;
+  std::vector<std::pair<size_t, uint64_t>> channel_ids;
+  size_t paced_ids_pos = 0;
+  std::vector<Soundcard::MIDIWriteTime> times;
+
+  snd_rawmidi_t *out = nullptr;
+  unsigned num = 0;
+  unsigned byte_rate = 0;
+  int64_t sysex_delay_us = 0;
+
+  bool write_all(const uint8_t *data, size_t length)
+  {
+    int64_t stall_us = Platform::clock_us() + STALL_US;
+    while(length)
+    {
+      ssize_t ret = snd_rawmidi_write(out, data, length);
+      if(ret < 0 && ret != -EAGAIN)
+      {
+        Log::print(Log::ERROR, "ALSA RawMidi: output %u: write error: %s\n",
+         num, snd_strerror(ret));
+        return false;
+      }
+      if(ret <= 0)
+      {
+        /* Device buffer is full; wait for it to drain a bit. */
+        if(Platform::clock_us() > stall_us)
+        {
+          Log::print(Log::ERROR, "ALSA RawMidi: output %u: device stalled\n", num);
+          return false;
+        }
+        Platform::delay(1);
+        continue;
+      }
+      data += ret;
+      length -= ret;
+      stall_us = Platform::clock_us() + STALL_US;
+    }
+    return true;
+  }
+
+  /* Output is queued or being written (call with the lock held). */
+  bool is_pending() const
+  {
+    return writing || paced_pos < paced.size() || channel.size();
+  }
+
+  void run()
+  {
+    /* Leave signals (capture callback, abort) to the main thread. */
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    std::vector<uint8_t> data;
+    std::vector<std::pair<size_t, uint64_t>> ids;
+    int64_t start_us = 0;
+    size_t sent = 0;
+
+    std::unique_lock<std::mutex> guard(lock);
+    while(true)
+    {
+      bool ok = true;
+      int64_t until_us = -1;
+      if(channel.size())
+      {
+        /* Everything paced was queued after this. */
+        data.swap(channel);
+        channel.clear();
+        ids.swap(channel_ids);
+        channel_ids.clear();
+        writing = true;
+        guard.unlock();
+
+        ok = write_all(data.data(), data.size());
+        data.clear();
+      }
+      else
+
+      if(paced_pos < paced.size())
+      {
+        int64_t now_us = Platform::clock_us();
+        if(now_us < paced_until_us)
+        {
+          cond.wait_for(guard, std::chrono::microseconds(paced_until_us - now_us));
+          continue;
+        }
+
+        /* Send up to the end of the next SysEx message. */
+        const uint8_t *src = paced.data() + paced_pos;
+        size_t n = std::min(CHUNK_SIZE, paced.size() - paced_pos);
+        const void *end = memchr(src, 0xf7, n);
+        if(end)
+          n = static_cast<const uint8_t *>(end) - src + 1;
+
+        data.assign(src, src + n);
+        paced_pos += n;
+        writing = true;
+        unsigned rate = byte_rate;
+        int64_t delay_us = sysex_delay_us;
+        guard.unlock();
+
+        if(!sent)
+          start_us = now_us;
+
+        ok = write_all(data.data(), n);
+        sent += n;
+
+        until_us = rate ? now_us + n * 1000000LL / rate : 0;
+        if(end && delay_us)
+          until_us = std::max(until_us, Platform::clock_us() + delay_us);
+      }
+      else
+
+      if(stop)
+        break;
+      else
+      {
+        cond.wait(guard);
+        continue;
+      }
+
+      int64_t done_us = Platform::clock_us();
+      guard.lock();
+      if(until_us >= 0)
+        paced_until_us = until_us;
+
+      /* Timestamp the writes that are now completely sent. */
+      if(ok)
+      {
+        for(auto &id : ids)
+          times.push_back({ id.second, done_us });
+
+        for(; paced_ids_pos < paced_ids.size() &&
+         paced_ids[paced_ids_pos].first <= paced_pos; paced_ids_pos++)
+          times.push_back({ paced_ids[paced_ids_pos].second, done_us });
+      }
+      ids.clear();
+
+      if(!ok)
+      {
+        /* Drop everything queued; the capture is aborted. */
+        failed = true;
+        paced.clear();
+        channel.clear();
+        paced_ids.clear();
+        channel_ids.clear();
+        paced_pos = 0;
+        paced_ids_pos = 0;
+        paced_until_us = 0;
+      }
+
+      if(paced_pos >= paced.size() && sent)
+      {
+        paced.clear();
+        paced_ids.clear();
+        paced_pos = 0;
+        paced_ids_pos = 0;
+
+        /* Report how long programming took. */
+        if(ok)
+        {
+          guard.unlock();
+          snd_rawmidi_drain(out);
+          Log::print(Log::INFO, "ALSA RawMidi: output %u: sent %zu bytes in %.1fms\n",
+           num, sent, (Platform::clock_us() - start_us) / 1000.0);
+          guard.lock();
+        }
+        sent = 0;
+      }
+      writing = false;
+      cond.notify_all();
+    }
+  }
+
+public:
+  ~RawMidiWriter()
+  {
+    close();
+  }
+
+  void open(snd_rawmidi_t *_out, unsigned _num)
+  {
+    close();
+    out = _out;
+    num = _num;
+    thread = std::thread(&RawMidiWriter::run, this);
+  }
+
+  /* Stop the writer once everything queued has been sent. */
+  void close()
+  {
+    if(thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+      }
+      cond.notify_all();
+      thread.join();
+    }
+    paced.clear();
+    channel.clear();
+    paced_ids.clear();
+    channel_ids.clear();
+    times.clear();
+    paced_pos = 0;
+    paced_ids_pos = 0;
+    paced_until_us = 0;
+    in_sysex = false;
+    behind_sysex = false;
+    writing = false;
+    stop = false;
+    failed = false;
+    out = nullptr;
+  }
+
+  void set_flow(unsigned bytes_per_sec, unsigned sysex_delay_ms)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    byte_rate = bytes_per_sec;
+    sysex_delay_us = sysex_delay_ms * 1000LL;
+  }
+
+  /* A write failed or stalled; queued output was dropped. */
+  bool has_failed() const
+  {
+    return failed;
+  }
+
+  /* Output hasn't been completely sent yet, or the device is still in the
+   * pause after a SysEx message. */
+  bool pending()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return thread.joinable() &&
+     (is_pending() || Platform::clock_us() < paced_until_us);
+  }
+
+  /* Wait for everything queued to be sent, then move the completion times
+   * of the writes so far to `out`. */
+  void take_times(std::vector<Soundcard::MIDIWriteTime> &out)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    if(thread.joinable())
+    {
+      /* A stalled write fails within STALL_US; pacing doesn't take longer
+       * than one message's pause between writes. */
+      cond.wait(guard, [this]{ return failed || !is_pending(); });
+    }
+    out.insert(out.end(), times.begin(), times.end());
+    times.clear();
+  }
+
+  void write(const uint8_t *data, size_t length, uint64_t id = 0)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      size_t paced_size = paced.size();
+      size_t channel_size = channel.size();
+
+      /* Channel messages must not overtake SysEx queued before them. */
+      bool drained = paced_pos >= paced.size() &&
+       !(writing && paced_pos) && Platform::clock_us() >= paced_until_us;
+
+      for(size_t i = 0; i < length; i++)
+      {
+        uint8_t b = data[i];
+        /* Real time messages may be sent in the middle of a SysEx message;
+         * any other status byte ends it. */
+        if(b == 0xf0)
+          in_sysex = true;
+        else
+
+        if(b >= 0x80 && b < 0xf8 && b != 0xf7)
+        {
+          in_sysex = false;
+          behind_sysex = !drained || paced.size() > paced_pos;
+        }
+
+        if(in_sysex || b == 0xf7 || behind_sysex)
+          paced.push_back(b);
+        else
+          channel.push_back(b);
+
+        if(b == 0xf7)
+          in_sysex = false;
+      }
+
+      if(id && paced.size() > paced_size)
+        paced_ids.push_back({ paced.size(), id });
+      if(id && channel.size() > channel_size)
+        channel_ids.push_back({ channel.size(), id });
+    }
+    cond.notify_all();
+  }
+};
+
 static class Soundcard_ALSA final: public Soundcard
 {
   static constexpr unsigned DEFAULT_LATENCY_US = 100000; /* 100ms */
+  static constexpr unsigned SEQ_POOL_SIZE = 2000;
+  static constexpr unsigned SEQ_ENCODE_SIZE = 256;
+  static constexpr int SEQ_STALL_MS = 1000;
 
   snd_pcm_t *audio_in = nullptr;
   snd_async_handler_t *async_in = nullptr;
   AudioInput *in_target = nullptr;
   bool in_fail = false;
 
+  /* Capture position as of the last callback (written by the callback). */
+  std::atomic<uint64_t> in_frames{0};
+  std::atomic<int64_t> in_time_us{0};
+
   snd_rawmidi_t *midi_out[GlobalConfig::max_inputs]{};
+  RawMidiWriter midi_writer[GlobalConfig::max_inputs];
+  bool track_writes = false;
+  uint64_t write_id = 0;
+  snd_rawmidi_t *midi_in[GlobalConfig::max_inputs]{};
   unsigned midi_max = 0;
 
+  /* Sequencer output for MIDIQueue; inputs with a port don't use rawmidi. */
+  snd_seq_t *seq = nullptr;
+  snd_midi_event_t *seq_encoder = nullptr;
+  int seq_queue = -1;
+  int seq_port[GlobalConfig::max_inputs];
+
+  /* Encoded events the output pool had no room for yet, in order. The
+   * payloads of variable length events (SysEx) are copied to a separate
+   * buffer; `ext_offset` locates them. */
+  struct SeqPending
+  {
+    snd_seq_event_t ev;
+    size_t ext_offset;
+  };
+  std::vector<SeqPending> seq_pending;
+  std::vector<uint8_t> seq_pending_ext;
+  size_t seq_pending_pos = 0;
+
 public:
-  Soundcard_ALSA(const char *name): Soundcard(name) {}
+  Soundcard_ALSA(const char *name): Soundcard(name)
+  {
+    std::fill(std::begin(seq_port), std::end(seq_port), -1);
+  }
 
   virtual ~Soundcard_ALSA()
   {
@@ -71,6 +440,9 @@ public:
       in_target = nullptr;
     }
 
+    for(RawMidiWriter &writer : midi_writer)
+      writer.close();
+
     for(snd_rawmidi_t *out : midi_out)
     {
       if(out)
@@ -85,6 +457,43 @@ public:
     }
     memset(midi_out, 0, sizeof(midi_out));
     midi_max = 0;
+
+    for(snd_rawmidi_t *in : midi_in)
+    {
+      if(in)
+      {
+        err = snd_rawmidi_close(in);
+        if(err)
+        {
+          fprintf(stderr, "ALSA RawMidi: error closing input stream: %s\n",
+           snd_strerror(err));
+        }
+      }
+    }
+    memset(midi_in, 0, sizeof(midi_in));
+
+    if(seq)
+    {
+      if(seq_queue >= 0)
+        snd_seq_free_queue(seq, seq_queue);
+
+      err = snd_seq_close(seq);
+      if(err)
+      {
+        fprintf(stderr, "ALSA Seq: error closing sequencer: %s\n",
+         snd_strerror(err));
+      }
+      seq = nullptr;
+    }
+    if(seq_encoder)
+    {
+      snd_midi_event_free(seq_encoder);
+      seq_encoder = nullptr;
+    }
+    seq_queue = -1;
+    queue_running = false;
+    std::fill(std::begin(seq_port), std::end(seq_port), -1);
+    seq_discard();
   }
 
   virtual bool init_audio_in(const char *interface)
@@ -170,6 +579,8 @@ public:
     in_fail = false;
     in_channels = dest.channels;
     in_rate = dest.rate;
+    in_frames = 0;
+    in_time_us = Platform::clock_us();
     return true;
   }
 
@@ -199,6 +610,20 @@ public:
     return true;
   }
 
+  virtual bool audio_capture_failed() const
+  {
+    return in_fail;
+  }
+
+  virtual bool midi_output_failed() const
+  {
+    for(const RawMidiWriter &writer : midi_writer)
+      if(writer.has_failed())
+        return true;
+
+    return false;
+  }
+
   bool audio_capture_error(snd_pcm_sframes_t _err)
   {
     fprintf(stderr, "ALSA PCM: stream error: %s\n",
@@ -265,7 +690,30 @@ public:
       in_target->write(src + start, frames);
 
       snd_pcm_mmap_commit(audio_in, offset, frames);
+      in_frames += frames;
     }
+    in_time_us = Platform::clock_us();
+  }
+
+  virtual bool audio_capture_position(int64_t time_us, uint64_t &frame) const
+  {
+    if(!in_target)
+      return false;
+
+    /* The callback consumes everything available, so the last callback's
+     * total approximates the hardware position at the time it ran. */
+    int64_t last_us;
+    uint64_t frames;
+    do
+    {
+      last_us = in_time_us;
+      frames = in_frames;
+    }
+    while(last_us != in_time_us);
+
+    int64_t elapsed = std::max<int64_t>(time_us - last_us, 0);
+    frame = frames + static_cast<uint64_t>(elapsed) * in_rate / 1000000;
+    return true;
   }
 
 
@@ -277,7 +725,9 @@ public:
       return false;
     }
 
-    if(midi_out[num])
+    /* Sequencer port (MIDIQueue); opening the rawmidi device too would
+     * prevent the sequencer from subscribing to it. */
+    if(midi_out[num] || seq_port[num] >= 0)
       return true;
 
     /* FIXME: mode? */
@@ -294,25 +744,453 @@ public:
       fprintf(stderr, "ALSA RawMidi: failed to set nonblock: %s\n", snd_strerror(err));
       return false;
     }
+    midi_writer[num].open(midi_out[num], num);
 
     midi_max = num + 1;
     return true;
   }
 
-  virtual void midi_write(const std::vector<uint8_t> &data, int num)
+  virtual void midi_write(const uint8_t *data, size_t length, int num)
   {
+    uint64_t id = 0;
+    auto next_id = [&]()
+    {
+      if(!id && track_writes)
+        id = ++write_id;
+      return id;
+    };
+
     if(num >= 0 && (unsigned)num < GlobalConfig::max_inputs)
     {
       if(midi_out[num])
-        snd_rawmidi_write(midi_out[num], data.data(), data.size());
+        midi_writer[num].write(data, length, next_id());
+      else
+
+      if(seq_port[num] >= 0)
+        seq_write(data, length, num, nullptr);
     }
     else
 
-    for(unsigned i = 0; i < midi_max; i++)
+    for(unsigned i = 0; i < GlobalConfig::max_inputs; i++)
     {
       if(midi_out[i])
-        snd_rawmidi_write(midi_out[i], data.data(), data.size());
+        midi_writer[i].write(data, length, next_id());
+      else
+
+      if(seq_port[i] >= 0)
+        seq_write(data, length, i, nullptr);
+    }
+  }
+
+  virtual void midi_track_writes(bool enable)
+  {
+    track_writes = enable;
+  }
+
+  virtual uint64_t midi_write_id() const
+  {
+    return write_id;
+  }
+
+  virtual void midi_write_times(std::vector<MIDIWriteTime> &out)
+  {
+    for(RawMidiWriter &writer : midi_writer)
+      writer.take_times(out);
+  }
+
+  virtual bool midi_output_pending()
+  {
+    for(RawMidiWriter &writer : midi_writer)
+      if(writer.pending())
+        return true;
+
+    return false;
+  }
+
+
+  virtual bool init_midi_in(const char *interface, unsigned num)
+  {
+    if(num >= GlobalConfig::max_inputs)
+    {
+      fprintf(stderr, "ALSA RawMidi: invalid input number %u!\n", num);
+      return false;
+    }
+
+    if(midi_in[num])
+      return true;
+
+    int err = snd_rawmidi_open(&midi_in[num], nullptr, interface, SND_RAWMIDI_NONBLOCK);
+    if(err)
+    {
+      fprintf(stderr, "ALSA RawMidi: error opening input stream: %s\n", snd_strerror(err));
+      midi_in[num] = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  virtual ssize_t midi_read(uint8_t *data, size_t length, unsigned num,
+   unsigned timeout_ms)
+  {
+    if(num >= GlobalConfig::max_inputs || !midi_in[num])
+      return -1;
+
+    struct pollfd fds[4];
+    int count = snd_rawmidi_poll_descriptors(midi_in[num], fds, 4);
+    if(count <= 0)
+      return -1;
+
+    int64_t end_us = Platform::clock_us() + timeout_ms * 1000LL;
+    while(true)
+    {
+      ssize_t ret = snd_rawmidi_read(midi_in[num], data, length);
+      if(ret > 0)
+        return ret;
+
+      if(ret < 0 && ret != -EAGAIN && ret != -EINTR)
+      {
+        fprintf(stderr, "ALSA RawMidi: input %u: error reading: %s\n",
+         num, snd_strerror(ret));
+        return -1;
+      }
+
+      int64_t left_us = end_us - Platform::clock_us();
+      if(left_us <= 0)
+        return 0;
+
+      if(poll(fds, count, (left_us + 999) / 1000) < 0 && errno != EINTR)
+        return -1;
+    }
+  }
+
+
+  bool init_seq_pcm_timer()
+  {
+    if(!audio_in)
+    {
+      fprintf(stderr, "ALSA Seq: no capture stream for PCM clock\n");
+      return false;
+    }
+
+    snd_pcm_info_t *info;
+    snd_pcm_info_alloca(&info);
+    int err = snd_pcm_info(audio_in, info);
+    if(err)
+    {
+      fprintf(stderr, "ALSA Seq: error getting PCM info: %s\n", snd_strerror(err));
+      return false;
+    }
+
+    /* PCM timers are numbered by substream and direction (capture = 1). */
+    snd_timer_id_t *id;
+    snd_timer_id_alloca(&id);
+    snd_timer_id_set_class(id, SND_TIMER_CLASS_PCM);
+    snd_timer_id_set_sclass(id, SND_TIMER_SCLASS_NONE);
+    snd_timer_id_set_card(id, snd_pcm_info_get_card(info));
+    snd_timer_id_set_device(id, snd_pcm_info_get_device(info));
+    snd_timer_id_set_subdevice(id, snd_pcm_info_get_subdevice(info) * 2 + 1);
+
+    snd_seq_queue_timer_t *timer;
+    snd_seq_queue_timer_alloca(&timer);
+    err = snd_seq_get_queue_timer(seq, seq_queue, timer);
+    if(!err)
+    {
+      snd_seq_queue_timer_set_type(timer, SND_SEQ_TIMER_ALSA);
+      snd_seq_queue_timer_set_id(timer, id);
+      err = snd_seq_set_queue_timer(seq, seq_queue, timer);
+    }
+    if(err)
+    {
+      fprintf(stderr, "ALSA Seq: error setting PCM queue timer: %s\n", snd_strerror(err));
+      return false;
+    }
+    return true;
+  }
+
+  virtual bool init_midi_queue(const char *address, unsigned num, bool pcm_clock)
+  {
+    if(num >= GlobalConfig::max_inputs)
+    {
+      fprintf(stderr, "ALSA Seq: invalid input number %u!\n", num);
+      return false;
+    }
+
+    if(seq_port[num] >= 0)
+      return true;
+
+    int err;
+    if(!seq)
+    {
+      /* Non-blocking: a full output pool must not stall the event loop,
+       * so events that don't fit are kept and sent by seq_refill(). */
+      err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, SND_SEQ_NONBLOCK);
+      if(err)
+      {
+        fprintf(stderr, "ALSA Seq: error opening sequencer: %s\n", snd_strerror(err));
+        seq = nullptr;
+        return false;
+      }
+      snd_seq_set_client_name(seq, "ITI Recorder");
+      snd_seq_set_client_pool_output(seq, SEQ_POOL_SIZE);
+
+      err = snd_midi_event_new(SEQ_ENCODE_SIZE, &seq_encoder);
+      if(err)
+      {
+        fprintf(stderr, "ALSA Seq: error allocating encoder: %s\n", snd_strerror(err));
+        return false;
+      }
+
+      seq_queue = snd_seq_alloc_named_queue(seq, "ITI Recorder");
+      if(seq_queue < 0)
+      {
+        fprintf(stderr, "ALSA Seq: error allocating queue: %s\n", snd_strerror(seq_queue));
+        return false;
+      }
+
+      /* The PCM timer only ticks once per period, so events are aligned
+       * to period boundaries. This trades jitter for zero clock drift. */
+      if(pcm_clock && !init_seq_pcm_timer())
+        return false;
+    }
+
+    snd_seq_addr_t dest;
+    err = snd_seq_parse_address(seq, &dest, address);
+    if(err)
+    {
+      fprintf(stderr, "ALSA Seq: invalid address '%s': %s\n", address, snd_strerror(err));
+      return false;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "MIDI %u", num);
+    int port = snd_seq_create_simple_port(seq, name,
+     SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+     SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if(port < 0)
+    {
+      fprintf(stderr, "ALSA Seq: error creating port: %s\n", snd_strerror(port));
+      return false;
+    }
+
+    err = snd_seq_connect_to(seq, port, dest.client, dest.port);
+    if(err)
+    {
+      fprintf(stderr, "ALSA Seq: error connecting to '%s': %s\n", address, snd_strerror(err));
+      return false;
     }
+
+    seq_port[num] = port;
+    return true;
+  }
+
+  /* Output an event, or add it to the pending events if the pool is full
+   * or earlier events are still waiting for room. */
+  void seq_output(snd_seq_event_t &ev)
+  {
+    if(seq_pending_pos >= seq_pending.size())
+    {
+      int err = snd_seq_event_output(seq, &ev);
+      if(err >= 0)
+        return;
+
+      if(err != -EAGAIN)
+      {
+        fprintf(stderr, "ALSA Seq: error queueing event: %s\n", snd_strerror(err));
+        return;
+      }
+    }
+
+    SeqPending p{ ev, seq_pending_ext.size() };
+    if(snd_seq_ev_is_variable(&ev))
+    {
+      const uint8_t *ext = static_cast<const uint8_t *>(ev.data.ext.ptr);
+      seq_pending_ext.insert(seq_pending_ext.end(), ext, ext + ev.data.ext.len);
+    }
+    seq_pending.push_back(p);
+  }
+
+  /* Wait until the output pool has room, at most `timeout_ms`. */
+  bool seq_wait_output(int timeout_ms)
+  {
+    struct pollfd fds[4];
+    int count = snd_seq_poll_descriptors(seq, fds, 4, POLLOUT);
+    if(count <= 0)
+      return false;
+
+    int ret = poll(fds, count, timeout_ms);
+    return ret > 0 || (ret < 0 && errno == EINTR);
+  }
+
+  /**
+   * Move pending events to the sequencer as the output pool frees up.
+   *
+   * @param wait  Wait for room until everything is sent; gives up if the
+   *              pool doesn't drain for SEQ_STALL_MS.
+   * @returns     `true` if events are still pending, otherwise `false`.
+   */
+  bool seq_refill(bool wait)
+  {
+    while(true)
+    {
+      while(seq_pending_pos < seq_pending.size())
+      {
+        SeqPending &p = seq_pending[seq_pending_pos];
+        if(snd_seq_ev_is_variable(&p.ev))
+          p.ev.data.ext.ptr = seq_pending_ext.data() + p.ext_offset;
+
+        int err = snd_seq_event_output(seq, &p.ev);
+        if(err == -EAGAIN)
+          break;
+        if(err < 0)
+          fprintf(stderr, "ALSA Seq: error queueing event: %s\n", snd_strerror(err));
+
+        seq_pending_pos++;
+      }
+      if(seq_pending_pos >= seq_pending.size())
+        seq_discard();
+
+      int err = snd_seq_drain_output(seq);
+      if(err < 0 && err != -EAGAIN)
+      {
+        fprintf(stderr, "ALSA Seq: error sending events: %s\n", snd_strerror(err));
+        seq_discard();
+        return false;
+      }
+
+      bool pending = err != 0 || seq_pending.size();
+      if(!pending || !wait)
+        return pending;
+
+      if(!seq_wait_output(SEQ_STALL_MS))
+      {
+        fprintf(stderr, "ALSA Seq: output stalled, dropping %zu events\n",
+         seq_pending.size() - seq_pending_pos);
+        snd_seq_drop_output(seq);
+        seq_discard();
+        return false;
+      }
+    }
+  }
+
+  void seq_discard()
+  {
+    seq_pending.clear();
+    seq_pending_ext.clear();
+    seq_pending_pos = 0;
+  }
+
+  /* Encode raw MIDI bytes into sequencer events and send them either
+   * directly (time = nullptr) or scheduled on the queue. Direct output
+   * waits for room unless the queue is running; otherwise, events are kept
+   * for midi_queue_refill() if the pool is full. */
+  void seq_write(const uint8_t *data, size_t length, int num,
+   const snd_seq_real_time_t *time)
+  {
+    snd_midi_event_reset_encode(seq_encoder);
+    while(length > 0)
+    {
+      snd_seq_event_t ev;
+      snd_seq_ev_clear(&ev);
+
+      long used = snd_midi_event_encode(seq_encoder, data, length, &ev);
+      if(used <= 0)
+        break;
+
+      data += used;
+      length -= used;
+      if(ev.type == SND_SEQ_EVENT_NONE)
+        continue;
+
+      snd_seq_ev_set_source(&ev, seq_port[num]);
+      snd_seq_ev_set_subs(&ev);
+      if(time)
+        snd_seq_ev_schedule_real(&ev, seq_queue, 0, time);
+      else
+        snd_seq_ev_set_direct(&ev);
+
+      seq_output(ev);
+    }
+    seq_refill(time == nullptr && !queue_running);
+  }
+
+  virtual bool midi_queue_start()
+  {
+    if(!seq || seq_queue < 0)
+      return false;
+
+    int err = snd_seq_start_queue(seq, seq_queue, nullptr);
+    if(!err)
+      err = snd_seq_drain_output(seq);
+    if(err < 0)
+    {
+      fprintf(stderr, "ALSA Seq: error starting queue: %s\n", snd_strerror(err));
+      return false;
+    }
+    queue_running = true;
+    return true;
+  }
+
+  virtual void midi_queue_stop(bool drain)
+  {
+    if(!queue_running)
+      return;
+
+    if(drain)
+    {
+      /* Wait for every queued event to be delivered. */
+      seq_refill(true);
+      snd_seq_sync_output_queue(seq);
+    }
+    else
+    {
+      /* Discard the pending events, the library output buffer, and the
+       * events already in the kernel queue, so nothing more is played. */
+      seq_discard();
+      snd_seq_drop_output(seq);
+
+      snd_seq_remove_events_t *remove;
+      snd_seq_remove_events_alloca(&remove);
+      snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT);
+      snd_seq_remove_events_set_queue(remove, seq_queue);
+      int err = snd_seq_remove_events(seq, remove);
+      if(err < 0)
+        fprintf(stderr, "ALSA Seq: error removing events: %s\n", snd_strerror(err));
+    }
+
+    snd_seq_stop_queue(seq, seq_queue, nullptr);
+    seq_refill(true);
+    queue_running = false;
+  }
+
+  virtual bool midi_queue_refill()
+  {
+    if(!seq)
+      return false;
+
+    return seq_refill(false);
+  }
+
+  virtual void midi_flow_control(unsigned num, unsigned bytes_per_sec,
+   unsigned sysex_delay_ms)
+  {
+    if(num < GlobalConfig::max_inputs)
+      midi_writer[num].set_flow(bytes_per_sec, sysex_delay_ms);
+  }
+
+  virtual void midi_write_at(const uint8_t *data, size_t length, int num,
+   int64_t time_us)
+  {
+    if(!queue_running || num < 0 || (unsigned)num >= GlobalConfig::max_inputs ||
+     seq_port[num] < 0)
+    {
+      midi_write(data, length, num);
+      return;
+    }
+
+    snd_seq_real_time_t time;
+    time.tv_sec = time_us / 1000000;
+    time.tv_nsec = (time_us % 1000000) * 1000;
+    seq_write(data, length, num, &time);
   }
 } soundcard_alsa("ALSA");
 
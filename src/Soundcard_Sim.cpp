@@ -0,0 +1,261 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AudioFormat.hpp"
+#include "Soundcard_Sim.hpp"
+
+#include <math.h>
+#include <algorithm>
+
+bool Soundcard_Sim::load_source(const char *filename)
+{
+  AudioBuffer<int16_t> buffer(2, 48000);
+  if(!AudioFormatSession.load(buffer, filename))
+    return false;
+
+  const int16_t *samples = buffer.get_samples();
+  source.assign(samples, samples + buffer.total_frames() * buffer.channels);
+  source_channels = buffer.channels;
+  source_rate = buffer.rate;
+  return true;
+}
+
+void Soundcard_Sim::deinit()
+{
+  audio_capture_stop();
+  pending.clear();
+  queue_running = false;
+}
+
+bool Soundcard_Sim::init_audio_in(const char *interface)
+{
+  return true;
+}
+
+bool Soundcard_Sim::audio_capture_start(AudioInput &dest)
+{
+  if(source_channels && (source_channels != dest.channels || source_rate != dest.rate))
+  {
+    fprintf(stderr, "simulator: source is %u channels %uHz, capture is %u channels %uHz\n",
+     source_channels, source_rate, dest.channels, dest.rate);
+    return false;
+  }
+
+  target = &dest;
+  in_channels = dest.channels;
+  in_rate = dest.rate;
+  release = expf(-1000.0f / (dest.rate * RELEASE_MS));
+  capture_us = now_us;
+  frames = 0;
+  source_pos = 0;
+  chunk.resize(CHUNK_FRAMES * dest.channels);
+  return true;
+}
+
+bool Soundcard_Sim::audio_capture_stop()
+{
+  target = nullptr;
+  return true;
+}
+
+bool Soundcard_Sim::audio_capture_position(int64_t time_us, uint64_t &frame) const
+{
+  if(!target || time_us < capture_us)
+    return false;
+
+  frame = static_cast<uint64_t>(time_us - capture_us) * in_rate / 1000000;
+  return true;
+}
+
+bool Soundcard_Sim::init_midi_out(const char *interface, unsigned num)
+{
+  return true;
+}
+
+void Soundcard_Sim::midi_write(const uint8_t *data, size_t length, int num)
+{
+  play(data, length);
+}
+
+bool Soundcard_Sim::init_midi_queue(const char *address, unsigned num, bool pcm_clock)
+{
+  return true;
+}
+
+bool Soundcard_Sim::midi_queue_start()
+{
+  queue_us = now_us;
+  queue_running = true;
+  return true;
+}
+
+void Soundcard_Sim::midi_queue_stop(bool drain)
+{
+  if(drain && !pending.empty())
+    advance(pending.back().time_us);
+
+  pending.clear();
+  queue_running = false;
+}
+
+void Soundcard_Sim::midi_write_at(const uint8_t *data, size_t length, int num,
+ int64_t time_us)
+{
+  if(!queue_running)
+  {
+    play(data, length);
+    return;
+  }
+
+  /* Keep the queue sorted; events usually arrive in order. */
+  Pending p{ queue_us + time_us, std::vector<uint8_t>(data, data + length) };
+  auto pos = std::upper_bound(pending.begin(), pending.end(), p,
+   [](const Pending &a, const Pending &b){ return a.time_us < b.time_us; });
+  pending.insert(pos, std::move(p));
+}
+
+void Soundcard_Sim::advance(int64_t time_us)
+{
+  if(time_us <= now_us)
+    return;
+
+  /* Deliver queued MIDI at its exact position in the audio. */
+  size_t i = 0;
+  for(; i < pending.size() && pending[i].time_us <= time_us; i++)
+  {
+    now_us = pending[i].time_us;
+    if(target)
+      render_until(static_cast<uint64_t>(now_us - capture_us) * in_rate / 1000000);
+
+    play(pending[i].data.data(), pending[i].data.size());
+  }
+  pending.erase(pending.begin(), pending.begin() + i);
+
+  now_us = time_us;
+  if(target)
+    render_until(static_cast<uint64_t>(now_us - capture_us) * in_rate / 1000000);
+}
+
+void Soundcard_Sim::render_until(uint64_t end_frame)
+{
+  while(frames < end_frame)
+  {
+    size_t num_frames = std::min<uint64_t>(CHUNK_FRAMES, end_frame - frames);
+    render(num_frames);
+    target->write(chunk.data(), num_frames);
+    frames += num_frames;
+  }
+}
+
+void Soundcard_Sim::render(size_t num_frames)
+{
+  unsigned channels = in_channels;
+  if(source_channels)
+  {
+    size_t available = std::min<size_t>(num_frames,
+     source.size() / channels - source_pos);
+
+    memcpy(chunk.data(), source.data() + source_pos * channels,
+     available * channels * sizeof(int16_t));
+    std::fill(chunk.begin() + available * channels,
+     chunk.begin() + num_frames * channels, 0);
+    source_pos += available;
+    return;
+  }
+
+  std::fill(chunk.begin(), chunk.begin() + num_frames * channels, 0);
+  for(Voice &v : voices)
+  {
+    if(v.level < 1.0f && v.target == 0.0f)
+      continue;
+
+    for(size_t i = 0; i < num_frames; i++)
+    {
+      if(v.target > 0.0f)
+        v.level = v.target;
+      else
+        v.level *= release;
+
+      int sample = chunk[i * channels] + lrintf(v.level * sinf(v.phase));
+      sample = std::max(-32768, std::min(32767, sample));
+      for(unsigned c = 0; c < channels; c++)
+        chunk[i * channels + c] = sample;
+
+      v.phase += v.step;
+      if(v.phase >= 2.0 * M_PI)
+        v.phase -= 2.0 * M_PI;
+    }
+  }
+}
+
+void Soundcard_Sim::play(const uint8_t *data, size_t length)
+{
+  for(size_t i = 0; i < length; i++)
+  {
+    uint8_t b = data[i];
+    if(b & 0x80)
+    {
+      /* Real time messages don't affect running status. */
+      if(b >= 0xf8)
+        continue;
+
+      /* System messages (SysEx etc.) are ignored entirely. */
+      if(b >= 0xf0)
+      {
+        status = 0;
+        while(b == 0xf0 && i + 1 < length && data[i] != 0xf7)
+          i++;
+        continue;
+      }
+      status = b;
+      continue;
+    }
+
+    uint8_t kind = status & 0xf0;
+    if(kind == 0xc0 || kind == 0xd0)
+      continue;
+    if(!status || i + 1 >= length)
+      break;
+
+    /* Running status: two data bytes per message. */
+    uint8_t param = b;
+    uint8_t value = data[++i];
+    if(kind == 0x90 && value)
+    {
+      Voice &v = voices[param];
+      v.step = 2.0 * M_PI * 440.0 * pow(2.0, (param - 69) / 12.0) / (in_rate ? in_rate : 48000);
+      v.target = AMPLITUDE * value / 127.0f;
+      v.phase = 0.0;
+    }
+    else
+
+    if(kind == 0x80 || kind == 0x90)
+      voices[param].target = 0.0f;
+    else
+
+    if(kind == 0xb0 && (param == 120 || param == 123))
+    {
+      for(Voice &v : voices)
+      {
+        v.target = 0.0f;
+        if(param == 120)
+          v.level = 0.0f;
+      }
+    }
+  }
+}
@@ -0,0 +1,111 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOUNDCARD_SIM_HPP
+#define SOUNDCARD_SIM_HPP
+
+#include "AudioBuffer.hpp"
+#include "Soundcard.hpp"
+
+#include <vector>
+
+/**
+ * Soundcard driven by a virtual clock instead of real time, for dry runs
+ * and benchmarks. MIDI written to it plays a simple sine synthesizer (or,
+ * with a source session, the captured audio of that session is replayed
+ * instead), and audio is only generated when the clock is advanced, so a
+ * whole schedule runs as fast as the CPU allows.
+ */
+class Soundcard_Sim final : public Soundcard
+{
+  static constexpr unsigned CHUNK_FRAMES = 256;
+  static constexpr float AMPLITUDE = 8000.0f;
+  static constexpr float RELEASE_MS = 30.0f;
+
+  struct Voice
+  {
+    double phase = 0.0;
+    double step = 0.0;
+    float level = 0.0f;
+    float target = 0.0f;
+  };
+
+  struct Pending
+  {
+    int64_t time_us;
+    std::vector<uint8_t> data;
+  };
+
+  Voice voices[128];
+  std::vector<Pending> pending;
+  std::vector<int16_t> chunk;
+  /* Copied rather than mapped, so the source may be the file being dumped. */
+  std::vector<int16_t> source;
+  unsigned source_channels = 0;
+  unsigned source_rate = 0;
+  size_t source_pos = 0;
+
+  AudioInput *target = nullptr;
+  int64_t now_us = 0;
+  int64_t capture_us = 0;
+  int64_t queue_us = 0;
+  uint64_t frames = 0;
+  float release = 0.0f;
+  uint8_t status = 0;
+
+  void render(size_t num_frames);
+  void render_until(uint64_t end_frame);
+  void play(const uint8_t *data, size_t length);
+
+public:
+  Soundcard_Sim(): Soundcard("simulator", false) {}
+
+  /**
+   * Replay a captured session instead of synthesizing audio.
+   *
+   * @param filename  Session filename.
+   * @returns         `true` on success, otherwise `false`.
+   */
+  bool load_source(const char *filename);
+
+  /* Virtual clock in microseconds; starts at 0. */
+  int64_t clock_us() const
+  {
+    return now_us;
+  }
+
+  /* Move the virtual clock forward, generating audio for the elapsed time. */
+  void advance(int64_t time_us);
+
+  void deinit() override;
+  bool init_audio_in(const char *interface) override;
+  bool audio_capture_start(AudioInput &dest) override;
+  bool audio_capture_stop() override;
+  bool audio_capture_position(int64_t time_us, uint64_t &frame) const override;
+
+  bool init_midi_out(const char *interface, unsigned num) override;
+  void midi_write(const uint8_t *data, size_t length, int num) override;
+
+  bool init_midi_queue(const char *address, unsigned num, bool pcm_clock) override;
+  bool midi_queue_start() override;
+  void midi_queue_stop(bool drain) override;
+  void midi_write_at(const uint8_t *data, size_t length, int num,
+   int64_t time_us) override;
+};
+
+#endif /* SOUNDCARD_SIM_HPP */
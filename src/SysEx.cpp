@@ -0,0 +1,346 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Platform.hpp"
+#include "SysEx.hpp"
+
+/* Roland: F0 41 dev model... cmd [address... data... checksum] F7 */
+void SysExParser::parse_roland(SysExMessage &msg, const uint8_t *body,
+ const uint8_t *body_end) const
+{
+  size_t len = body_end - body;
+  if(len < roland_model_len + 2)
+    return;
+
+  msg.device = body[0];
+  for(unsigned i = 0; i < roland_model_len; i++)
+    msg.model = (msg.model << 8) | body[1 + i];
+
+  body += roland_model_len + 1;
+  msg.command = *(body++);
+  msg.payload = body;
+  msg.payload_length = body_end - body;
+
+  if(msg.command != ROLAND_DT1 && msg.command != ROLAND_RQ1)
+  {
+    msg.valid = true;
+    return;
+  }
+
+  /* Address, data, checksum. */
+  if(msg.payload_length < roland_addr_len + 1)
+    return;
+
+  unsigned sum = 0;
+  for(const uint8_t *p = body; p < body_end; p++)
+    sum += *p;
+
+  for(unsigned i = 0; i < roland_addr_len; i++)
+    msg.address = (msg.address << 8) | body[i];
+
+  msg.payload = body + roland_addr_len;
+  msg.payload_length -= roland_addr_len + 1;
+  msg.valid = !(sum & 0x7f);
+}
+
+/* Yamaha bulk dump: F0 43 0n format count(2) data... checksum F7
+ * Yamaha parameter change: F0 43 1n group param value F7
+ * Yamaha dump request: F0 43 2n format F7 */
+void SysExParser::parse_yamaha(SysExMessage &msg, const uint8_t *body,
+ const uint8_t *body_end) const
+{
+  size_t len = body_end - body;
+  if(len < 2)
+    return;
+
+  msg.command = body[0] & 0x70;
+  msg.device = body[0] & 0x0f;
+  msg.payload = body + 1;
+  msg.payload_length = len - 1;
+
+  switch(msg.command)
+  {
+  case YAMAHA_BULK:
+  {
+    if(len < 5)
+      return;
+
+    size_t count = (body[2] << 7) | body[3];
+    if(len != count + 5)
+      return;
+
+    unsigned sum = 0;
+    for(const uint8_t *p = body + 4; p < body_end; p++)
+      sum += *p;
+
+    msg.model = body[1];
+    msg.payload = body + 4;
+    msg.payload_length = count;
+    msg.valid = !(sum & 0x7f);
+    return;
+  }
+
+  case YAMAHA_PARAM:
+    if(len != 4)
+      return;
+
+    msg.address = (body[1] << 7) | body[2];
+    msg.payload = body + 3;
+    msg.payload_length = 1;
+    msg.valid = true;
+    return;
+
+  case YAMAHA_REQUEST:
+    msg.model = body[1];
+    msg.valid = true;
+    return;
+  }
+  msg.valid = true;
+}
+
+/**
+ * Find the next message in the buffer.
+ *
+ * @param msg   Receives the message.
+ * @returns     `true` if a message was found, or `false` at the end.
+ */
+bool SysExParser::next(SysExMessage &msg)
+{
+  while(pos < end)
+  {
+    const uint8_t *start = pos;
+    uint8_t b = *pos;
+
+    /* Realtime messages can appear anywhere outside of SysEx. */
+    if(b >= 0xf8)
+    {
+      pos++;
+      continue;
+    }
+
+    if(b == 0xf0)
+    {
+      const uint8_t *p = start + 1;
+      while(p < end && *p < 0x80)
+        p++;
+
+      bool terminated = p < end && *p == 0xf7;
+      pos = terminated ? p + 1 : p;
+      running = 0;
+
+      msg = SysExMessage{};
+      msg.data = start;
+      msg.length = pos - start;
+      msg.status = b;
+      if(p - start < 2)
+        return true;
+
+      msg.manufacturer = start[1];
+      msg.payload = start + 2;
+      msg.payload_length = p - msg.payload;
+      if(!terminated)
+        return true;
+
+      if(msg.manufacturer == ROLAND)
+        parse_roland(msg, start + 2, p);
+      else
+
+      if(msg.manufacturer == YAMAHA)
+        parse_yamaha(msg, start + 2, p);
+      else
+        msg.valid = true;
+
+      return true;
+    }
+
+    /* System common messages aren't needed; their data bytes are skipped
+     * as stray bytes. */
+    if(b > 0xf0)
+    {
+      running = 0;
+      pos++;
+      continue;
+    }
+
+    uint8_t status = running;
+    const uint8_t *p = start;
+    if(b >= 0x80)
+    {
+      status = b;
+      running = b;
+      p++;
+    }
+    if(!status)
+    {
+      pos++;
+      continue;
+    }
+
+    size_t count = ((status & 0xe0) == 0xc0) ? 1 : 2;
+    if((size_t)(end - p) < count)
+      break;
+
+    if(p[0] >= 0x80 || (count > 1 && p[1] >= 0x80))
+    {
+      /* Incomplete message; resume at the next status byte. */
+      pos = p;
+      while(pos < end && *pos < 0x80)
+        pos++;
+      continue;
+    }
+
+    pos = p + count;
+    msg = SysExMessage{};
+    msg.data = start;
+    msg.length = pos - start;
+    msg.status = status;
+    msg.payload = p;
+    msg.payload_length = count;
+    msg.valid = true;
+    return true;
+  }
+  pos = end;
+  return false;
+}
+
+
+/**
+ * Index a segment of data.
+ *
+ * @param address   Linear address of the first byte.
+ * @param data      Segment data; not copied.
+ * @param length    Length of the segment.
+ */
+void RolandImage::add(unsigned address, const uint8_t *data, size_t length)
+{
+  if(!length)
+    return;
+
+  /* Dumps are almost always in address order; only sort if they aren't. */
+  if(segments.size() && address < segments.back().address)
+    sorted = false;
+
+  segments.push_back({ address, (unsigned)length, (unsigned)segments.size(), data });
+  max_length = std::max(max_length, (unsigned)length);
+}
+
+/* Find the latest segment containing an address. */
+const RolandImage::Segment *RolandImage::find(unsigned address)
+{
+  if(!sorted)
+  {
+    std::stable_sort(segments.begin(), segments.end(),
+     [](const Segment &a, const Segment &b){ return a.address < b.address; });
+    sorted = true;
+  }
+
+  auto it = std::upper_bound(segments.begin(), segments.end(), address,
+   [](unsigned a, const Segment &s){ return a < s.address; });
+
+  /* Only segments starting within max_length before can contain it. */
+  const Segment *found = nullptr;
+  while(it != segments.begin())
+  {
+    --it;
+    if(address - it->address >= max_length)
+      break;
+
+    if(address - it->address < it->length && (!found || it->order > found->order))
+      found = &(*it);
+  }
+  return found;
+}
+
+/**
+ * Copy a range of the image, which may span several segments.
+ *
+ * @param address   Linear address of the first byte.
+ * @param dest      Destination buffer.
+ * @param length    Number of bytes to read.
+ * @returns         `true` if every byte of the range is present.
+ */
+bool RolandImage::read(unsigned address, uint8_t *dest, size_t length)
+{
+  while(length)
+  {
+    const Segment *seg = find(address);
+    if(!seg)
+      return false;
+
+    /* Stop where a later segment starts to take precedence. */
+    unsigned seg_end = seg->address + seg->length;
+    for(auto it = segments.begin() + (seg - segments.data()) + 1;
+     it != segments.end() && it->address < seg_end; it++)
+    {
+      if(it->order > seg->order)
+      {
+        seg_end = it->address;
+        break;
+      }
+    }
+
+    size_t offset = address - seg->address;
+    size_t n = std::min<size_t>(length, seg_end - address);
+    memcpy(dest, seg->data + offset, n);
+    address += n;
+    dest += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @returns `true` if every byte of a range is present in the image.
+ */
+bool RolandImage::has(unsigned address, size_t length)
+{
+  while(length)
+  {
+    const Segment *seg = find(address);
+    if(!seg)
+      return false;
+
+    size_t n = std::min<size_t>(length, seg->length - (address - seg->address));
+    address += n;
+    length -= n;
+  }
+  return true;
+}
+
+
+/**
+ * Map a dump file into memory. An empty file is valid and has no data.
+ *
+ * @param path  Filename of the dump.
+ * @returns     `true` on success, otherwise `false`.
+ */
+bool SysExFile::open(const char *path)
+{
+  file = Platform::map_file(path, length);
+  if(!file)
+  {
+    length = 0;
+    fprintf(stderr, "couldn't find file '%s', ignoring\n", path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,290 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYSEX_HPP
+#define SYSEX_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "Buffer.hpp"
+
+/**
+ * A message found by SysExParser. All pointers point into the parsed
+ * buffer; nothing is copied.
+ */
+struct SysExMessage
+{
+  const uint8_t *data = nullptr;  /* Status byte through F7 (if any). */
+  size_t length = 0;
+  uint8_t status = 0;             /* F0 or a channel message status. */
+
+  /* SysEx only. */
+  uint8_t manufacturer = 0;
+  uint8_t device = 0;             /* Roland device ID or Yamaha channel. */
+  uint32_t model = 0;             /* Roland model ID or Yamaha format. */
+  uint8_t command = 0;            /* Roland command or Yamaha sub-status. */
+  uint32_t address = 0;           /* Roland address or Yamaha parameter. */
+  const uint8_t *payload = nullptr;
+  size_t payload_length = 0;
+
+  /* Terminated by F7 and the checksum (if any) matches. */
+  bool valid = false;
+};
+
+/**
+ * Splits a MIDI byte stream (e.g. a librarian dump) into messages in one
+ * pass. Roland DT1/RQ1 and Yamaha bulk dump/parameter change messages are
+ * decoded and checksummed; other SysEx messages only provide their payload.
+ * Channel messages are returned as-is (running status is expanded into the
+ * status field). Realtime and stray bytes are skipped.
+ */
+class SysExParser
+{
+  const uint8_t *pos;
+  const uint8_t *end;
+  unsigned roland_model_len;
+  unsigned roland_addr_len;
+  uint8_t running = 0;
+
+  void parse_roland(SysExMessage &msg, const uint8_t *body, const uint8_t *body_end) const;
+  void parse_yamaha(SysExMessage &msg, const uint8_t *body, const uint8_t *body_end) const;
+
+public:
+  static constexpr uint8_t ROLAND = 0x41;
+  static constexpr uint8_t YAMAHA = 0x43;
+
+  static constexpr uint8_t ROLAND_RQ1 = 0x11;
+  static constexpr uint8_t ROLAND_DT1 = 0x12;
+
+  static constexpr uint8_t YAMAHA_BULK = 0x00;
+  static constexpr uint8_t YAMAHA_PARAM = 0x10;
+  static constexpr uint8_t YAMAHA_REQUEST = 0x20;
+
+  /**
+   * @param data              Buffer to parse.
+   * @param size              Size of the buffer.
+   * @param model_len         Length of Roland model IDs for this synth.
+   * @param addr_len          Length of Roland addresses for this synth.
+   */
+  SysExParser(const uint8_t *data, size_t size,
+   unsigned model_len = 1, unsigned addr_len = 3):
+   pos(data), end(data + size),
+   roland_model_len(model_len), roland_addr_len(addr_len) {}
+
+  bool next(SysExMessage &msg);
+};
+
+/**
+ * Fixed message prefix (F0 followed by BYTES), computed at compile time.
+ * For Roland and Yamaha messages the third byte is the device ID or
+ * channel, which SysExFrame ORs in.
+ */
+template<uint8_t... BYTES>
+static constexpr StaticBuffer<sizeof...(BYTES) + 1> sysex_prefix =
+ StaticBuffer<sizeof...(BYTES) + 1>().append(uint8_t(0xf0), BYTES...);
+
+/**
+ * Append values to a buffer as data bytes. The buffer's bounds checking
+ * applies, so too many values fails to compile.
+ */
+template<size_t N, size_t I, class... T>
+static constexpr Buffer<N, uint8_t, I + sizeof...(T)>
+sysex_data(Buffer<N, uint8_t, I> buf, const T &...values)
+{
+  return buf.append(static_cast<uint8_t>(values)...);
+}
+
+/**
+ * SysEx message with a compile-time layout: a precomputed prefix, an
+ * ADDR-byte address, LEN data bytes, a checksum of the address and data
+ * (Roland and Yamaha bulk format), and F7. The message is built on the
+ * stack and appended to the output in one go.
+ */
+template<size_t PREFIX, size_t ADDR, size_t LEN>
+class SysExFrame
+{
+  uint8_t head[PREFIX + ADDR];
+  uint8_t body[LEN];
+
+public:
+  static constexpr size_t size = PREFIX + ADDR + LEN + 2;
+
+  /**
+   * @param prefix    Precomputed message prefix (see sysex_prefix).
+   * @param device    Device ID or channel, ORed into the third byte.
+   * @param address   Address, 7 bits per byte, in Roland byte order
+   *                  (e.g. 0x030400 for 03-04-00h).
+   */
+  constexpr SysExFrame(const StaticBuffer<PREFIX> &prefix, uint8_t device,
+   uint32_t address = 0): head{}, body{}
+  {
+    static_assert(PREFIX >= 3, "prefix must include the device byte");
+    for(size_t i = 0; i < PREFIX; i++)
+      head[i] = prefix.get()[i];
+
+    head[2] |= device;
+    for(size_t i = 0; i < ADDR; i++)
+      head[PREFIX + i] = (address >> (8 * (ADDR - i - 1))) & 0x7f;
+  }
+
+  /* Writer for the data bytes; finish with check(). */
+  constexpr Buffer<LEN> data()
+  {
+    return Buffer<LEN>(body);
+  }
+
+  constexpr const uint8_t (&get() const)[LEN]
+  {
+    return body;
+  }
+
+  /* Set all of the data bytes at once. */
+  template<class... T>
+  constexpr void set(const T &...values)
+  {
+    sysex_data(data(), values...).check();
+  }
+
+  void write(std::vector<uint8_t> &out) const
+  {
+    unsigned sum = 0;
+    for(size_t i = PREFIX; i < PREFIX + ADDR; i++)
+      sum += head[i];
+    for(size_t i = 0; i < LEN; i++)
+      sum += body[i];
+
+    out.insert(out.end(), std::begin(head), std::end(head));
+    out.insert(out.end(), std::begin(body), std::end(body));
+    out.push_back((-sum) & 0x7f);
+    out.push_back(0xf7);
+  }
+};
+
+/**
+ * Create a SysExFrame, deducing the prefix length.
+ */
+template<size_t ADDR, size_t LEN, size_t PREFIX>
+static constexpr SysExFrame<PREFIX, ADDR, LEN>
+sysex_frame(const StaticBuffer<PREFIX> &prefix, uint8_t device,
+ uint32_t address = 0)
+{
+  return SysExFrame<PREFIX, ADDR, LEN>(prefix, device, address);
+}
+
+/**
+ * Append a SysEx message without a checksum (prefix, data bytes, F7).
+ */
+template<size_t PREFIX, class... T>
+static inline void sysex_message(std::vector<uint8_t> &out,
+ const StaticBuffer<PREFIX> &prefix, uint8_t device, const T &...values)
+{
+  uint8_t buf[PREFIX + sizeof...(T) + 1];
+
+  sysex_data(Buffer<sizeof(buf)>(buf).append(prefix.get()), values...)
+   .append(uint8_t(0xf7)).check();
+
+  buf[2] |= device;
+  out.insert(out.end(), std::begin(buf), std::end(buf));
+}
+
+/**
+ * Sparse image of a Roland address space, indexing the data segments of
+ * DT1 messages as they are parsed. Addresses are linear (see linear()).
+ * Segments point into the parsed buffer, which must outlive the image.
+ * Where segments overlap, the one added last takes precedence.
+ */
+class RolandImage
+{
+  struct Segment
+  {
+    unsigned address;
+    unsigned length;
+    unsigned order;
+    const uint8_t *data;
+  };
+
+  std::vector<Segment> segments;
+  unsigned max_length = 0;
+  bool sorted = true;
+
+  const Segment *find(unsigned address);
+
+public:
+  /* Convert a Roland address (7 bits per byte, up to 4 bytes) to linear. */
+  static constexpr unsigned linear(uint32_t raw)
+  {
+    return ((raw >> 3) & (0x7f << 21)) | ((raw >> 2) & (0x7f << 14)) |
+     ((raw >> 1) & (0x7f << 7)) | (raw & 0x7f);
+  }
+
+  void add(unsigned address, const uint8_t *data, size_t length);
+  bool read(unsigned address, uint8_t *dest, size_t length);
+  bool has(unsigned address, size_t length);
+
+  template<size_t N>
+  bool read(unsigned address, uint8_t (&dest)[N])
+  {
+    return read(address, dest, N);
+  }
+
+  bool get(unsigned address, unsigned &value)
+  {
+    uint8_t b;
+    if(!read(address, &b, 1))
+      return false;
+
+    value = b;
+    return true;
+  }
+
+  /* Read a value stored as two nibbles (high first). */
+  bool get_nibbles(unsigned address, unsigned &value)
+  {
+    uint8_t b[2];
+    if(!read(address, b))
+      return false;
+
+    value = ((b[0] & 0x0f) << 4) | (b[1] & 0x0f);
+    return true;
+  }
+
+  size_t size() const
+  {
+    return segments.size();
+  }
+};
+
+/**
+ * A read-only memory mapped dump file for SysExParser.
+ */
+class SysExFile
+{
+  std::shared_ptr<const void> file;
+  size_t length = 0;
+
+public:
+  bool open(const char *path);
+  const uint8_t *data() const { return static_cast<const uint8_t *>(file.get()); }
+  size_t size() const { return length; }
+};
+
+#endif /* SYSEX_HPP */
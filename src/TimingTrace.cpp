@@ -0,0 +1,126 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "TimingTrace.hpp"
+
+#include <inttypes.h>
+#include <algorithm>
+
+static void print_stats(FILE *out, const char *name, std::vector<int64_t> &values)
+{
+  std::sort(values.begin(), values.end());
+  size_t n = values.size();
+  int64_t total = 0;
+  for(int64_t v : values)
+    total += v;
+
+  fprintf(out, "  %-10s min %9.3fms  mean %9.3fms  p50 %9.3fms  p99 %9.3fms  max %9.3fms\n",
+   name, values[0] / 1000.0, total / 1000.0 / n, values[n / 2] / 1000.0,
+   values[std::min(n - 1, n * 99 / 100)] / 1000.0, values[n - 1] / 1000.0);
+}
+
+void TimingTrace::complete(uint64_t id, int64_t done_us)
+{
+  /* Ids are assigned in order, so the ranges are sorted. */
+  auto it = std::lower_bound(writes.begin(), writes.end(), id,
+   [](const Writes &w, uint64_t id){ return w.last < id; });
+  if(it == writes.end() || it->first > id)
+    return;
+
+  Sample &s = samples[it->sample];
+  s.done_us = it->done ? std::max(s.done_us, done_us) : done_us;
+  it->done = true;
+}
+
+void TimingTrace::summary(FILE *out) const
+{
+  static constexpr int64_t buckets[] =
+  {
+    100, 250, 500, 1000, 2000, 5000, 10000, 20000, 50000, INT64_MAX
+  };
+  static constexpr size_t num_buckets = sizeof(buckets) / sizeof(buckets[0]);
+  size_t counts[num_buckets]{};
+  size_t early = 0;
+
+  if(samples.empty())
+    return;
+
+  std::vector<int64_t> late(samples.size());
+  std::vector<int64_t> run(samples.size());
+  std::vector<int64_t> drift;
+
+  for(size_t i = 0; i < samples.size(); i++)
+  {
+    const Sample &s = samples[i];
+    late[i] = s.wake_us - s.planned_us;
+    run[i] = s.done_us - s.wake_us;
+
+    if(late[i] < 0)
+      early++;
+    else
+      counts[std::upper_bound(buckets, buckets + num_buckets, late[i]) - buckets]++;
+
+    /* Captured frames vs. frames expected at the wakeup time. */
+    if(rate)
+    {
+      int64_t expected = start_frame + (s.wake_us - start_us) * rate / 1000000;
+      drift.push_back((static_cast<int64_t>(s.frame) - expected) * 1000000 / rate);
+    }
+  }
+
+  fprintf(out, "\nevent timing (%zu events):\n", samples.size());
+  print_stats(out, "late", late);
+  print_stats(out, "run", run);
+  if(!drift.empty())
+    print_stats(out, "capture", drift);
+
+  fprintf(out, "\nlateness:\n");
+  if(early)
+    fprintf(out, "  %11s %8zu\n", "early", early);
+
+  for(size_t i = 0; i < num_buckets; i++)
+  {
+    if(buckets[i] == INT64_MAX)
+      fprintf(out, "  >=%7.2fms %8zu\n", buckets[i - 1] / 1000.0, counts[i]);
+    else
+      fprintf(out, "  < %7.2fms %8zu\n", buckets[i] / 1000.0, counts[i]);
+  }
+}
+
+bool TimingTrace::save_csv(const char *filename) const
+{
+  FILE *fp = fopen(filename, "w");
+  if(!fp)
+    return false;
+
+  fprintf(fp, "event,planned_us,wake_us,done_us,late_us,run_us,frame,bytes\n");
+  for(size_t i = 0; i < samples.size(); i++)
+  {
+    const Sample &s = samples[i];
+    fprintf(fp, "%zu,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRIu64 ",%" PRIu32 "\n",
+     i, s.planned_us - start_us, s.wake_us - start_us, s.done_us - start_us,
+     s.wake_us - s.planned_us, s.done_us - s.wake_us, s.frame, s.bytes);
+  }
+
+  if(fclose(fp))
+  {
+    fprintf(stderr, "error writing file '%s'\n", filename);
+    return false;
+  }
+  return true;
+}
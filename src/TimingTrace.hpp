@@ -0,0 +1,113 @@
+/* ITI Recorder
+ *
+ * Copyright (C) 2023 Alice Rowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMINGTRACE_HPP
+#define TIMINGTRACE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Records when each timeline event actually ran compared to its deadline,
+ * to measure scheduling jitter and how long MIDI output takes. Times are
+ * Platform::clock_us() values; frames are the number of frames captured
+ * when the event woke up.
+ *
+ * An event's done time is when its task returned, unless its MIDI output
+ * was written in the background; then, once the writer reports it with
+ * complete(), it is when the device accepted the last of that output.
+ */
+class TimingTrace
+{
+public:
+  struct Sample
+  {
+    int64_t planned_us;
+    int64_t wake_us;
+    int64_t done_us;
+    uint64_t frame;
+    uint32_t bytes;
+  };
+
+private:
+  /* Range of background write ids of a sample. */
+  struct Writes
+  {
+    uint64_t first;
+    uint64_t last;
+    size_t sample;
+    bool done;
+  };
+
+  std::vector<Sample> samples;
+  std::vector<Writes> writes;
+  int64_t start_us = 0;
+  uint64_t start_frame = 0;
+  unsigned rate = 0;
+
+public:
+  /**
+   * Start a trace.
+   *
+   * @param events      Expected number of events.
+   * @param _start_us   Time of the start of the timeline.
+   * @param _frame      Capture frame at the start of the timeline.
+   * @param _rate       Capture sample rate (0 if not capturing).
+   */
+  void start(size_t events, int64_t _start_us, uint64_t _frame, unsigned _rate)
+  {
+    samples.reserve(events);
+    start_us = _start_us;
+    start_frame = _frame;
+    rate = _rate;
+  }
+
+  /**
+   * Add a sample.
+   *
+   * @param first_write   First background write id of the event, or 0.
+   * @param last_write    Last background write id of the event, or 0.
+   */
+  void add(int64_t planned_us, int64_t wake_us, int64_t done_us,
+   uint64_t frame, uint32_t bytes, uint64_t first_write = 0, uint64_t last_write = 0)
+  {
+    if(first_write)
+      writes.push_back({ first_write, last_write, samples.size(), false });
+
+    samples.push_back({ planned_us, wake_us, done_us, frame, bytes });
+  }
+
+  /**
+   * Set the done times of events from the completion times of their
+   * background writes; an event is done once all of its writes are.
+   *
+   * @param id        Write id.
+   * @param done_us   Time the write was accepted by the device.
+   */
+  void complete(uint64_t id, int64_t done_us);
+
+  /* Print lateness and run time statistics and a lateness histogram. */
+  void summary(FILE *out) const;
+
+  /* Write every sample as CSV. */
+  bool save_csv(const char *filename) const;
+};
+
+#endif /* TIMINGTRACE_HPP */
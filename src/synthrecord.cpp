@@ -17,27 +17,142 @@
  */
 
 #include "AudioBuffer.hpp"
+#include "AudioDump.hpp"
 #include "AudioFormat.hpp"
 #include "Event.hpp"
 #include "Config.hpp"
+#include "Journal.hpp"
+#include "Log.hpp"
 #include "Midi.hpp"
 #include "Platform.hpp"
+#include "ReleaseDetector.hpp"
 #include "Soundcard.hpp"
+#include "Soundcard_Sim.hpp"
+#include "TimingTrace.hpp"
 
+#include <ctype.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
 #include <typeinfo>
 
 #define OUTPUT_DIR "output"
+#define JOURNAL_FILE OUTPUT_DIR "/capture.journal"
 
-static size_t schedule_events(EventSchedule &ev,
+static volatile sig_atomic_t abort_signal = 0;
+
+static void abort_handler(int sig)
+{
+  abort_signal = sig;
+}
+
+/**
+ * Get the notes to record. With a NoteStep > 1 only every Nth note is
+ * played, centered so the keymap can cover the gaps by transposing each
+ * sample by up to (N - 1) / 2 half steps. NoteStep=0 derives N from the
+ * ITI MaxHalfSteps.
+ */
+static std::vector<unsigned> playback_notes(ConfigContext &ctx,
+ const std::shared_ptr<PlaybackConfig> &play)
+{
+  std::vector<unsigned> notes;
+  unsigned step = play->NoteStep;
+  if(step == 0)
+  {
+    const auto iti = ctx.get_interface_as<ITIConfig>("ITI");
+    step = iti ? iti->MaxHalfSteps * 2 + 1 : 1;
+  }
+
+  if(play->MaxNote < play->MinNote)
+    return notes;
+
+  unsigned reach = (step - 1) / 2;
+  unsigned note = std::min<unsigned>(play->MinNote + reach, play->MaxNote);
+  for(; note <= play->MaxNote; note += step)
+    notes.push_back(note);
+
+  /* Make sure the top of the range is still in reach. */
+  if(notes.back() + reach < play->MaxNote)
+    notes.push_back(play->MaxNote);
+
+  return notes;
+}
+
+/**
+ * Get the velocity layers to record: the comma or space separated list in
+ * Velocities, or OnVelocity if it's empty.
+ */
+static bool playback_velocities(const std::shared_ptr<PlaybackConfig> &play,
+ std::vector<unsigned> &velocities)
+{
+  const char *pos = play->Velocities;
+  while(*pos)
+  {
+    char *end;
+    if(*pos == ',' || isspace((unsigned char)*pos))
+    {
+      pos++;
+      continue;
+    }
+
+    unsigned long v = strtoul(pos, &end, 10);
+    if(end == pos || v < 1 || v > 127)
+    {
+      fprintf(stderr, "invalid velocity list: %s\n", play->Velocities.value());
+      return false;
+    }
+    velocities.push_back(v);
+    pos = end;
+  }
+
+  if(velocities.empty())
+    velocities.push_back(play->OnVelocity);
+
+  std::sort(velocities.begin(), velocities.end());
+  velocities.erase(std::unique(velocities.begin(), velocities.end()), velocities.end());
+  return true;
+}
+
+static int64_t schedule_events(EventSchedule &ev,
  const std::shared_ptr<GlobalConfig> &cfg,
  const std::shared_ptr<PlaybackConfig> &play,
+ const std::vector<unsigned> &notes, const std::vector<unsigned> &velocities,
  const std::vector<const MIDIInterface *> &midi_interfaces,
- AudioBuffer<int16_t> &buffer)
+ AudioBuffer<int16_t> &buffer, ReleaseDetector<int16_t> *release,
+ const std::set<int> &captured, Journal *journal, bool noise,
+ unsigned synth = 0)
 {
   bool add_cues = cfg->output_on;
   unsigned cues = 0;
-  size_t time_ms = 0;
+  int64_t time_us = 0;
+
+  /* Each synth's MIDI is sent ahead by its latency (Latency_us), so all of
+   * them sound, and the cues are placed, lead_us after the nominal time.
+   * The off cue is placed a little before the next note so its onset can't
+   * leak into the sample; once the latency is known, this only has to
+   * cover the jitter. */
+  int64_t lead_us = 0;
+  int64_t jitter_us = 0;
+  for(const MIDIInterface *mi : midi_interfaces)
+  {
+    const InputConfig *ic = mi->get_input_config();
+    if(ic)
+    {
+      lead_us = std::max<int64_t>(lead_us, ic->latency_us);
+      jitter_us = std::max<int64_t>(jitter_us, ic->latency_jitter_us);
+    }
+  }
+  int64_t gap_us = lead_us ? jitter_us + 1000 : 10000;
+
+  auto midi_time = [lead_us](const MIDIInterface *mi, int64_t t)
+  {
+    const InputConfig *ic = mi->get_input_config();
+    return t + lead_us - (ic ? ic->latency_us : 0);
+  };
 
   if(cfg->program_on)
   {
@@ -47,54 +162,87 @@ static size_t schedule_events(EventSchedule &ev,
   else
     fprintf(stderr, "not programming interface(s)\n");
 
-  if(cfg->output_noise_removal)
+  if(noise && cfg->output_noise_removal)
   {
-    AudioCueEvent::schedule(ev, buffer, AudioCue::NoiseStart, time_ms);
-    time_ms += cfg->output_noise_ms;
-    AudioCueEvent::schedule(ev, buffer, AudioCue::NoiseEnd, time_ms - 1);
+    AudioCueEvent::schedule(ev, buffer, AudioCue::NoiseStart, time_us);
+    time_us += cfg->output_noise_ms * 1000LL;
+    AudioCueEvent::schedule(ev, buffer, AudioCue::NoiseEnd, time_us - 1000);
   }
 
   if(play->PlaybackOn)
   {
+    /* Two cues and three short MIDI messages per interface per note. */
+    unsigned takes = play->RoundRobin;
+    size_t num_notes = notes.size() * velocities.size() * takes;
+    size_t num_interfaces = midi_interfaces.size();
+    ev.reserve(num_notes * (2 + 3 * num_interfaces), num_notes * 9 * num_interfaces);
+
+    /* Layers and takes of a note are played back to back; cues only carry
+     * them when there's more than one. */
+    bool layered = velocities.size() > 1 || takes > 1;
+
     std::vector<uint8_t> out;
-    for(unsigned i = play->MinNote; i <= play->MaxNote; i++)
+    for(unsigned note : notes)
+    for(unsigned velocity : velocities)
+    for(unsigned take = 1; take <= takes; take++)
     {
+      int value = AudioCue::note_value(note, layered ? velocity : 0,
+       takes > 1 ? take : 0);
+
+      /* Already captured by a previous (resumed) run. */
+      if(captured.count(value))
+        continue;
+
       /* On cue */
       if(add_cues)
       {
-        AudioCueEvent::schedule(ev, buffer, AudioCue::NoteOn, i, time_ms);
+        AudioCueEvent::schedule(ev, buffer, AudioCue::NoteOn,
+         AudioCue::synth_value(value, synth), time_us + lead_us);
         cues++;
       }
 
       for(const MIDIInterface *mi : midi_interfaces)
       {
         out.resize(0);
-        mi->note_on(out, i, play->OnVelocity);
-        MIDIEvent::schedule(ev, *mi, out, time_ms);
+        mi->note_on(out, note, velocity);
+        MIDIEvent::schedule(ev, *mi, out, midi_time(mi, time_us));
       }
-      time_ms += play->On_ms;
+      time_us += play->On_ms * 1000LL;
 
       for(const MIDIInterface *mi : midi_interfaces)
       {
         out.resize(0);
-        mi->note_off(out, i, play->OffVelocity);
-        MIDIEvent::schedule(ev, *mi, out, time_ms);
+        mi->note_off(out, note, play->OffVelocity);
+        MIDIEvent::schedule(ev, *mi, out, midi_time(mi, time_us));
+      }
+
+      /* Adaptive release: the rest of the timeline can be moved up to the
+       * off cue as soon as the release has decayed. */
+      if(release)
+      {
+        int64_t resume_us = time_us + lead_us +
+         (play->Off_ms + play->Quiet_ms) * 1000LL - gap_us;
+        ReleaseEvent::schedule(ev, *release, time_us + lead_us, resume_us);
       }
-      time_ms += play->Off_ms;
+      time_us += play->Off_ms * 1000LL;
 
       for(const MIDIInterface *mi : midi_interfaces)
       {
         out.resize(0);
         mi->all_off(out);
-        MIDIEvent::schedule(ev, *mi, out, time_ms);
+        MIDIEvent::schedule(ev, *mi, out, midi_time(mi, time_us));
       }
-      time_ms += play->Quiet_ms;
+      time_us += play->Quiet_ms * 1000LL;
 
       /* Off cue */
       if(add_cues)
       {
-        AudioCueEvent::schedule(ev, buffer, AudioCue::NoteOff, i, time_ms - 10);
+        AudioCueEvent::schedule(ev, buffer, AudioCue::NoteOff,
+         AudioCue::synth_value(value, synth), time_us + lead_us - gap_us);
         cues++;
+
+        if(journal)
+          JournalEvent::schedule(ev, *journal, time_us + lead_us - gap_us);
       }
     }
     buffer.reserve_cues(cues);
@@ -102,7 +250,164 @@ static size_t schedule_events(EventSchedule &ev,
   else
     fprintf(stderr, "not performing playback\n");
 
-  return time_ms;
+  return time_us + lead_us;
+}
+
+/**
+ * Schedule a latency calibration run: a few test notes are played on each
+ * synth in turn, each one marked by a note-on cue (whose value is the index
+ * of the interface) placed when its note-on is sent.
+ */
+static int64_t schedule_calibration(EventSchedule &ev,
+ const std::shared_ptr<GlobalConfig> &cfg,
+ const std::shared_ptr<PlaybackConfig> &play, const std::vector<unsigned> &notes,
+ const std::vector<const MIDIInterface *> &midi_interfaces,
+ AudioBuffer<int16_t> &buffer)
+{
+  static constexpr unsigned CALIBRATE_NOTES = 8;
+  static constexpr int64_t CALIBRATE_ON_US = 250000;
+  static constexpr int64_t CALIBRATE_START_US = 500000;
+  unsigned note = notes.size() ? notes[notes.size() / 2] : 60;
+  int64_t time_us = CALIBRATE_START_US;
+
+  if(cfg->program_on)
+  {
+    for(const MIDIInterface *mi : midi_interfaces)
+      mi->program(ev);
+  }
+
+  std::vector<uint8_t> out;
+  for(size_t i = 0; i < midi_interfaces.size(); i++)
+  {
+    const MIDIInterface *mi = midi_interfaces[i];
+    for(unsigned n = 0; n < CALIBRATE_NOTES; n++)
+    {
+      AudioCueEvent::schedule(ev, buffer, AudioCue::NoteOn, i, time_us);
+
+      out.resize(0);
+      mi->note_on(out, note, play->OnVelocity);
+      MIDIEvent::schedule(ev, *mi, out, time_us);
+      time_us += CALIBRATE_ON_US;
+
+      out.resize(0);
+      mi->note_off(out, note, play->OffVelocity);
+      MIDIEvent::schedule(ev, *mi, out, time_us);
+      time_us += play->Off_ms * 1000LL;
+
+      out.resize(0);
+      mi->all_off(out);
+      MIDIEvent::schedule(ev, *mi, out, time_us);
+      time_us += play->Quiet_ms * 1000LL;
+
+      AudioCueEvent::schedule(ev, buffer, AudioCue::NoteOff, i, time_us - 10000);
+    }
+  }
+  buffer.reserve_cues(2 * CALIBRATE_NOTES * midi_interfaces.size());
+  return time_us;
+}
+
+/**
+ * Measure the MIDI to audio latency of each synth from a calibration run.
+ * The onset of each test note is found the same way samples are trimmed
+ * (OutputNoiseThreshold) and compared to the frame its note-on was sent.
+ * The results are printed as configuration for each synth's MIDI device.
+ */
+static bool report_calibration(AudioBuffer<int16_t> &buffer,
+ const std::vector<const MIDIInterface *> &midi_interfaces, unsigned threshold)
+{
+  std::vector<AudioCue> sent = buffer.get_cues();
+  buffer.shrink_cues(threshold);
+  const std::vector<AudioCue> &found = buffer.get_cues();
+  bool ok = true;
+
+  fprintf(stderr, "\n");
+  for(size_t i = 0; i < midi_interfaces.size(); i++)
+  {
+    const MIDIInterface *mi = midi_interfaces[i];
+    const InputConfig *ic = mi->get_input_config();
+    std::vector<int64_t> latency;
+    unsigned total = 0;
+
+    for(size_t j = 0; j + 1 < sent.size(); j++)
+    {
+      if(sent[j].type != AudioCue::NoteOn || sent[j].value != (int)i)
+        continue;
+
+      /* No onset before the off cue: the note wasn't heard. */
+      total++;
+      if(found[j].frame >= sent[j + 1].frame)
+        continue;
+
+      latency.push_back(static_cast<int64_t>(found[j].frame - sent[j].frame) *
+       1000000 / buffer.rate);
+    }
+
+    if(latency.empty())
+    {
+      fprintf(stderr, "%s: no onsets found; check the patch and OutputNoiseThreshold\n",
+       mi->tag);
+      ok = false;
+      continue;
+    }
+
+    int64_t sum = 0;
+    for(int64_t l : latency)
+      sum += l;
+
+    int64_t mean = sum / static_cast<int64_t>(latency.size());
+    int64_t jitter = 0;
+    for(int64_t l : latency)
+      jitter = std::max(jitter, std::abs(l - mean));
+
+    fprintf(stderr, "%s: latency %.2fms, jitter %.2fms (%zu of %u notes)\n",
+     mi->tag, mean / 1000.0, jitter / 1000.0, latency.size(), total);
+
+    if(ic)
+    {
+      fprintf(stderr, "[%s:%d]\nLatency_us=%" PRId64 "\nLatencyJitter_us=%" PRId64 "\n\n",
+       ic->tag, ic->id, mean, jitter);
+    }
+  }
+  return ok;
+}
+
+/**
+ * Get the capture channels needed to record synths in parallel, each one
+ * on its own input channel pair (AudioPair). Either every synth or none
+ * must have a pair.
+ *
+ * @returns the number of capture channels, 0 if the synths aren't recorded
+ *          in parallel, or -1 if the configuration is invalid.
+ */
+static int parallel_channels(const std::vector<const MIDIInterface *> &midi_interfaces)
+{
+  std::set<unsigned> pairs;
+  unsigned max_pair = 0;
+
+  for(const MIDIInterface *mi : midi_interfaces)
+  {
+    const InputConfig *ic = mi->get_input_config();
+    unsigned pair = ic ? ic->audio_pair.value() : 0;
+    if(!pair)
+      continue;
+
+    if(!pairs.insert(pair).second)
+    {
+      fprintf(stderr, "AudioPair=%u is used by more than one synth\n", pair);
+      return -1;
+    }
+    max_pair = std::max(max_pair, pair);
+  }
+
+  if(pairs.empty())
+    return 0;
+
+  if(pairs.size() != midi_interfaces.size())
+  {
+    fprintf(stderr, "AudioPair must be set for every synth or none\n");
+    return -1;
+  }
+  return max_pair * 2;
 }
 
 static bool try_init(Soundcard &card,
@@ -125,12 +430,26 @@ static bool try_init(Soundcard &card,
     for(const MIDIInterface *mi : midi_interfaces)
     {
       const InputConfig *ic = mi->get_input_config();
+      if(ic && cfg->midi_queue != GlobalConfig::MIDI_QUEUE_OFF)
+      {
+        bool pcm_clock = cfg->midi_queue == GlobalConfig::MIDI_QUEUE_PCM;
+        if(!ic->seq_device[0] ||
+         !card.init_midi_queue(ic->seq_device, mi->device, pcm_clock))
+        {
+          fprintf(stderr, "couldn't initialize '%s': MIDI queue (SeqDevice)\n",
+           card.name);
+          card.deinit();
+          return false;
+        }
+      }
+
       if(!ic || !card.init_midi_out(ic->midi_device, mi->device))
       {
         fprintf(stderr, "couldn't initialize '%s': MIDI out\n", card.name);
         card.deinit();
         return false;
       }
+      card.midi_flow_control(mi->device, ic->byte_rate, ic->sysex_delay_ms);
     }
   }
   card.select();
@@ -170,158 +489,1266 @@ static Soundcard &initialize_soundcard(
   return card;
 }
 
-
-int main(int argc, char **argv)
+/**
+ * Request the current patch from each synth and load it in place of any
+ * SysExPath dump. Only the MIDI devices are opened; the card is closed again
+ * afterward so it can be initialized for the capture.
+ */
+static bool fetch_patches(const std::shared_ptr<GlobalConfig> &cfg,
+ const std::vector<MIDIInterface *> &midi_interfaces)
 {
-  ConfigContext ctx{};
+  static constexpr unsigned FETCH_TIMEOUT_MS = 1000;
 
-  if(!ctx.init(argc, argv))
-    return 1;
+  for(Soundcard &card : Soundcard::list())
+  {
+    if(strcasecmp("default", cfg->audio_driver) && strcmp(cfg->audio_driver, card.name))
+      continue;
 
-  const auto cfg = ctx.get_interface_as<GlobalConfig>("global");
-  const auto play = ctx.get_interface_as<PlaybackConfig>("Playback");
+    bool has_midi = true;
+    for(const MIDIInterface *mi : midi_interfaces)
+    {
+      const InputConfig *ic = mi->get_input_config();
+      if(!ic || !card.init_midi_out(ic->midi_device, mi->device) ||
+         !card.init_midi_in(ic->midi_device, mi->device))
+      {
+        fprintf(stderr, "couldn't initialize '%s': MIDI in/out\n", card.name);
+        has_midi = false;
+        break;
+      }
+      card.midi_flow_control(mi->device, ic->byte_rate, ic->sysex_delay_ms);
+    }
+    if(!has_midi)
+    {
+      card.deinit();
+      continue;
+    }
 
-  if(cfg == nullptr || play == nullptr)
-    return 1;
+    bool ok = true;
+    for(MIDIInterface *mi : midi_interfaces)
+    {
+      fprintf(stderr, "fetching patch from '%s'\n", mi->tag);
+      if(!mi->fetch(card, FETCH_TIMEOUT_MS))
+      {
+        fprintf(stderr, "failed to fetch patch from '%s'\n", mi->tag);
+        ok = false;
+        break;
+      }
+    }
+    card.deinit();
+    return ok;
+  }
 
-  std::vector<const MIDIInterface *> midi_interfaces;
+  fprintf(stderr, "failed to initialize any device.\n");
+  return false;
+}
 
-  /* Get all MIDI synths. */
-  for(auto &p : ctx.get_interfaces())
+static void all_notes_off(Soundcard &card,
+ const std::vector<const MIDIInterface *> &midi_interfaces)
+{
+  std::vector<uint8_t> out;
+  for(const MIDIInterface *mi : midi_interfaces)
   {
-    /* pointer - failure returns nullptr */
-    MIDIInterface *mi = dynamic_cast<MIDIInterface *>(p.get());
-    if(mi)
+    out.resize(0);
+    mi->all_off(out);
+    card.midi_write(out.data(), out.size(), mi->device);
+  }
+}
+
+/**
+ * Load the journal of a previous capture and the sessions it refers to.
+ * Notes that didn't make it into their session are dropped so they will
+ * be recorded again.
+ */
+static bool resume_journal(Journal &journal,
+ std::vector<std::unique_ptr<AudioBuffer<int16_t>>> &sessions,
+ std::set<int> &captured, unsigned rate)
+{
+  if(!journal.load(JOURNAL_FILE))
+    return false;
+
+  const std::vector<Journal::Run> &runs = journal.get_runs();
+  for(size_t i = 0; i < runs.size(); i++)
+  {
+    std::unique_ptr<AudioBuffer<int16_t>> buffer(new AudioBuffer<int16_t>(2, rate));
+    if(!AudioFormatSession.load(*buffer, runs[i].session.c_str()))
     {
-      /* Load external SysEx if applicable. */
-      mi->load();
+      journal.truncate(i, 0);
+      sessions.push_back(nullptr);
+      continue;
+    }
 
-      midi_interfaces.push_back(mi);
+    if(buffer->rate != rate)
+    {
+      fprintf(stderr, "session '%s' is %uHz, but AudioRate is %uHz\n",
+       runs[i].session.c_str(), buffer->rate, rate);
+      return false;
     }
-  }
-  if(midi_interfaces.size() < 1)
-  {
-    fprintf(stderr, "nothing to do\n");
-    return 0;
+    journal.truncate(i, buffer->total_frames());
+
+    for(const Journal::Region &r : runs[i].regions)
+      captured.insert(r.value);
+
+    sessions.push_back(std::move(buffer));
   }
 
-  /* Schedule MIDI events and user program prompts. */
-  EventSchedule ev;
-  AudioBuffer<int16_t> buffer(2, cfg->audio_rate);
+  fprintf(stderr, "resuming: %zu note(s) already captured in %zu run(s)\n",
+   captured.size(), runs.size());
+  return true;
+}
 
-  size_t time_ms = schedule_events(ev, cfg, play, midi_interfaces, buffer);
-  uint64_t buffer_frames =
-   cast_multiply<uint64_t>(cfg->audio_rate, ev.total_duration() + 30000) / 1000;
+/**
+ * Combine the journaled note regions of every run into one buffer, in the
+ * order a single uninterrupted run would have recorded them. A note that
+ * was recorded more than once uses the latest run.
+ *
+ * @param journal   Journal of all runs.
+ * @param sources   Captured audio of each run (nullptr if unavailable).
+ * @param merged    Destination buffer.
+ * @returns         `true` on success, otherwise `false`.
+ */
+static bool merge_journal(const Journal &journal,
+ const std::vector<const AudioBuffer<int16_t> *> &sources,
+ AudioBuffer<int16_t> &merged)
+{
+  struct Source
+  {
+    const AudioBuffer<int16_t> *buffer;
+    Journal::Region region;
+  };
+  std::map<unsigned, Source> regions;
+  size_t frames = 0;
 
-  if(buffer_frames * buffer.frame_size() > SIZE_MAX)
+  const std::vector<Journal::Run> &runs = journal.get_runs();
+  for(size_t i = 0; i < runs.size() && i < sources.size(); i++)
   {
-    fprintf(stderr, "can't fit sample buffer of %" PRIu64 "u frames in RAM!\n",
-     buffer_frames);
-    return 0;
+    const AudioBuffer<int16_t> *buffer = sources[i];
+    if(!buffer)
+      continue;
+
+    if(buffer->channels != merged.channels)
+    {
+      fprintf(stderr, "session '%s' has %u channels, expected %u\n",
+       runs[i].session.c_str(), buffer->channels, merged.channels);
+      return false;
+    }
+
+    for(const Journal::Region &r : runs[i].regions)
+    {
+      /* Note, then velocity layer, then take. */
+      unsigned key = (AudioCue::note_of(r.value) << 16) |
+       (AudioCue::velocity_of(r.value) << 8) | AudioCue::take_of(r.value);
+
+      if(r.end <= buffer->total_frames())
+        regions[key] = { buffer, r };
+    }
   }
 
-  /* Confirm MIDI devices and manual synthesizer configuration. */
-  fprintf(stderr, "Start note:   %s\n", MIDIInterface::get_note(play->MinNote));
-  fprintf(stderr, "End note:     %s\n", MIDIInterface::get_note(play->MaxNote));
-  fprintf(stderr, "Duration:     %.2fs\n", time_ms / 1000.0);
-  fprintf(stderr, "Buffer frames:%zu\n", buffer_frames);
-  fprintf(stderr, "\n");
+  for(auto &p : regions)
+    frames += p.second.region.end - p.second.region.start;
 
-  for(unsigned i = 0; i < midi_interfaces.size(); i++)
+  merged.resize(frames);
+  merged.reserve_cues(regions.size() * 2);
+  for(auto &p : regions)
   {
-    const MIDIInterface *mi = midi_interfaces[i];
-    const InputConfig *ic = mi->get_input_config();
-    const char *device = ic ? ic->midi_device : "?";
-    unsigned channel = ic ? ic->midi_channel : 0;
+    const Source &src = p.second;
+    const int16_t *samples = src.buffer->get_samples() + src.region.start * merged.channels;
 
-    fprintf(stderr, "Interface %2u: '%s' on port '%s' channel %u\n",
-     i, mi->tag, device, channel);
+    merged.cue(AudioCue::NoteOn, src.region.value);
+    merged.write(samples, src.region.end - src.region.start);
+    merged.cue(AudioCue::NoteOff, src.region.value);
   }
-  fprintf(stderr, "\n");
 
-  // FIXME: these should print literally anything about their interface
-  while(ev.has_next())
+  fprintf(stderr, "merged %zu note(s) from %zu run(s)\n", regions.size(), runs.size());
+  return true;
+}
+
+/**
+ * Post-capture pipeline: trim the recorded notes and write all enabled
+ * output formats to `dir`. Used both after a capture and to reprocess a
+ * session. With `timing`, the time spent in each stage is reported afterward.
+ */
+static void process_output(ConfigContext &ctx,
+ const std::shared_ptr<GlobalConfig> &cfg, AudioBuffer<int16_t> &buffer,
+ const char *dir, bool timing = false)
+{
+  char path[512];
+  auto output = [&](const char *filename)
   {
-    if(ev.next_time() != EventSchedule::NOTICE_TIME)
-      break;
+    snprintf(path, sizeof(path), "%s/%s", dir, filename);
+    return path;
+  };
+
+  std::vector<std::pair<const char *, int64_t>> stages;
+  int64_t stage_us = Platform::clock_us();
+  auto stage = [&](const char *name)
+  {
+    int64_t now_us = Platform::clock_us();
+    stages.emplace_back(name, now_us - stage_us);
+    stage_us = now_us;
+  };
 
-    std::shared_ptr<Event> notice = ev.pop();
-    notice->task();
+  /* Output audio (debug, no processing) */
+  if(cfg->output_debug)
+  {
+    AudioFormatRaw.save(ctx, buffer, output("pre.raw"));
+    stage("pre.raw");
   }
-  fprintf(stderr, "Press 'enter' to continue.\n");
-  Platform::wait_input();
 
-  /* Preallocate recording buffer. */
-  if(cfg->output_on)
-    buffer.resize(buffer_frames);
+  // FIXME: remove redundant channels
 
-  /* Initialize sound device. */
-  Soundcard &card = initialize_soundcard(cfg, play, midi_interfaces);
+  // FIXME: amplify and noise removal
 
-  // FIXME: signal handler to send all off event on abort.
+  /* Remove silence from individual samples. */
+  buffer.shrink_cues(cfg->output_noise_threshold);
+  stage("trim");
+  fprintf(stderr, "\ncues after processing:\n");
+  for(const AudioCue &c : buffer.get_cues())
+    fprintf(stderr, "%10" PRIu64 " : cue %s\n", c.frame,
+     AudioCue::type_str(c.type));
 
-  if(cfg->output_on)
+  /* Output audio */
+  if(cfg->output_debug)
   {
-    if(!card.audio_capture_start(buffer))
-    {
-      fprintf(stderr, "Failed to start audio capture\n");
-      return 0;
-    }
+    AudioFormatRaw.save(ctx, buffer, output("post.raw"));
+    stage("post.raw");
   }
 
-  /* Run remaining scheduled events. */
-  while(ev.has_next())
+  if(cfg->output_wav)
   {
-    int ms = ev.next_time() - ev.previous_time();
-    if(ms > 0)
-      Platform::delay(ms);
+    AudioFormatWAVE.save_all(ctx, buffer, output("%.wav"));
+    stage("WAV");
+  }
 
-    std::shared_ptr<Event> event = ev.pop();
-    event->task();
+  if(cfg->output_session_wav)
+  {
+    AudioFormatWAVE.save(ctx, buffer, output("session.wav"));
+    stage("session WAV");
   }
 
-  if(cfg->output_on)
+  if(cfg->output_iti)
   {
-    card.audio_capture_stop();
-    fprintf(stderr, "total frames read: %zu\n", buffer.total_frames());
+    AudioFormatITI.save(ctx, buffer, output("out.iti"));
+    stage("ITI");
+  }
 
-    for(const AudioCue &c : buffer.get_cues())
-      fprintf(stderr, "%10" PRIu64 " : cue %s\n", c.frame,
-       AudioCue::type_str(c.type));
+  if(cfg->output_it)
+  {
+    AudioFormatIT.save(ctx, buffer, output("out.it"));
+    stage("IT");
+  }
 
-    if(!Platform::mkdir_recursive("output"))
-    {
-      fprintf(stderr, "failed to create output directory\n");
-      return 0;
-    }
+  if(cfg->output_sfz)
+  {
+    AudioFormatSFZ.save(ctx, buffer, output("out.sfz"));
+    stage("SFZ");
+  }
 
-    /* Output audio (debug, no processing) */
-    if(cfg->output_debug)
-      AudioFormatRaw.save(ctx, buffer, OUTPUT_DIR "/pre.raw");
+  if(cfg->output_sf2)
+  {
+    AudioFormatSF2.save(ctx, buffer, output("out.sf2"));
+    stage("SF2");
+  }
 
-    // FIXME: remove redundant channels
+  // FIXME: output audio
 
-    // FIXME: amplify and noise removal
+  if(timing)
+  {
+    int64_t total_us = 0;
+    fprintf(stderr, "\npost-processing time:\n");
+    for(auto &p : stages)
+    {
+      fprintf(stderr, "  %-12s %10.3fms\n", p.first, p.second / 1000.0);
+      total_us += p.second;
+    }
+    fprintf(stderr, "  %-12s %10.3fms\n", "total", total_us / 1000.0);
+  }
+}
 
-    /* Remove silence from individual samples. */
-    buffer.shrink_cues(cfg->output_noise_threshold);
-    fprintf(stderr, "\ncues after processing:\n");
-    for(const AudioCue &c : buffer.get_cues())
-      fprintf(stderr, "%10" PRIu64 " : cue %s\n", c.frame,
-       AudioCue::type_str(c.type));
+/**
+ * Reload a captured session and run only the post-capture pipeline.
+ */
+static int reprocess(ConfigContext &ctx,
+ const std::shared_ptr<GlobalConfig> &cfg, const char *filename)
+{
+  AudioBuffer<int16_t> buffer(2, cfg->audio_rate);
+  if(!AudioFormatSession.load(buffer, filename))
+    return 1;
 
-    /* Output audio */
-    if(cfg->output_debug)
-      AudioFormatRaw.save(ctx, buffer, OUTPUT_DIR "/post.raw");
+  fprintf(stderr, "reprocessing '%s': %u channels, %uHz, %zu frames, %zu cues\n",
+   filename, buffer.channels, buffer.rate, buffer.total_frames(),
+   buffer.get_cues().size());
 
-    if(cfg->output_wav)
-      AudioFormatWAVE.save_all(ctx, buffer, OUTPUT_DIR "/%.wav");
+  if(!Platform::mkdir_recursive(OUTPUT_DIR))
+  {
+    fprintf(stderr, "failed to create output directory\n");
+    return 1;
+  }
 
-    if(cfg->output_iti)
-      AudioFormatITI.save(ctx, buffer, OUTPUT_DIR "/out.iti");
+  process_output(ctx, cfg, buffer, OUTPUT_DIR);
+  return 0;
+}
 
-    // FIXME: output audio
-  }
+/**
+ * Split a parallel capture into a stereo recording per synth, from its
+ * input channel pair and its cues, and write the outputs of each synth to
+ * its own directory.
+ */
+static void process_parallel(ConfigContext &ctx,
+ const std::shared_ptr<GlobalConfig> &cfg,
+ const std::vector<const MIDIInterface *> &midi_interfaces,
+ const AudioBuffer<int16_t> &buffer, bool timing)
+{
+  const std::vector<AudioCue> &cues = buffer.get_cues();
+  const int16_t *samples = buffer.get_samples();
+  size_t frames = buffer.total_frames();
+
+  for(size_t i = 0; i < midi_interfaces.size(); i++)
+  {
+    const MIDIInterface *mi = midi_interfaces[i];
+    const InputConfig *ic = mi->get_input_config();
+    unsigned first = (ic->audio_pair - 1) * 2;
+
+    auto data = std::make_shared<std::vector<int16_t>>(frames * 2);
+    int16_t *dest = data->data();
+    for(size_t j = 0; j < frames; j++)
+    {
+      dest[j * 2 + 0] = samples[j * buffer.channels + first + 0];
+      dest[j * 2 + 1] = samples[j * buffer.channels + first + 1];
+    }
+
+    std::vector<AudioCue> synth_cues;
+    for(const AudioCue &c : cues)
+    {
+      unsigned synth = AudioCue::synth_of(c.value);
+      if(!synth || synth == i + 1)
+        synth_cues.push_back({ c.frame, c.type, AudioCue::synth_value(c.value, 0) });
+    }
+
+    AudioBuffer<int16_t> split(2, buffer.rate);
+    split.assign(data, data->data(), frames, std::move(synth_cues));
+
+    std::string dir = OUTPUT_DIR "/" + std::string(mi->tag);
+    if(mi->id > 1)
+      dir += "-" + std::to_string(mi->id);
+
+    if(!Platform::mkdir_recursive(dir.c_str()))
+    {
+      fprintf(stderr, "failed to create output directory '%s'\n", dir.c_str());
+      continue;
+    }
+
+    fprintf(stderr, "\nsynth '%s': channels %u-%u\n", mi->tag, first + 1, first + 2);
+    process_output(ctx, cfg, split, dir.c_str(), timing);
+  }
+}
+
+/**
+ * One patch of a session: its configuration (config.ini plus the patch
+ * file), the synths it programs, and the notes to record.
+ */
+struct Patch
+{
+  ConfigContext ctx{};
+  std::string name;
+  std::shared_ptr<PlaybackConfig> play;
+  std::vector<const MIDIInterface *> midi_interfaces;
+  std::vector<unsigned> notes;
+  std::vector<unsigned> velocities;
+};
+
+static bool load_patch(Patch &patch, const MIDIInterface *bank = nullptr)
+{
+  patch.play = patch.ctx.get_interface_as<PlaybackConfig>("Playback");
+  if(patch.play == nullptr)
+    return false;
+
+  /* Get all MIDI synths. */
+  for(auto &p : patch.ctx.get_interfaces())
+  {
+    /* pointer - failure returns nullptr */
+    MIDIInterface *mi = dynamic_cast<MIDIInterface *>(p.get());
+    if(mi)
+    {
+      /* Load external SysEx if applicable. The bank synth of a bank
+       * session is loaded from the bank instead. */
+      if(!bank || mi->id != bank->id || strcmp(mi->tag, bank->tag))
+        mi->load();
+
+      patch.midi_interfaces.push_back(mi);
+    }
+  }
+
+  patch.notes = playback_notes(patch.ctx, patch.play);
+  return playback_velocities(patch.play, patch.velocities);
+}
+
+/* Parse a list of patch numbers from 1 to max, e.g. "1-8,12". */
+static bool parse_patch_list(const char *list, unsigned max,
+ std::vector<unsigned> &out)
+{
+  while(*list)
+  {
+    char *end;
+    unsigned long first = strtoul(list, &end, 10);
+    unsigned long last = first;
+    if(end == list)
+      return false;
+
+    if(*end == '-')
+    {
+      list = end + 1;
+      last = strtoul(list, &end, 10);
+      if(end == list)
+        return false;
+    }
+    if(first < 1 || last < first || last > max)
+      return false;
+
+    for(unsigned long i = first; i <= last; i++)
+      out.push_back(i);
+
+    if(*end == ',')
+      end++;
+    else
+
+    if(*end)
+      return false;
+
+    list = end;
+  }
+  return !out.empty();
+}
+
+/* Output name of a patch file: its filename without directory or extension. */
+static std::string patch_name(const char *filename)
+{
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+
+  const char *ext = strrchr(base, '.');
+  return std::string(base, ext && ext != base ? ext : base + strlen(base));
+}
+
+/* Bank dump of a bank session and the voice recorded by each patch. */
+struct Bank
+{
+  std::vector<uint8_t> data;
+  std::vector<unsigned> voices;
+  const MIDIInterface *interface = nullptr;
+};
+
+/**
+ * Create the patches of a session from the config arguments.
+ *
+ * A batch session records several patches (one per patch file) in one
+ * continuous capture. A bank session records several patches of a bank dump
+ * (SysExPath) as a batch; the bank is read once and each patch gets its own
+ * copy of the configuration. Either way, the global settings of the first
+ * patch are used.
+ *
+ * @param patches   Destination list of patches.
+ * @param args      Config arguments; the first is the program name.
+ * @param batch     Create one patch per patch file (--batch).
+ * @param bank      Create one patch per bank voice (--bank), or `nullptr`.
+ * @param voices    Bank voices to record, e.g. "1-8,12"; `nullptr` for all.
+ * @returns         `true` on success, otherwise `false`.
+ */
+static bool create_patches(std::vector<std::unique_ptr<Patch>> &patches,
+ std::vector<char *> &args, bool batch, Bank *bank, const char *voices)
+{
+  if(batch)
+  {
+    if(bank)
+    {
+      fprintf(stderr, "--bank can't be used with --batch\n");
+      return false;
+    }
+
+    for(size_t i = 1; i < args.size(); i++)
+    {
+      char *patch_args[] = { args[0], args[i] };
+      patches.emplace_back(new Patch);
+      patches.back()->name = patch_name(args[i]);
+      if(!patches.back()->ctx.init(2, patch_args))
+      {
+        fprintf(stderr, "failed to load patch '%s'\n", args[i]);
+        return false;
+      }
+    }
+    if(patches.empty())
+    {
+      fprintf(stderr, "--batch requires one or more patch files\n");
+      return false;
+    }
+    return true;
+  }
+
+  patches.emplace_back(new Patch);
+  if(!patches[0]->ctx.init(args.size(), args.data()))
+    return false;
+
+  if(!bank)
+    return true;
+
+  unsigned count = 0;
+  for(auto &p : patches[0]->ctx.get_interfaces())
+  {
+    /* pointer - failure returns nullptr */
+    MIDIInterface *mi = dynamic_cast<MIDIInterface *>(p.get());
+    if(mi)
+      count = mi->read_bank(bank->data);
+    if(count)
+    {
+      bank->interface = mi;
+      break;
+    }
+  }
+  if(!count)
+  {
+    fprintf(stderr, "--bank requires a synth with a bank dump (SysExPath)\n");
+    return false;
+  }
+
+  if(!voices)
+  {
+    for(unsigned i = 1; i <= count; i++)
+      bank->voices.push_back(i);
+  }
+  else
+
+  if(!parse_patch_list(voices, count, bank->voices))
+  {
+    fprintf(stderr, "invalid voice list '%s' (1-%u)\n", voices, count);
+    return false;
+  }
+
+  std::string base = args.size() > 1 ? patch_name(args[1]) : "bank";
+  for(size_t i = 0; i < bank->voices.size(); i++)
+  {
+    char name[16];
+    snprintf(name, sizeof(name), "-%02u", bank->voices[i]);
+
+    if(i > 0)
+    {
+      patches.emplace_back(new Patch);
+      if(!patches.back()->ctx.init(args.size(), args.data()))
+        return false;
+    }
+    patches.back()->name = base + name;
+  }
+  return true;
+}
+
+/**
+ * Load the synths and notes of every patch; for a bank session, also load
+ * each patch's voice from the bank.
+ *
+ * @param patches           Patches created by create_patches.
+ * @param bank              Bank of a bank session, or `nullptr`.
+ * @param midi_interfaces   Destination for the synths of every patch.
+ * @param midi_devices      Destination for one synth per MIDI device.
+ * @returns                 `true` on success, otherwise `false`.
+ */
+static bool load_patches(const std::vector<std::unique_ptr<Patch>> &patches,
+ const Bank *bank, std::vector<const MIDIInterface *> &midi_interfaces,
+ std::vector<const MIDIInterface *> &midi_devices)
+{
+  for(size_t i = 0; i < patches.size(); i++)
+  {
+    Patch *patch = patches[i].get();
+    if(!load_patch(*patch, bank ? bank->interface : nullptr))
+      return false;
+
+    if(bank)
+    {
+      auto p = patch->ctx.get_interface(bank->interface->tag, bank->interface->id);
+      MIDIInterface *mi = dynamic_cast<MIDIInterface *>(p.get());
+      if(!mi || !mi->load_bank(bank->data, bank->voices[i]))
+        return false;
+    }
+
+    for(const MIDIInterface *mi : patch->midi_interfaces)
+    {
+      midi_interfaces.push_back(mi);
+      if(std::none_of(midi_devices.begin(), midi_devices.end(),
+       [mi](const MIDIInterface *d){ return d->device == mi->device; }))
+        midi_devices.push_back(mi);
+    }
+  }
+  return true;
+}
+
+/**
+ * Split a batch capture at its patch cues and run the post-capture pipeline
+ * for each patch, writing each patch to its own output subdirectory.
+ */
+static void process_batch(const std::vector<std::unique_ptr<Patch>> &patches,
+ const AudioBuffer<int16_t> &buffer, bool timing)
+{
+  const std::vector<AudioCue> &cues = buffer.get_cues();
+  for(size_t i = 0; i < cues.size(); i++)
+  {
+    if(cues[i].type != AudioCue::Patch || (size_t)cues[i].value >= patches.size())
+      continue;
+
+    Patch &patch = *patches[cues[i].value];
+    const auto cfg = patch.ctx.get_interface_as<GlobalConfig>("global");
+    size_t start = std::min(cues[i].frame, buffer.total_frames());
+    size_t end = buffer.total_frames();
+
+    std::vector<AudioCue> patch_cues;
+    for(i++; i < cues.size(); i++)
+    {
+      if(cues[i].type == AudioCue::Patch)
+      {
+        end = std::min(end, cues[i].frame);
+        break;
+      }
+      patch_cues.push_back({ cues[i].frame - start, cues[i].type, cues[i].value });
+    }
+    i--;
+
+    /* View into the capture; the capture buffer outlives it. */
+    const int16_t *samples = buffer.get_samples() + start * buffer.channels;
+    AudioBuffer<int16_t> view(buffer.channels, buffer.rate);
+    view.assign(std::shared_ptr<const void>(std::shared_ptr<const void>(), samples),
+     samples, end - start, std::move(patch_cues));
+
+    std::string dir = OUTPUT_DIR "/" + patch.name;
+    if(!cfg || !Platform::mkdir_recursive(dir.c_str()))
+    {
+      fprintf(stderr, "failed to create output directory '%s'\n", dir.c_str());
+      continue;
+    }
+
+    fprintf(stderr, "\npatch '%s': %zu frames\n", patch.name.c_str(), end - start);
+    process_output(patch.ctx, cfg, view, dir.c_str(), timing);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *reprocess_file = nullptr;
+  const char *simulate_file = nullptr;
+  bool simulate = false;
+  bool resume = false;
+  bool batch = false;
+  bool fetch = false;
+  bool calibrate = false;
+  bool bank = false;
+  const char *voices = nullptr;
+
+  /* Handle program options; everything else is passed to the config. */
+  std::vector<char *> args;
+  for(int i = 0; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--reprocess") && i + 1 < argc)
+      reprocess_file = argv[++i];
+    else
+
+    if(!strcmp(argv[i], "--resume"))
+      resume = true;
+    else
+
+    if(!strcmp(argv[i], "--simulate"))
+      simulate = true;
+    else
+
+    if(!strcmp(argv[i], "--simulate-source") && i + 1 < argc)
+    {
+      simulate_file = argv[++i];
+      simulate = true;
+    }
+    else
+
+    if(!strcmp(argv[i], "--batch"))
+      batch = true;
+    else
+
+    if(!strcmp(argv[i], "--fetch"))
+      fetch = true;
+    else
+
+    if(!strcmp(argv[i], "--calibrate"))
+      calibrate = true;
+    else
+
+    if(!strcmp(argv[i], "--bank"))
+      bank = true;
+    else
+
+    if(!strcmp(argv[i], "--voices") && i + 1 < argc)
+    {
+      voices = argv[++i];
+      bank = true;
+    }
+    else
+      args.push_back(argv[i]);
+  }
+
+  std::vector<std::unique_ptr<Patch>> patches;
+  Bank bank_info;
+  if(!create_patches(patches, args, batch, bank ? &bank_info : nullptr, voices))
+    return 1;
+
+  /* A bank session is recorded as a batch. */
+  batch |= bank;
+
+  ConfigContext &ctx = patches[0]->ctx;
+  const auto cfg = ctx.get_interface_as<GlobalConfig>("global");
+  const auto play = ctx.get_interface_as<PlaybackConfig>("Playback");
+
+  if(cfg == nullptr || play == nullptr)
+    return 1;
+
+  Log::set_level(static_cast<Log::Level>(cfg->log_level.value()));
+
+  if(reprocess_file)
+    return reprocess(ctx, cfg, reprocess_file);
+
+  /* Interfaces of every patch, and one of them per MIDI device to open. */
+  std::vector<const MIDIInterface *> midi_interfaces;
+  std::vector<const MIDIInterface *> midi_devices;
+  if(!load_patches(patches, bank ? &bank_info : nullptr, midi_interfaces,
+   midi_devices))
+    return 1;
+
+  if(midi_interfaces.size() < 1)
+  {
+    fprintf(stderr, "nothing to do\n");
+    return 0;
+  }
+
+  /* Synths on their own input channel pairs are played at the same time,
+   * each on its own schedule, and split into separate outputs. */
+  int channels = parallel_channels(midi_interfaces);
+  bool parallel = channels > 0;
+  if(channels < 0)
+    return 1;
+
+  if(parallel && (batch || calibrate || resume))
+  {
+    fprintf(stderr, "AudioPair can't be used with --batch, --bank, --calibrate, or --resume\n");
+    return 1;
+  }
+
+  /* Pull the synths' current patch over MIDI instead of a SysEx file. */
+  if(fetch)
+  {
+    if(batch || simulate)
+    {
+      fprintf(stderr, "--fetch can't be used with --batch or --simulate\n");
+      return 1;
+    }
+
+    std::vector<MIDIInterface *> fetch_interfaces;
+    for(auto &p : ctx.get_interfaces())
+    {
+      /* pointer - failure returns nullptr */
+      MIDIInterface *mi = dynamic_cast<MIDIInterface *>(p.get());
+      if(mi)
+        fetch_interfaces.push_back(mi);
+    }
+    if(!fetch_patches(cfg, fetch_interfaces))
+      return 1;
+  }
+
+  /* Measure the latency of each synth instead of recording. */
+  if(calibrate)
+  {
+    if(batch || resume)
+    {
+      fprintf(stderr, "--calibrate can't be used with --batch or --resume\n");
+      return 1;
+    }
+    if(!cfg->output_on)
+    {
+      fprintf(stderr, "--calibrate requires Output=on\n");
+      return 1;
+    }
+  }
+
+  /* Schedule MIDI events and user program prompts. */
+  EventSchedule ev;
+  AudioBuffer<int16_t> buffer(parallel ? channels : 2, cfg->audio_rate);
+
+  /* Adaptive release can't tell synths apart when they play in parallel. */
+  bool adaptive = cfg->output_on && !parallel &&
+   cfg->midi_queue == GlobalConfig::MIDI_QUEUE_OFF;
+  ReleaseDetector<int16_t> release(buffer, cfg->output_noise_threshold,
+   play->ReleaseHold_ms);
+
+  /* Journal completed notes as they are captured so an interrupted capture
+   * can be resumed. The journal relies on the capture dump for the audio and
+   * on cues running at their actual time (i.e. not queued up front). */
+  bool journaling = cfg->output_on && cfg->output_dump && !batch && !calibrate &&
+   !parallel && cfg->midi_queue == GlobalConfig::MIDI_QUEUE_OFF;
+  Journal journal;
+  std::vector<std::unique_ptr<AudioBuffer<int16_t>>> sessions;
+  std::set<int> captured;
+  char session_file[64] = OUTPUT_DIR "/capture.session";
+
+  /* Simulated runs must not replace a real capture or its journal. */
+  if(simulate)
+  {
+    snprintf(session_file, sizeof(session_file), OUTPUT_DIR "/simulate.session");
+    journaling = false;
+  }
+
+  if(resume)
+  {
+    if(!journaling)
+    {
+      fprintf(stderr, "--resume requires OutputDump and MIDIQueue=off, and no --batch\n");
+      return 1;
+    }
+    if(!resume_journal(journal, sessions, captured, cfg->audio_rate))
+      return 1;
+
+    snprintf(session_file, sizeof(session_file), OUTPUT_DIR "/capture-%zu.session",
+     sessions.size() + 1);
+  }
+
+  /* Each patch is scheduled on its own and appended to the timeline. The
+   * next patch is programmed at the start of the previous patch's final
+   * quiet period, while its last note releases, and starts once both the
+   * previous patch and the SysEx transfer have ended. The noise window is
+   * only recorded once. */
+  static constexpr int64_t PATCH_SETTLE_US = 100000;
+  bool use_release = false;
+  int64_t program_us = EventSchedule::PROGRAM_TIME;
+  int64_t time_us = 0;
+  if(calibrate)
+  {
+    time_us = schedule_calibration(ev, cfg, play, patches[0]->notes,
+     midi_interfaces, buffer);
+  }
+  else
+
+  /* Parallel synths all start after the noise window. */
+  if(parallel)
+  {
+    Patch &patch = *patches[0];
+    int64_t noise_us = cfg->output_noise_removal ? cfg->output_noise_ms * 1000LL : 0;
+
+    for(size_t i = 0; i < patch.midi_interfaces.size(); i++)
+    {
+      EventSchedule pev;
+      int64_t end_us = schedule_events(pev, cfg, patch.play, patch.notes,
+       patch.velocities, { patch.midi_interfaces[i] }, buffer, nullptr, captured,
+       nullptr, i == 0, i + 1);
+
+      int64_t offset_us = i ? noise_us : 0;
+      ev.append(pev, offset_us, program_us);
+      time_us = std::max(time_us, offset_us + end_us);
+    }
+  }
+  else
+
+  for(size_t i = 0; i < patches.size(); i++)
+  {
+    Patch &patch = *patches[i];
+    EventSchedule pev;
+    bool patch_adaptive = adaptive && patch.play->AdaptiveRelease;
+    use_release |= patch_adaptive;
+
+    if(batch)
+    {
+      char msg[300];
+      snprintf(msg, sizeof(msg), "Patch %zu: %s", i, patch.name.c_str());
+      NoticeEvent::schedule(ev, msg);
+    }
+
+    int64_t end_us = schedule_events(pev, cfg, patch.play, patch.notes,
+     patch.velocities, patch.midi_interfaces, buffer,
+     patch_adaptive ? &release : nullptr, captured,
+     journaling ? &journal : nullptr, i == 0);
+
+    if(i > 0)
+    {
+      int64_t transfer_us = PATCH_SETTLE_US +
+       MIDIEvent::transfer_us(pev, EventSchedule::PROGRAM_TIME);
+
+      program_us = std::max<int64_t>(0,
+       time_us - patches[i - 1]->play->Quiet_ms * 1000LL);
+      time_us = std::max(time_us, program_us + transfer_us);
+    }
+
+    if(batch)
+      AudioCueEvent::schedule(ev, buffer, AudioCue::Patch, i, time_us);
+
+    ev.append(pev, time_us, program_us);
+    time_us += end_us;
+  }
+  uint64_t buffer_frames =
+   cast_multiply<uint64_t>(cfg->audio_rate, ev.total_duration() + 30000000) / 1000000;
+
+  if(buffer_frames * buffer.frame_size() > SIZE_MAX)
+  {
+    fprintf(stderr, "can't fit sample buffer of %" PRIu64 "u frames in RAM!\n",
+     buffer_frames);
+    return 0;
+  }
+
+  /* Confirm MIDI devices and manual synthesizer configuration. */
+  for(auto &patch : patches)
+  {
+    if(batch)
+      fprintf(stderr, "Patch:        %s\n", patch->name.c_str());
+    fprintf(stderr, "Start note:   %s\n", MIDIInterface::get_note(patch->play->MinNote));
+    fprintf(stderr, "End note:     %s\n", MIDIInterface::get_note(patch->play->MaxNote));
+    fprintf(stderr, "Notes:        %zu\n", patch->notes.size());
+    fprintf(stderr, "Layers:       %zu x %u round robin\n", patch->velocities.size(),
+     patch->play->RoundRobin.value());
+  }
+  fprintf(stderr, "Duration:     %.2fs\n", time_us / 1000000.0);
+  fprintf(stderr, "Buffer frames:%zu\n", buffer_frames);
+  fprintf(stderr, "\n");
+
+  for(unsigned i = 0; i < midi_interfaces.size(); i++)
+  {
+    const MIDIInterface *mi = midi_interfaces[i];
+    const InputConfig *ic = mi->get_input_config();
+    const char *device = ic ? ic->midi_device : "?";
+    unsigned channel = ic ? ic->midi_channel : 0;
+
+    if(parallel)
+    {
+      fprintf(stderr, "Interface %2u: '%s' on port '%s' channel %u, audio in %u-%u\n",
+       i, mi->tag, device, channel, ic->audio_pair * 2 - 1, ic->audio_pair * 2);
+    }
+    else
+      fprintf(stderr, "Interface %2u: '%s' on port '%s' channel %u\n",
+       i, mi->tag, device, channel);
+  }
+  fprintf(stderr, "\n");
+
+  // FIXME: these should print literally anything about their interface
+  while(ev.has_next())
+  {
+    if(ev.next_time() != EventSchedule::NOTICE_TIME)
+      break;
+
+    ev.run_next();
+  }
+  /* Dry run: the simulator stands in for the sound device and clock. */
+  Soundcard_Sim simulator;
+  if(simulate)
+  {
+    if(simulate_file && !simulator.load_source(simulate_file))
+      return 1;
+
+    fprintf(stderr, "simulating capture (%s)\n",
+     simulate_file ? simulate_file : "sine synthesizer");
+  }
+  else
+  {
+    fprintf(stderr, "Press 'enter' to continue.\n");
+    Platform::wait_input();
+  }
+
+  /* Preallocate recording buffer. */
+  if(cfg->output_on)
+  {
+    buffer.resize(buffer_frames);
+
+    if(!Platform::mkdir_recursive(OUTPUT_DIR))
+    {
+      fprintf(stderr, "failed to create output directory\n");
+      return 0;
+    }
+  }
+
+  /* Stream the capture to disk as it is recorded. */
+  AudioDump dump;
+  bool dumping = false;
+  if(cfg->output_on && cfg->output_dump && !calibrate)
+  {
+    dumping = dump.start(buffer, session_file, cfg->output_dump_direct);
+    if(!dumping)
+      fprintf(stderr, "failed to start capture dump\n");
+  }
+
+  if(journaling)
+  {
+    if(!dumping || !journal.open(JOURNAL_FILE, resume, session_file, buffer.get_cues()))
+    {
+      fprintf(stderr, "capture can't be resumed if interrupted\n");
+      journaling = false;
+    }
+  }
+
+  if(use_release)
+    buffer.add_listener(&release);
+
+  /* Initialize sound device. */
+  if(simulate && !try_init(simulator, cfg, play, midi_devices))
+    return 1;
+
+  Soundcard &card = simulate ? simulator :
+   initialize_soundcard(cfg, play, midi_devices);
+
+  /* On abort, stop at the next event and turn off any sounding notes. */
+  struct sigaction sa{};
+  sa.sa_handler = abort_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  if(cfg->output_on)
+  {
+    if(!card.audio_capture_start(buffer))
+    {
+      fprintf(stderr, "Failed to start audio capture\n");
+      return 0;
+    }
+  }
+
+  /* Run remaining scheduled events. Programming events (negative times) run
+   * immediately; the timeline starts once they are done and their output
+   * has been sent. Every event is scheduled against an absolute deadline so
+   * time spent in tasks, output, or interrupted sleeps doesn't accumulate.
+   *
+   * With a MIDI queue, the driver sends MIDI at its timestamp and cues are
+   * placed from their timestamps, so the whole timeline is queued up front.
+   *
+   * A simulated run uses the simulator's virtual clock; "sleeping" just
+   * generates the audio for the skipped time. */
+  auto clock_us = [&]()
+  {
+    return simulate ? simulator.clock_us() : Platform::clock_us();
+  };
+  auto sleep_until = [&](int64_t time_us)
+  {
+    if(simulate)
+    {
+      simulator.advance(time_us);
+      return true;
+    }
+    return Platform::sleep_until(time_us, &abort_signal);
+  };
+  auto card_failed = [&]()
+  {
+    return card.audio_capture_failed() || card.midi_output_failed();
+  };
+
+  static constexpr int64_t RELEASE_POLL_US = 2000;
+  static constexpr int64_t QUEUE_REFILL_US = 10000;
+  static constexpr int64_t OUTPUT_POLL_US = 2000;
+  int64_t wall_start_us = Platform::clock_us();
+  TimingTrace trace;
+
+  /* Event output is written by the log thread while the timeline runs. */
+  Log::start();
+  int64_t start_us = 0;
+  int64_t skipped_us = 0;
+  bool started = false;
+  bool queued = false;
+  while(ev.has_next())
+  {
+    int64_t next_us = ev.next_time();
+    if(next_us >= 0)
+    {
+      if(!started)
+      {
+        /* Paced output may still be sending the programming. */
+        while(!abort_signal && !card_failed() && card.midi_output_pending())
+          sleep_until(clock_us() + OUTPUT_POLL_US);
+
+        if(abort_signal || card_failed())
+          break;
+
+        if(cfg->midi_queue != GlobalConfig::MIDI_QUEUE_OFF)
+          queued = card.midi_queue_start();
+
+        start_us = clock_us();
+        started = true;
+
+        if(cfg->output_timing)
+        {
+          trace.start(ev.remaining_events(), start_us, buffer.total_frames(),
+           cfg->output_on ? buffer.rate : 0);
+          card.midi_track_writes(true);
+        }
+
+        if(queued && cfg->output_on)
+        {
+          uint64_t frame;
+          if(!card.audio_capture_position(start_us, frame))
+            frame = buffer.total_frames();
+
+          buffer.set_timeline(frame);
+        }
+      }
+      if(!queued)
+      {
+        /* Poll for the end of a release while waiting; once it ends, pull
+         * the rest of the timeline forward to its resume time. */
+        while(release.is_armed() && !abort_signal)
+        {
+          int64_t now_us = clock_us();
+          if(release.check_released())
+          {
+            int64_t skip_us = release.resume_time() - (now_us - start_us);
+            if(skip_us > 0)
+            {
+              start_us -= skip_us;
+              skipped_us += skip_us;
+            }
+            break;
+          }
+          if(now_us - start_us >= release.resume_time())
+          {
+            release.disarm();
+            break;
+          }
+          if(now_us >= start_us + next_us)
+            break;
+
+          sleep_until(std::min(start_us + next_us, now_us + RELEASE_POLL_US));
+        }
+        sleep_until(start_us + next_us);
+      }
+    }
+
+    if(abort_signal || card_failed())
+      break;
+
+    if(cfg->output_timing && next_us >= 0)
+    {
+      int64_t wake_us = clock_us();
+      uint64_t frame = buffer.total_frames();
+      uint32_t bytes = ev.peek().data_length;
+      uint64_t write_id = card.midi_write_id();
+
+      ev.run_next();
+      uint64_t last_write = card.midi_write_id();
+      trace.add(start_us + next_us, wake_us, clock_us(), frame, bytes,
+       last_write != write_id ? write_id + 1 : 0, last_write);
+    }
+    else
+      ev.run_next();
+  }
+
+  Log::stop();
+
+  if(skipped_us)
+    fprintf(stderr, "adaptive release saved %.2fs\n", skipped_us / 1000000.0);
+
+  /* Keep feeding the driver anything it didn't have room for, then wait
+   * for the end of the timeline. */
+  while(queued && !abort_signal && !card_failed() && card.midi_queue_refill())
+    sleep_until(clock_us() + QUEUE_REFILL_US);
+
+  if(queued && !abort_signal)
+    sleep_until(start_us + ev.total_duration());
+
+  if(cfg->output_timing)
+  {
+    /* Output written in the background is timestamped by its writer. On
+     * abort, don't wait for it; those events keep the time they ran. */
+    if(!abort_signal && !card_failed())
+    {
+      std::vector<Soundcard::MIDIWriteTime> times;
+      card.midi_write_times(times);
+      for(const Soundcard::MIDIWriteTime &t : times)
+        trace.complete(t.id, t.done_us);
+    }
+    card.midi_track_writes(false);
+
+    trace.summary(stderr);
+    if(!Platform::mkdir_recursive(OUTPUT_DIR) ||
+     !trace.save_csv(OUTPUT_DIR "/timing.csv"))
+      fprintf(stderr, "failed to save timing trace\n");
+  }
+
+  bool aborted = abort_signal || card_failed();
+  if(aborted)
+  {
+    fprintf(stderr, "\n%s; stopping\n", abort_signal ? "interrupted" :
+     card.audio_capture_failed() ? "audio capture failed" : "MIDI output failed");
+
+    if(queued)
+      card.midi_queue_stop(false);
+    all_notes_off(card, midi_interfaces);
+  }
+  else
+
+  if(queued)
+    card.midi_queue_stop();
+
+  if(cfg->output_on)
+  {
+    card.audio_capture_stop();
+    buffer.remove_listener(&release);
+    fprintf(stderr, "total frames read: %zu\n", buffer.total_frames());
+
+    if(simulate)
+    {
+      double wall = (Platform::clock_us() - wall_start_us) / 1000000.0;
+      double duration = (clock_us() - start_us - skipped_us) / 1000000.0;
+      fprintf(stderr, "simulated %.2fs session (%zu cues) in %.3fs\n",
+       duration, buffer.get_cues().size(), wall);
+    }
+
+    for(const AudioCue &c : buffer.get_cues())
+      fprintf(stderr, "%10" PRIu64 " : cue %s\n", c.frame,
+       AudioCue::type_str(c.type));
+
+    if(calibrate && !aborted)
+    {
+      return report_calibration(buffer, midi_interfaces,
+       cfg->output_noise_threshold) ? 0 : 1;
+    }
+
+    if(dumping)
+      dump.finish(buffer);
+    else
+
+    if(cfg->output_session)
+      AudioFormatSession.save(ctx, buffer, session_file);
+
+    journal.close();
+    if(aborted)
+    {
+      if(journaling)
+        fprintf(stderr, "run again with --resume to record the remaining notes\n");
+      return 1;
+    }
+
+    /* Resumed: merge the notes of every run before processing them. */
+    if(resume)
+    {
+      std::vector<const AudioBuffer<int16_t> *> sources;
+      for(const auto &s : sessions)
+        sources.push_back(s.get());
+      sources.push_back(&buffer);
+
+      AudioBuffer<int16_t> merged(buffer.channels, buffer.rate);
+      if(!merge_journal(journal, sources, merged))
+        return 1;
+
+      if(cfg->output_session)
+        AudioFormatSession.save(ctx, merged, OUTPUT_DIR "/merged.session");
+
+      process_output(ctx, cfg, merged, OUTPUT_DIR, simulate);
+      return 0;
+    }
+
+    if(parallel)
+      process_parallel(ctx, cfg, midi_interfaces, buffer, simulate);
+    else
+
+    if(batch)
+      process_batch(patches, buffer, simulate);
+    else
+      process_output(ctx, cfg, buffer, OUTPUT_DIR, simulate);
+  }
+  else
+
+  if(aborted)
+    return 1;
 
   return 0;
 }
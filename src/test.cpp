@@ -16,14 +16,405 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "AudioFormat_IT.hpp"
 #include "Config.hpp"
+#include "Event.hpp"
+#include "Journal.hpp"
 #include "Midi.hpp"
 #include "Soundcard.hpp"
+#include "SysEx.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+static bool check(bool ok, const char *what)
+{
+  if(!ok)
+    fprintf(stderr, "FAILED: %s\n", what);
+  return ok;
+}
+
+/* Reference IT 2.14 decompressor, for round-trip checks. */
+template<unsigned BITS>
+static std::vector<int> it214_decompress(const std::vector<uint8_t> &in,
+ size_t samples)
+{
+  constexpr unsigned MAX_WIDTH = BITS + 1;
+  constexpr unsigned A_BITS = (BITS == 8) ? 3 : 4;
+  constexpr unsigned B_HALF = (BITS == 8) ? 4 : 8;
+  constexpr size_t BLOCK_SAMPLES = (BITS == 8) ? 0x8000 : 0x4000;
+  std::vector<int> out;
+  size_t pos = 0;
+
+  while(out.size() < samples && pos + 2 <= in.size())
+  {
+    size_t len = in[pos] | (in[pos + 1] << 8);
+    size_t end = std::min(in.size(), pos + 2 + len);
+    size_t bitpos = (pos + 2) * 8;
+    size_t count = std::min(samples - out.size(), BLOCK_SAMPLES);
+    unsigned width = MAX_WIDTH;
+    int prev = 0;
+
+    auto get = [&](unsigned bits)
+    {
+      uint32_t v = 0;
+      for(unsigned i = 0; i < bits && bitpos < end * 8; i++, bitpos++)
+        v |= ((in[bitpos >> 3] >> (bitpos & 7)) & 1U) << i;
+      return v;
+    };
+
+    for(size_t i = 0; i < count && bitpos < end * 8;)
+    {
+      uint32_t v = get(width);
+      if(width < 7)
+      {
+        if(v == 1U << (width - 1))
+        {
+          unsigned next = get(A_BITS) + 1;
+          width = (next < width) ? next : next + 1;
+          continue;
+        }
+      }
+      else
+
+      if(width < MAX_WIDTH)
+      {
+        uint32_t border = ((1U << (width - 1)) - 1) - B_HALF;
+        if(v > border && v <= border + 2 * B_HALF)
+        {
+          unsigned next = v - border;
+          width = (next < width) ? next : next + 1;
+          continue;
+        }
+      }
+      else
+
+      if(v & (1U << BITS))
+      {
+        width = (v & ((1U << BITS) - 1)) + 1;
+        continue;
+      }
+
+      /* Sign extend the delta and accumulate with wrapping. */
+      unsigned bits = std::min(width, BITS);
+      int delta = static_cast<int>(v << (32 - bits)) >> (32 - bits);
+      prev += delta;
+      prev = (BITS == 8) ? static_cast<int8_t>(prev) : static_cast<int16_t>(prev);
+      out.push_back(prev);
+      i++;
+    }
+    pos += 2 + len;
+  }
+  return out;
+}
+
+template<unsigned BITS>
+static bool test_it214()
+{
+  constexpr int max = (1 << (BITS - 1)) - 1;
+  std::vector<int> in;
+  std::vector<uint8_t> data;
+  uint32_t seed = 1;
+
+  /* Silence, a slow ramp, full scale noise, and a few small steps; long
+   * enough to span more than one compression block. */
+  in.resize(0x100, 0);
+  for(int i = 0; i < 0x9000; i++)
+    in.push_back((i * 3) % (max + 1) - max / 2);
+  for(int i = 0; i < 0x1000; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    in.push_back(static_cast<int>((seed >> 8) % (2 * max + 2)) - max - 1);
+  }
+  for(int i = 0; i < 0x100; i++)
+    in.push_back((i & 8) ? 2 : -3);
+
+  {
+    ITCompressor<BITS> c(data);
+    for(int v : in)
+      c.push(v);
+  }
+  return check(it214_decompress<BITS>(data, in.size()) == in,
+   BITS == 8 ? "IT214 8-bit round trip" : "IT214 16-bit round trip");
+}
+
+static void record_event(const Event &e, const uint8_t *data)
+{
+  std::string &out = *const_cast<std::string *>(static_cast<const std::string *>(e.target));
+  out += std::to_string(e.time_us) + ":";
+  out.append(reinterpret_cast<const char *>(data), e.data_length);
+  out += " ";
+}
+
+static bool test_event_append()
+{
+  std::string out;
+  EventSchedule a;
+  EventSchedule b;
+
+  a.push(EventSchedule::PROGRAM_TIME, record_event, &out, 0, 0, "pa", 2);
+  a.push(200, record_event, &out, 0, 0, "a2", 2);
+  a.push(0, record_event, &out, 0, 0, "a0", 2);
+
+  /* Events at the same time must keep the order they were added in. */
+  b.push(100, record_event, &out, 0, 0, "b1", 2);
+  b.push(EventSchedule::PROGRAM_TIME, record_event, &out, 0, 0, "pb", 2);
+  b.push(0, record_event, &out, 0, 0, "b0", 2);
+  b.push(100, record_event, &out, 0, 0, "b2", 2);
+  a.append(b, 1000, 500);
+
+  while(a.has_next())
+    a.run_next();
+
+  return check(out == "-1:pa 0:a0 200:a2 500:pb 1000:b0 1100:b1 1100:b2 ",
+   "EventSchedule::append ordering") &&
+   check(a.total_duration() == 1100, "EventSchedule::append duration");
+}
+
+static bool test_journal()
+{
+  static constexpr const char *filename = "test_journal.tmp";
+  std::vector<AudioCue> cues;
+  Journal out;
+  Journal in;
+
+  /* Write two runs; the partial line is left by an interrupted write. */
+  if(!check(out.open(filename, false, "a.session", cues), "Journal::open"))
+    return false;
+  cues.push_back({ 100, AudioCue::NoteOn, 60 });
+  cues.push_back({ 200, AudioCue::NoteOff, 60 });
+  out.record();
+  cues.push_back({ 300, AudioCue::NoteOn, 62 });
+  cues.push_back({ 400, AudioCue::NoteOff, 62 });
+  out.record();
+  out.close();
+
+  cues.clear();
+  out.open(filename, true, "b.session", cues);
+  cues.push_back({ 50, AudioCue::NoteOn, 64 });
+  cues.push_back({ 150, AudioCue::NoteOff, 64 });
+  out.record();
+  out.close();
+
+  FILE *fp = fopen(filename, "a");
+  if(fp)
+  {
+    fprintf(fp, "note 150 2");
+    fclose(fp);
+  }
+
+  bool ok = check(in.load(filename), "Journal::load");
+  remove(filename);
+  if(!ok)
+    return false;
+
+  /* The second note of the first run isn't completely in its session. */
+  in.truncate(0, 350);
+  const std::vector<Journal::Run> &runs = in.get_runs();
+  return check(runs.size() == 2 &&
+   runs[0].session == "a.session" && runs[0].regions.size() == 1 &&
+   runs[0].regions[0].start == 100 && runs[0].regions[0].end == 200 &&
+   runs[0].regions[0].value == 60 &&
+   runs[1].session == "b.session" && runs[1].regions.size() == 1 &&
+   runs[1].regions[0].start == 50 && runs[1].regions[0].value == 64,
+   "Journal load and truncate");
+}
+
+/* Roland DT1 message with a 3-byte address. */
+static std::vector<uint8_t> roland_dt1(unsigned addr, const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> msg{ 0xf0, 0x41, 0x10, 0x16, 0x12,
+   (uint8_t)((addr >> 14) & 0x7f), (uint8_t)((addr >> 7) & 0x7f), (uint8_t)(addr & 0x7f) };
+  msg.insert(msg.end(), data.begin(), data.end());
+  msg.push_back(MIDIInterface::roland_checksum(msg.data() + 5, msg.size() - 5));
+  msg.push_back(0xf7);
+  return msg;
+}
+
+static bool test_program_changes()
+{
+  ConfigContext mctx{};
+  if(!mctx.parse_config(""))
+    return check(false, "program changes: config");
+
+  auto mi = mctx.get_interface_as<MIDIInterface>("JU-06A");
+  if(!check(mi != nullptr, "program changes: interface"))
+    return false;
+
+  bool ok = true;
+  std::vector<uint8_t> data(20);
+  for(size_t i = 0; i < data.size(); i++)
+    data[i] = i;
+
+  /* Nothing to compare against the first time; everything is sent. */
+  std::vector<uint8_t> out = roland_dt1(0x7e, data);
+  mi->roland_changes(out, 5, 3, 1);
+  ok &= check(out == roland_dt1(0x7e, data), "roland_changes: first programming");
+
+  /* Changes far enough apart are sent as separate messages; addresses
+   * carry into the next 7-bit byte. */
+  std::vector<uint8_t> changed = data;
+  changed[3] = 0x40;
+  changed[15] = 0x41;
+  out = roland_dt1(0x7e, changed);
+  mi->roland_changes(out, 5, 3, 1);
+  std::vector<uint8_t> expect = roland_dt1(0x7e + 3, { 0x40 });
+  std::vector<uint8_t> second = roland_dt1(0x7e + 15, { 0x41 });
+  expect.insert(expect.end(), second.begin(), second.end());
+  ok &= check(out == expect, "roland_changes: separate changes");
+
+  /* Nearby changes are merged. */
+  changed[5] = 0x42;
+  out = roland_dt1(0x7e, changed);
+  mi->roland_changes(out, 5, 3, 1);
+  ok &= check(out == roland_dt1(0x7e + 5, { 0x42 }), "roland_changes: one change");
+
+  changed[7] = 0x43;
+  changed[9] = 0x44;
+  out = roland_dt1(0x7e, changed);
+  mi->roland_changes(out, 5, 3, 1);
+  ok &= check(out == roland_dt1(0x7e + 7, { 0x43, 8, 0x44 }), "roland_changes: merged changes");
+
+  out = roland_dt1(0x7e, changed);
+  mi->roland_changes(out, 5, 3, 1);
+  ok &= check(out.empty(), "roland_changes: no changes");
+
+  std::vector<uint8_t> cc{ 0xb0, 0x10, 0x01, 0xb0, 0x11, 0x02, 0xb0, 0x12, 0x03 };
+  out = cc;
+  mi->cc_changes(out);
+  ok &= check(out == cc, "cc_changes: first programming");
+
+  cc[5] = 0x05;
+  out = cc;
+  mi->cc_changes(out);
+  ok &= check(out == std::vector<uint8_t>{ 0xb0, 0x11, 0x05 }, "cc_changes: one change");
+  return ok;
+}
+
+static bool test_sysex_parser()
+{
+  std::vector<uint8_t> in{ 0xf8 };
+  std::vector<uint8_t> good = roland_dt1(0x100, { 0x01, 0x02 });
+  std::vector<uint8_t> bad = good;
+  bad[bad.size() - 2] ^= 0x01;
+  in.insert(in.end(), good.begin(), good.end());
+  in.insert(in.end(), bad.begin(), bad.end());
+
+  /* Yamaha bulk dump, format 9, four bytes. */
+  std::vector<uint8_t> yamaha{ 0xf0, 0x43, 0x02, 0x09, 0x00, 0x04,
+   0x10, 0x20, 0x30, 0x40, 0x00, 0xf7 };
+  yamaha[10] = (-(0x10 + 0x20 + 0x30 + 0x40)) & 0x7f;
+  in.insert(in.end(), yamaha.begin(), yamaha.end());
+
+  /* Note on with running status and a realtime byte in between, an
+   * unterminated message, and a program change. */
+  std::vector<uint8_t> rest{ 0x90, 0x3c, 0x64, 0xfe, 0x3e, 0x00,
+   0xf0, 0x41, 0x10, 0x16, 0x12, 0x00, 0xc0, 0x05 };
+  in.insert(in.end(), rest.begin(), rest.end());
+
+  SysExParser parser(in.data(), in.size());
+  SysExMessage msg;
+  bool ok = true;
+
+  ok &= check(parser.next(msg) && msg.status == 0xf0 && msg.valid &&
+   msg.manufacturer == SysExParser::ROLAND && msg.device == 0x10 &&
+   msg.model == 0x16 && msg.command == SysExParser::ROLAND_DT1 &&
+   msg.address == 0x000200 && msg.payload_length == 2 &&
+   msg.payload[0] == 0x01 && msg.payload[1] == 0x02 &&
+   msg.length == good.size(), "SysExParser: Roland DT1");
+
+  ok &= check(parser.next(msg) && msg.status == 0xf0 && !msg.valid &&
+   msg.length == bad.size(), "SysExParser: Roland bad checksum");
+
+  ok &= check(parser.next(msg) && msg.valid &&
+   msg.manufacturer == SysExParser::YAMAHA &&
+   msg.command == SysExParser::YAMAHA_BULK && msg.device == 0x02 &&
+   msg.model == 0x09 && msg.payload_length == 4 && msg.payload[0] == 0x10,
+   "SysExParser: Yamaha bulk dump");
+
+  ok &= check(parser.next(msg) && msg.status == 0x90 && msg.length == 3 &&
+   msg.payload[0] == 0x3c && msg.payload[1] == 0x64, "SysExParser: note on");
+
+  ok &= check(parser.next(msg) && msg.status == 0x90 && msg.length == 2 &&
+   msg.payload[0] == 0x3e && msg.payload[1] == 0x00,
+   "SysExParser: running status");
+
+  ok &= check(parser.next(msg) && msg.status == 0xf0 && !msg.valid &&
+   msg.length == 6, "SysExParser: unterminated SysEx");
+
+  ok &= check(parser.next(msg) && msg.status == 0xc0 && msg.length == 2 &&
+   msg.payload[0] == 0x05, "SysExParser: program change");
+
+  ok &= check(!parser.next(msg), "SysExParser: end of buffer");
+  return ok;
+}
+
+static bool test_roland_image()
+{
+  uint8_t base[30], a[8], b[8], c[2];
+  for(size_t i = 0; i < sizeof(base); i++)
+    base[i] = i;
+  for(size_t i = 0; i < sizeof(a); i++)
+  {
+    a[i] = 0x40 + i;
+    b[i] = 0x50 + i;
+  }
+  c[0] = 0x60;
+  c[1] = 0x61;
+
+  /* Overlapping segments, the last out of order; later segments win. */
+  RolandImage image;
+  image.add(90, base, sizeof(base));
+  image.add(100, a, sizeof(a));
+  image.add(104, b, sizeof(b));
+  image.add(102, c, sizeof(c));
+
+  uint8_t buf[30];
+  bool ok = true;
+  ok &= check(image.read(90, buf), "RolandImage: read");
+
+  uint8_t expect[30];
+  for(size_t i = 0; i < sizeof(expect); i++)
+    expect[i] = i;
+  expect[10] = 0x40;
+  expect[11] = 0x41;
+  expect[12] = 0x60;
+  expect[13] = 0x61;
+  for(size_t i = 0; i < sizeof(b); i++)
+    expect[14 + i] = 0x50 + i;
+  ok &= check(!memcmp(buf, expect, sizeof(expect)), "RolandImage: overlap precedence");
+
+  unsigned value = 0;
+  ok &= check(image.get(105, value) && value == 0x51, "RolandImage: get");
+  ok &= check(image.has(90, 30) && !image.has(89, 2) && !image.has(110, 11),
+   "RolandImage: has");
+  ok &= check(!image.get(120, value), "RolandImage: missing address");
+  ok &= check(RolandImage::linear(0x010203) == ((1 << 14) | (2 << 7) | 3),
+   "RolandImage: linear");
+  return ok;
+}
+
+static bool run_checks()
+{
+  bool ok = true;
+  ok &= test_it214<8>();
+  ok &= test_it214<16>();
+  ok &= test_event_append();
+  ok &= test_journal();
+  ok &= test_program_changes();
+  ok &= test_sysex_parser();
+  ok &= test_roland_image();
+  return ok;
+}
 
 int main(int argc, char **argv)
 {
   ConfigContext ctx{};
 
+  if(!run_checks())
+    return 1;
+
   if(!ctx.init(argc, argv))
     return 1;
 